@@ -0,0 +1,61 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014 The Bitcoin Core developers
+# Copyright (c) 2017-2020 The XDNA Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Time initial block download from local nodes, with the getblocks/inv
+# sync (-headersfirst=0) and with headers-first sync, from one and from
+# two peers, and check that every node ends up on the same tip.
+#
+from test_framework import BitcoinTestFramework
+from util import *
+import time
+
+class HeadersSyncTest(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--blocks", dest="blocks", default=2000, type="int",
+                          help="Length of the chain to sync")
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 4)
+
+    def setup_network(self):
+        self.nodes = []
+        self.is_network_split = False
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-debug=net"]))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-debug=net", "-headersfirst=0"]))
+        self.nodes.append(start_node(2, self.options.tmpdir, ["-debug=net"]))
+        self.nodes.append(start_node(3, self.options.tmpdir, ["-debug=net"]))
+
+    def time_sync(self, node, sources):
+        start = time.time()
+        for source in sources:
+            connect_nodes(self.nodes[node], source)
+        sync_blocks([self.nodes[0], self.nodes[node]])
+        return time.time() - start
+
+    def run_test(self):
+        self.nodes[0].setgenerate(True, self.options.blocks)
+        tip = self.nodes[0].getbestblockhash()
+
+        getblocks_time = self.time_sync(1, [0])
+        headers_time = self.time_sync(2, [0])
+        parallel_time = self.time_sync(3, [0, 1])
+
+        print("Synced %d blocks: getblocks %.2fs, headers-first %.2fs, headers-first from 2 peers %.2fs" %
+              (self.options.blocks, getblocks_time, headers_time, parallel_time))
+        for node in self.nodes:
+            assert_equal(node.getbestblockhash(), tip)
+
+        # New blocks reach the synced nodes as header announcements
+        self.nodes[0].setgenerate(True, 1)
+        sync_blocks(self.nodes)
+        for node in self.nodes:
+            assert_equal(node.getbestblockhash(), self.nodes[0].getbestblockhash())
+
+if __name__ == '__main__':
+    HeadersSyncTest().main()
@@ -11,6 +11,8 @@
 #include "serialize.h"
 #include "streams.h"
 
+SaltedNetAddrHasher::SaltedNetAddrHasher() : salt(GetRandHash()) {}
+
 int CAddrInfo::GetTriedBucket(const uint256& nKey) const
 {
     uint64_t hash1 = (CHashWriter(SER_GETHASH, 0) << nKey << GetKey()).GetHash().GetLow64();
@@ -76,12 +78,12 @@ double CAddrInfo::GetChance(int64_t nNow) const
 
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
-    std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
+    boost::unordered_map<CNetAddr, int, SaltedNetAddrHasher>::iterator it = mapAddr.find(addr);
     if (it == mapAddr.end())
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
+    boost::unordered_map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
     if (it2 != mapInfo.end())
         return &(*it2).second;
     return NULL;
@@ -90,13 +92,14 @@ CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 CAddrInfo* CAddrMan::Create(const CAddress& addr, const CNetAddr& addrSource, int* pnId)
 {
     int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    CAddrInfo& info = mapInfo[nId];
+    info = CAddrInfo(addr, addrSource);
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    info.nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &info;
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -109,27 +112,91 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
+    boost::unordered_map<int, CAddrInfo>::iterator it1 = mapInfo.find(nId1);
+    boost::unordered_map<int, CAddrInfo>::iterator it2 = mapInfo.find(nId2);
+    assert(it1 != mapInfo.end());
+    assert(it2 != mapInfo.end());
 
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    it1->second.nRandomPos = nRndPos2;
+    it2->second.nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
 }
 
+void CAddrMan::SetNew(int nUBucket, int nUBucketPos, int nId)
+{
+    assert(vvNew[nUBucket][nUBucketPos] == -1);
+    boost::unordered_map<int, CAddrInfo>::iterator it = mapInfo.find(nId);
+    assert(it != mapInfo.end());
+    CAddrInfo& info = it->second;
+    assert(info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS);
+
+    int nSlot = nUBucket * ADDRMAN_BUCKET_SIZE + nUBucketPos;
+    info.vNewSlots[info.nRefCount++] = nSlot;
+    vvNew[nUBucket][nUBucketPos] = nId;
+    vvNewUsedPos[nUBucket][nUBucketPos] = vNewUsed.size();
+    vNewUsed.push_back(nSlot);
+}
+
+void CAddrMan::UnsetNew(int nUBucket, int nUBucketPos)
+{
+    int nId = vvNew[nUBucket][nUBucketPos];
+    assert(nId != -1);
+    boost::unordered_map<int, CAddrInfo>::iterator it = mapInfo.find(nId);
+    assert(it != mapInfo.end());
+    CAddrInfo& info = it->second;
+
+    int nSlot = nUBucket * ADDRMAN_BUCKET_SIZE + nUBucketPos;
+    int n = 0;
+    while (n < info.nRefCount && info.vNewSlots[n] != nSlot)
+        n++;
+    assert(n < info.nRefCount);
+    info.vNewSlots[n] = info.vNewSlots[--info.nRefCount];
+    vvNew[nUBucket][nUBucketPos] = -1;
+
+    // Move the last occupied slot into the freed place in vNewUsed
+    int nPos = vvNewUsedPos[nUBucket][nUBucketPos];
+    int nLast = vNewUsed.back();
+    vNewUsed[nPos] = nLast;
+    vvNewUsedPos[nLast / ADDRMAN_BUCKET_SIZE][nLast % ADDRMAN_BUCKET_SIZE] = nPos;
+    vNewUsed.pop_back();
+    vvNewUsedPos[nUBucket][nUBucketPos] = -1;
+}
+
+void CAddrMan::SetTried(int nKBucket, int nKBucketPos, int nId)
+{
+    assert(vvTried[nKBucket][nKBucketPos] == -1);
+    vvTried[nKBucket][nKBucketPos] = nId;
+    vvTriedUsedPos[nKBucket][nKBucketPos] = vTriedUsed.size();
+    vTriedUsed.push_back(nKBucket * ADDRMAN_BUCKET_SIZE + nKBucketPos);
+}
+
+void CAddrMan::UnsetTried(int nKBucket, int nKBucketPos)
+{
+    assert(vvTried[nKBucket][nKBucketPos] != -1);
+    vvTried[nKBucket][nKBucketPos] = -1;
+
+    int nPos = vvTriedUsedPos[nKBucket][nKBucketPos];
+    int nLast = vTriedUsed.back();
+    vTriedUsed[nPos] = nLast;
+    vvTriedUsedPos[nLast / ADDRMAN_BUCKET_SIZE][nLast % ADDRMAN_BUCKET_SIZE] = nPos;
+    vTriedUsed.pop_back();
+    vvTriedUsedPos[nKBucket][nKBucketPos] = -1;
+}
+
 void CAddrMan::Delete(int nId)
 {
-    assert(mapInfo.count(nId) != 0);
-    CAddrInfo& info = mapInfo[nId];
+    boost::unordered_map<int, CAddrInfo>::iterator it = mapInfo.find(nId);
+    assert(it != mapInfo.end());
+    CAddrInfo& info = it->second;
     assert(!info.fInTried);
     assert(info.nRefCount == 0);
 
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
     mapAddr.erase(info);
-    mapInfo.erase(nId);
+    mapInfo.erase(it);
     nNew--;
 }
 
@@ -138,11 +205,8 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
     // if there is an entry in the specified bucket, delete it.
     if (vvNew[nUBucket][nUBucketPos] != -1) {
         int nIdDelete = vvNew[nUBucket][nUBucketPos];
-        CAddrInfo& infoDelete = mapInfo[nIdDelete];
-        assert(infoDelete.nRefCount > 0);
-        infoDelete.nRefCount--;
-        vvNew[nUBucket][nUBucketPos] = -1;
-        if (infoDelete.nRefCount == 0) {
+        UnsetNew(nUBucket, nUBucketPos);
+        if (mapInfo[nIdDelete].nRefCount == 0) {
             Delete(nIdDelete);
         }
     }
@@ -151,12 +215,9 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
 void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 {
     // remove the entry from all new buckets
-    for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
-        int pos = info.GetBucketPosition(nKey, true, bucket);
-        if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
-            info.nRefCount--;
-        }
+    while (info.nRefCount > 0) {
+        int nSlot = info.vNewSlots[0];
+        UnsetNew(nSlot / ADDRMAN_BUCKET_SIZE, nSlot % ADDRMAN_BUCKET_SIZE);
     }
     nNew--;
 
@@ -175,7 +236,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
-        vvTried[nKBucket][nKBucketPos] = -1;
+        UnsetTried(nKBucket, nKBucketPos);
         nTried--;
 
         // find which new bucket it belongs to
@@ -185,13 +246,12 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
         assert(vvNew[nUBucket][nUBucketPos] == -1);
 
         // Enter it into the new set again.
-        infoOld.nRefCount = 1;
-        vvNew[nUBucket][nUBucketPos] = nIdEvict;
+        assert(infoOld.nRefCount == 0);
+        SetNew(nUBucket, nUBucketPos, nIdEvict);
         nNew++;
     }
-    assert(vvTried[nKBucket][nKBucketPos] == -1);
 
-    vvTried[nKBucket][nKBucketPos] = nId;
+    SetTried(nKBucket, nKBucketPos, nId);
     nTried++;
     info.fInTried = true;
 }
@@ -222,21 +282,9 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     if (info.fInTried)
         return;
 
-    // find a bucket it is in now
-    int nRnd = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
-    int nUBucket = -1;
-    for (unsigned int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
-        int nB = (n + nRnd) % ADDRMAN_NEW_BUCKET_COUNT;
-        int nBpos = info.GetBucketPosition(nKey, true, nB);
-        if (vvNew[nB][nBpos] == nId) {
-            nUBucket = nB;
-            break;
-        }
-    }
-
-    // if no bucket is found, something bad happened;
+    // if it is in no new bucket, something bad happened;
     // TODO: maybe re-add the node, but for now, just bail out
-    if (nUBucket == -1)
+    if (info.nRefCount == 0)
         return;
 
     LogPrint("addrman", "Moving %s to tried\n", addr.ToString());
@@ -302,8 +350,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         }
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
-            pinfo->nRefCount++;
-            vvNew[nUBucket][nUBucketPos] = nId;
+            SetNew(nUBucket, nUBucketPos, nId);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -338,49 +385,44 @@ CAddress CAddrMan::Select_()
         return CAddress();
 
     // Use a 50% chance for choosing between tried and new table entries.
+    // Drawing from the occupied slots is the same as probing random positions until one is occupied.
+    int64_t nNow = GetAdjustedTime();
     if (nTried > 0 && (nNew == 0 || GetRandInt(2) == 0)) {
         // use a tried node
         double fChanceFactor = 1.0;
         while (1) {
-            int nKBucket = GetRandInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
-            if (vvTried[nKBucket][nKBucketPos] == -1)
-                continue;
-            int nId = vvTried[nKBucket][nKBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
-                return info;
+            int nSlot = vTriedUsed[GetRandInt(vTriedUsed.size())];
+            int nId = vvTried[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE];
+            boost::unordered_map<int, CAddrInfo>::iterator it = mapInfo.find(nId);
+            assert(it != mapInfo.end());
+            if (GetRandInt(1 << 30) < fChanceFactor * it->second.GetChance(nNow) * (1 << 30))
+                return it->second;
             fChanceFactor *= 1.2;
         }
     } else {
         // use a new node
         double fChanceFactor = 1.0;
         while (1) {
-            int nUBucket = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
-            if (vvNew[nUBucket][nUBucketPos] == -1)
-                continue;
-            int nId = vvNew[nUBucket][nUBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
-                return info;
+            int nSlot = vNewUsed[GetRandInt(vNewUsed.size())];
+            int nId = vvNew[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE];
+            boost::unordered_map<int, CAddrInfo>::iterator it = mapInfo.find(nId);
+            assert(it != mapInfo.end());
+            if (GetRandInt(1 << 30) < fChanceFactor * it->second.GetChance(nNow) * (1 << 30))
+                return it->second;
             fChanceFactor *= 1.2;
         }
     }
 }
 
-#ifdef DEBUG_ADDRMAN
 int CAddrMan::Check_()
 {
     std::set<int> setTried;
     std::map<int, int> mapNew;
 
-    if (vRandom.size() != nTried + nNew)
+    if ((int)vRandom.size() != nTried + nNew)
         return -7;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+    for (boost::unordered_map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
         int n = (*it).first;
         CAddrInfo& info = (*it).second;
         if (info.fInTried) {
@@ -398,7 +440,7 @@ int CAddrMan::Check_()
         }
         if (mapAddr[info] != n)
             return -5;
-        if (info.nRandomPos < 0 || info.nRandomPos >= vRandom.size() || vRandom[info.nRandomPos] != n)
+        if (info.nRandomPos < 0 || info.nRandomPos >= (int)vRandom.size() || vRandom[info.nRandomPos] != n)
             return -14;
         if (info.nLastTry < 0)
             return -6;
@@ -406,10 +448,21 @@ int CAddrMan::Check_()
             return -8;
     }
 
-    if (setTried.size() != nTried)
+    if ((int)setTried.size() != nTried)
         return -9;
-    if (mapNew.size() != nNew)
+    if ((int)mapNew.size() != nNew)
         return -10;
+    if ((int)vTriedUsed.size() != nTried)
+        return -20;
+
+    for (unsigned int n = 0; n < vTriedUsed.size(); n++) {
+        if (vvTriedUsedPos[vTriedUsed[n] / ADDRMAN_BUCKET_SIZE][vTriedUsed[n] % ADDRMAN_BUCKET_SIZE] != (int)n)
+            return -21;
+    }
+    for (unsigned int n = 0; n < vNewUsed.size(); n++) {
+        if (vvNewUsedPos[vNewUsed[n] / ADDRMAN_BUCKET_SIZE][vNewUsed[n] % ADDRMAN_BUCKET_SIZE] != (int)n)
+            return -22;
+    }
 
     for (int n = 0; n < ADDRMAN_TRIED_BUCKET_COUNT; n++) {
         for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
@@ -427,6 +480,8 @@ int CAddrMan::Check_()
 
     for (int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
         for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
+            if ((vvNew[n][i] != -1) != (vvNewUsedPos[n][i] != -1))
+                return -23;
             if (vvNew[n][i] != -1) {
                 if (!mapNew.count(vvNew[n][i]))
                     return -12;
@@ -447,7 +502,6 @@ int CAddrMan::Check_()
 
     return 0;
 }
-#endif
 
 void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr)
 {
@@ -17,6 +17,72 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
+/** Stochastic address manager
+ *
+ * Design goals:
+ *  * Keep the address tables in-memory, and asynchronously dump the entire table to peers.dat.
+ *  * Make sure no (localized) attacker can fill the entire table with his nodes/addresses.
+ *
+ * To that end:
+ *  * Addresses are organized into buckets.
+ *    * Address that have not yet been tried go into 1024 "new" buckets.
+ *      * Based on the address range (/16 for IPv4) of source of the information, 64 buckets are selected at random
+ *      * The actual bucket is chosen from one of these, based on the range the address itself is located.
+ *      * One single address can occur in up to 8 different buckets, to increase selection chances for addresses that
+ *        are seen frequently. The chance for increasing this multiplicity decreases exponentially.
+ *      * When adding a new address to a full bucket, a randomly chosen entry (with a bias favoring less recently seen
+ *        ones) is removed from it first.
+ *    * Addresses of nodes that are known to be accessible go into 256 "tried" buckets.
+ *      * Each address range selects at random 8 of these buckets.
+ *      * The actual bucket is chosen from one of these, based on the full address.
+ *      * When adding a new good address to a full bucket, a randomly chosen entry (with a bias favoring less recently
+ *        tried ones) is evicted from it, back to the "new" buckets.
+ *    * Bucket selection is based on cryptographic hashing, using a randomly-generated 256-bit key, which should not
+ *      be observable by adversaries.
+ *    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
+ *      consistency checks for the entire data structure.
+ *    * The occupied slots of each table are also listed densely, so an entry can be selected without probing
+ *      empty positions.
+ */
+
+//! total number of buckets for tried addresses
+#define ADDRMAN_TRIED_BUCKET_COUNT 256
+
+//! total number of buckets for new addresses
+#define ADDRMAN_NEW_BUCKET_COUNT 1024
+
+//! maximum allowed number of entries in buckets for new and tried addresses
+#define ADDRMAN_BUCKET_SIZE 64
+
+//! over how many buckets entries with tried addresses from a single group (/16 for IPv4) are spread
+#define ADDRMAN_TRIED_BUCKETS_PER_GROUP 8
+
+//! over how many buckets entries with new addresses originating from a single group are spread
+#define ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP 64
+
+//! in how many buckets for entries with new addresses a single address may occur
+#define ADDRMAN_NEW_BUCKETS_PER_ADDRESS 8
+
+//! how old addresses can maximally be
+#define ADDRMAN_HORIZON_DAYS 30
+
+//! after how many failed attempts we give up on a new node
+#define ADDRMAN_RETRIES 3
+
+//! how many successive failures are allowed ...
+#define ADDRMAN_MAX_FAILURES 10
+
+//! ... in at least this many days
+#define ADDRMAN_MIN_FAIL_DAYS 7
+
+//! the maximum percentage of nodes to return in a getaddr call
+#define ADDRMAN_GETADDR_MAX_PCT 23
+
+//! the maximum number of nodes to return in a getaddr call
+#define ADDRMAN_GETADDR_MAX 2500
+
 /** 
  * Extended statistics about a CAddress 
  */
@@ -50,6 +116,9 @@ private:
     //! position in vRandom
     int nRandomPos;
 
+    //! the nRefCount "new" slots (bucket * ADDRMAN_BUCKET_SIZE + position) holding this entry (memory only)
+    int vNewSlots[ADDRMAN_NEW_BUCKETS_PER_ADDRESS];
+
     friend class CAddrMan;
 
 public:
@@ -72,6 +141,7 @@ public:
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
+        memset(vNewSlots, -1, sizeof(vNewSlots));
     }
 
     CAddrInfo(const CAddress& addrIn, const CNetAddr& addrSource) : CAddress(addrIn), source(addrSource)
@@ -106,67 +176,23 @@ public:
     double GetChance(int64_t nNow = GetAdjustedTime()) const;
 };
 
-/** Stochastic address manager
- *
- * Design goals:
- *  * Keep the address tables in-memory, and asynchronously dump the entire table to peers.dat.
- *  * Make sure no (localized) attacker can fill the entire table with his nodes/addresses.
- *
- * To that end:
- *  * Addresses are organized into buckets.
- *    * Address that have not yet been tried go into 1024 "new" buckets.
- *      * Based on the address range (/16 for IPv4) of source of the information, 64 buckets are selected at random
- *      * The actual bucket is chosen from one of these, based on the range the address itself is located.
- *      * One single address can occur in up to 8 different buckets, to increase selection chances for addresses that
- *        are seen frequently. The chance for increasing this multiplicity decreases exponentially.
- *      * When adding a new address to a full bucket, a randomly chosen entry (with a bias favoring less recently seen
- *        ones) is removed from it first.
- *    * Addresses of nodes that are known to be accessible go into 256 "tried" buckets.
- *      * Each address range selects at random 8 of these buckets.
- *      * The actual bucket is chosen from one of these, based on the full address.
- *      * When adding a new good address to a full bucket, a randomly chosen entry (with a bias favoring less recently
- *        tried ones) is evicted from it, back to the "new" buckets.
- *    * Bucket selection is based on cryptographic hashing, using a randomly-generated 256-bit key, which should not
- *      be observable by adversaries.
- *    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
- *      consistency checks for the entire data structure.
- */
-
-//! total number of buckets for tried addresses
-#define ADDRMAN_TRIED_BUCKET_COUNT 256
-
-//! total number of buckets for new addresses
-#define ADDRMAN_NEW_BUCKET_COUNT 1024
-
-//! maximum allowed number of entries in buckets for new and tried addresses
-#define ADDRMAN_BUCKET_SIZE 64
-
-//! over how many buckets entries with tried addresses from a single group (/16 for IPv4) are spread
-#define ADDRMAN_TRIED_BUCKETS_PER_GROUP 8
-
-//! over how many buckets entries with new addresses originating from a single group are spread
-#define ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP 64
-
-//! in how many buckets for entries with new addresses a single address may occur
-#define ADDRMAN_NEW_BUCKETS_PER_ADDRESS 8
-
-//! how old addresses can maximally be
-#define ADDRMAN_HORIZON_DAYS 30
-
-//! after how many failed attempts we give up on a new node
-#define ADDRMAN_RETRIES 3
-
-//! how many successive failures are allowed ...
-#define ADDRMAN_MAX_FAILURES 10
-
-//! ... in at least this many days
-#define ADDRMAN_MIN_FAIL_DAYS 7
+/** Salted hash of the address bytes, to index addresses in a hash map */
+class SaltedNetAddrHasher
+{
+private:
+    uint256 salt;
 
-//! the maximum percentage of nodes to return in a getaddr call
-#define ADDRMAN_GETADDR_MAX_PCT 23
+public:
+    SaltedNetAddrHasher();
 
-//! the maximum number of nodes to return in a getaddr call
-#define ADDRMAN_GETADDR_MAX 2500
+    size_t operator()(const CNetAddr& addr) const
+    {
+        uint256 key;
+        for (int i = 0; i < 16; i++)
+            key.begin()[i] = addr.GetByte(i);
+        return key.GetHash(salt);
+    }
+};
 
 /** 
  * Stochastical (IP) address manager 
@@ -181,10 +207,10 @@ private:
     int nIdCount;
 
     //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    boost::unordered_map<int, CAddrInfo> mapInfo;
 
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    boost::unordered_map<CNetAddr, int, SaltedNetAddrHasher> mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -195,12 +221,24 @@ private:
     //! list of "tried" buckets
     int vvTried[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! occupied "tried" slots (bucket * ADDRMAN_BUCKET_SIZE + position), in no particular order
+    std::vector<int> vTriedUsed;
+
+    //! position of each "tried" slot in vTriedUsed, or -1 if it is empty
+    int vvTriedUsedPos[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+
     //! number of (unique) "new" entries
     int nNew;
 
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! occupied "new" slots, in no particular order
+    std::vector<int> vNewUsed;
+
+    //! position of each "new" slot in vNewUsed, or -1 if it is empty
+    int vvNewUsedPos[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+
 protected:
     //! secret key to randomize bucket select with
     uint256 nKey;
@@ -215,6 +253,18 @@ protected:
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
+    //! Put nId in an empty "new" slot, adding a reference to it.
+    void SetNew(int nUBucket, int nUBucketPos, int nId);
+
+    //! Empty an occupied "new" slot, dropping the reference its entry had there.
+    void UnsetNew(int nUBucket, int nUBucketPos);
+
+    //! Put nId in an empty "tried" slot.
+    void SetTried(int nKBucket, int nKBucketPos, int nId);
+
+    //! Empty an occupied "tried" slot.
+    void UnsetTried(int nKBucket, int nKBucketPos);
+
     //! Move an entry from the "new" table(s) to the "tried" table
     void MakeTried(CAddrInfo& info, int nId);
 
@@ -237,10 +287,8 @@ protected:
     //! nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
     CAddress Select_();
 
-#ifdef DEBUG_ADDRMAN
     //! Perform consistency check. Returns an error code or zero.
     int Check_();
-#endif
 
     //! Select several addresses at once.
     void GetAddr_(std::vector<CAddress>& vAddr);
@@ -292,9 +340,9 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        boost::unordered_map<int, int> mapUnkIds;
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+        for (boost::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
             mapUnkIds[(*it).first] = nIds;
             const CAddrInfo& info = (*it).second;
             if (info.nRefCount) {
@@ -304,7 +352,7 @@ public:
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+        for (boost::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
             const CAddrInfo& info = (*it).second;
             if (info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
@@ -361,10 +409,8 @@ public:
                 // immediately try to give them a reference based on their primary source address.
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
-                if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
-                    info.nRefCount++;
-                }
+                if (vvNew[nUBucket][nUBucketPos] == -1)
+                    SetNew(nUBucket, nUBucketPos, n);
             }
         }
         nIdCount = nNew;
@@ -382,7 +428,7 @@ public:
                 vRandom.push_back(nIdCount);
                 mapInfo[nIdCount] = info;
                 mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
+                SetTried(nKBucket, nKBucketPos, nIdCount);
                 nIdCount++;
             } else {
                 nLost++;
@@ -400,19 +446,17 @@ public:
                 if (nIndex >= 0 && nIndex < nNew) {
                     CAddrInfo& info = mapInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
-                    if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
-                        info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
-                    }
+                    if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
+                        SetNew(bucket, nUBucketPos, nIndex);
                 }
             }
         }
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end();) {
+        for (boost::unordered_map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end();) {
             if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
+                boost::unordered_map<int, CAddrInfo>::const_iterator itCopy = it++;
                 Delete(itCopy->first);
                 nLostUnk++;
             } else {
@@ -434,15 +478,21 @@ public:
     void Clear()
     {
         std::vector<int>().swap(vRandom);
+        std::vector<int>().swap(vNewUsed);
+        std::vector<int>().swap(vTriedUsed);
+        mapInfo.clear();
+        mapAddr.clear();
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvNew[bucket][entry] = -1;
+                vvNewUsedPos[bucket][entry] = -1;
             }
         }
         for (size_t bucket = 0; bucket < ADDRMAN_TRIED_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvTried[bucket][entry] = -1;
+                vvTriedUsedPos[bucket][entry] = -1;
             }
         }
 
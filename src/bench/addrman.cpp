@@ -0,0 +1,107 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "addrman.h"
+#include "random.h"
+
+#include <vector>
+
+// Add, Select, Good and GetAddr against address managers holding 10k and
+// 100k addresses, learned from 1000 different source groups.
+
+static const int NUM_SOURCES = 1000;
+
+static std::vector<CAddress> vAddresses;
+static std::vector<CNetAddr> vSources;
+
+static CNetAddr RandomIPv4()
+{
+    struct in_addr ip;
+    do {
+        // Routable addresses only: 11.x.x.x to 110.x.x.x
+        uint32_t n = 0x0b000000 + GetRand(100 << 24);
+        ip.s_addr = htonl(n);
+    } while (!CNetAddr(ip).IsRoutable());
+    return CNetAddr(ip);
+}
+
+static void SetupAddresses(int nCount)
+{
+    if (vSources.empty()) {
+        for (int i = 0; i < NUM_SOURCES; i++)
+            vSources.push_back(RandomIPv4());
+    }
+    while ((int)vAddresses.size() < nCount) {
+        CAddress addr(CService(RandomIPv4(), 1945), NODE_NETWORK);
+        addr.nTime = GetAdjustedTime() - GetRand(7 * 24 * 60 * 60);
+        vAddresses.push_back(addr);
+    }
+}
+
+static void FillAddrMan(CAddrMan& addrman, int nCount)
+{
+    SetupAddresses(nCount);
+    for (int i = 0; i < nCount; i++)
+        addrman.Add(vAddresses[i], vSources[i % NUM_SOURCES]);
+    // Move a tenth of them to the tried table
+    for (int i = 0; i < nCount; i += 10)
+        addrman.Good(vAddresses[i]);
+}
+
+static void AddrManAdd(benchmark::State& state)
+{
+    SetupAddresses(10000);
+    while (state.KeepRunning()) {
+        CAddrMan addrman;
+        for (int i = 0; i < 10000; i++)
+            addrman.Add(vAddresses[i], vSources[i % NUM_SOURCES]);
+    }
+}
+
+static void AddrManSelect(benchmark::State& state, int nCount)
+{
+    CAddrMan addrman;
+    FillAddrMan(addrman, nCount);
+    while (state.KeepRunning()) {
+        CAddress addr = addrman.Select();
+        assert(addr.GetPort() != 0);
+    }
+}
+
+static void AddrManSelect10k(benchmark::State& state) { AddrManSelect(state, 10000); }
+static void AddrManSelect100k(benchmark::State& state) { AddrManSelect(state, 100000); }
+
+static void AddrManGood(benchmark::State& state)
+{
+    SetupAddresses(10000);
+    while (state.KeepRunning()) {
+        CAddrMan addrman;
+        for (int i = 0; i < 10000; i++)
+            addrman.Add(vAddresses[i], vSources[i % NUM_SOURCES]);
+        for (int i = 0; i < 10000; i++)
+            addrman.Good(vAddresses[i]);
+    }
+}
+
+static void AddrManGetAddr(benchmark::State& state, int nCount)
+{
+    CAddrMan addrman;
+    FillAddrMan(addrman, nCount);
+    while (state.KeepRunning()) {
+        std::vector<CAddress> vAddr = addrman.GetAddr();
+        assert(!vAddr.empty());
+    }
+}
+
+static void AddrManGetAddr10k(benchmark::State& state) { AddrManGetAddr(state, 10000); }
+static void AddrManGetAddr100k(benchmark::State& state) { AddrManGetAddr(state, 100000); }
+
+BENCHMARK(AddrManAdd);
+BENCHMARK(AddrManSelect10k);
+BENCHMARK(AddrManSelect100k);
+BENCHMARK(AddrManGood);
+BENCHMARK(AddrManGetAddr10k);
+BENCHMARK(AddrManGetAddr100k);
@@ -0,0 +1,18 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/sha256.h"
+#include "util.h"
+
+int main(int argc, char** argv)
+{
+    SHA256AutoDetect();
+    SetupEnvironment();
+    fPrintToDebugLog = false; // don't want to write to debug.log file
+
+    benchmark::BenchRunner::RunAll();
+}
@@ -0,0 +1,44 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+// Hash one merkle level of 1000 nodes: pairwise through CHash256, which is
+// what merkle building did before, and in one batch through SHA256D64.
+
+static void SetupLeaves(std::vector<uint256>& leaves)
+{
+    leaves.resize(1000);
+    for (unsigned int i = 0; i < leaves.size(); i++)
+        GetRandBytes(leaves[i].begin(), 32);
+}
+
+static void MerkleLevelPairwise(benchmark::State& state)
+{
+    std::vector<uint256> leaves, level(500);
+    SetupLeaves(leaves);
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < level.size(); i++)
+            level[i] = Hash(leaves[2 * i].begin(), leaves[2 * i].end(), leaves[2 * i + 1].begin(), leaves[2 * i + 1].end());
+    }
+}
+
+static void MerkleLevelSHA256D64(benchmark::State& state)
+{
+    std::vector<uint256> leaves, level(500);
+    SetupLeaves(leaves);
+    while (state.KeepRunning()) {
+        SHA256D64(level[0].begin(), leaves[0].begin(), level.size());
+    }
+}
+
+BENCHMARK(MerkleLevelPairwise);
+BENCHMARK(MerkleLevelSHA256D64);
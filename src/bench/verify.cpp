@@ -0,0 +1,64 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hash.h"
+#include "key.h"
+#include "pubkey.h"
+#include "uint256.h"
+
+#ifndef USE_SECP256K1
+#include "ecwrapper.h"
+#endif
+
+#include <vector>
+
+// Verify the same key over and over, like masternode, spork and staking keys.
+// VerifyFreshKey parses the public key on every call, which is what
+// CPubKey::Verify did before the shared verifier; VerifyCachedKey goes
+// through CPubKey::Verify and its cache of parsed keys.
+
+static void SetupSignature(CPubKey& pubkey, uint256& hash, std::vector<unsigned char>& vchSig)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    pubkey = key.GetPubKey();
+    hash = Hash(pubkey.begin(), pubkey.end());
+    bool ret = key.Sign(hash, vchSig);
+    assert(ret);
+}
+
+#ifndef USE_SECP256K1
+static void VerifyFreshKey(benchmark::State& state)
+{
+    CPubKey pubkey;
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    SetupSignature(pubkey, hash, vchSig);
+
+    while (state.KeepRunning()) {
+        CECKey key;
+        bool ret = key.SetPubKey(pubkey.begin(), pubkey.size()) && key.Verify(hash, vchSig);
+        assert(ret);
+    }
+}
+
+BENCHMARK(VerifyFreshKey);
+#endif
+
+static void VerifyCachedKey(benchmark::State& state)
+{
+    CPubKey pubkey;
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    SetupSignature(pubkey, hash, vchSig);
+
+    while (state.KeepRunning()) {
+        bool ret = pubkey.Verify(hash, vchSig);
+        assert(ret);
+    }
+}
+
+BENCHMARK(VerifyCachedKey);
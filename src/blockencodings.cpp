@@ -0,0 +1,165 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "random.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <boost/unordered_map.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : header(block.GetBlockHeader()),
+                                                                              vchBlockSig(block.vchBlockSig),
+                                                                              nonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    FillShortTxIDSelector();
+    // Nobody else can have the coinbase or the coinstake, so they always go in full
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    nPrefilled = std::min<unsigned int>(nPrefilled, block.vtx.size());
+    prefilledtxn.resize(nPrefilled);
+    for (unsigned int i = 0; i < nPrefilled; i++) {
+        prefilledtxn[i].index = i;
+        prefilledtxn[i].tx = block.vtx[i];
+    }
+    shorttxids.reserve(block.vtx.size() - nPrefilled);
+    for (unsigned int i = nPrefilled; i < block.vtx.size(); i++)
+        shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << header << nonce;
+    shorttxidsalt = ss.GetHash();
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return txhash.GetHash(shorttxidsalt) & ((uint64_t(1) << (8 * SHORTTXIDS_LENGTH)) - 1);
+}
+
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool, const std::vector<CTransaction>& vExtraTxn)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > std::numeric_limits<uint16_t>::max())
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.resize(cmpctblock.BlockTxCount());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    int32_t nLastPrefilled = -1;
+    for (unsigned int i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const PrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull() || prefilled.index <= nLastPrefilled || prefilled.index >= txn_available.size())
+            return READ_STATUS_INVALID;
+        txn_available[prefilled.index] = prefilled.tx;
+        vHave[prefilled.index] = true;
+        nLastPrefilled = prefilled.index;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Short ids fill the slots the prefilled transactions left, in order
+    boost::unordered_map<uint64_t, uint16_t> mapShortIDs;
+    mapShortIDs.rehash(cmpctblock.shorttxids.size());
+    uint16_t nIndex = 0;
+    for (unsigned int i = 0; i < cmpctblock.shorttxids.size(); i++, nIndex++) {
+        while (vHave[nIndex])
+            nIndex++;
+        // Two transactions in one block sharing a short id: the announcer's
+        // salt was unlucky, so fall back to the full block
+        if (!mapShortIDs.insert(std::make_pair(cmpctblock.shorttxids[i], nIndex)).second)
+            return READ_STATUS_FAILED;
+    }
+
+    // A slot matched twice stays claimed but empty, so it is requested
+    // instead of guessed
+    {
+        LOCK(pool.cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it) {
+            boost::unordered_map<uint64_t, uint16_t>::iterator itID = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (itID == mapShortIDs.end())
+                continue;
+            if (!vHave[itID->second]) {
+                txn_available[itID->second] = it->second.GetTx();
+                vHave[itID->second] = true;
+                mempool_count++;
+            } else if (!txn_available[itID->second].IsNull()) {
+                txn_available[itID->second] = CTransaction();
+                mempool_count--;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < vExtraTxn.size(); i++) {
+        boost::unordered_map<uint64_t, uint16_t>::iterator itID = mapShortIDs.find(cmpctblock.GetShortID(vExtraTxn[i].GetHash()));
+        if (itID == mapShortIDs.end() || vHave[itID->second])
+            continue;
+        txn_available[itID->second] = vExtraTxn[i];
+        vHave[itID->second] = true;
+        extra_count++;
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n",
+        cmpctblock.header.GetHash().ToString(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < txn_available.size());
+    return vHave[index] && !txn_available[index].IsNull();
+}
+
+std::vector<uint16_t> PartiallyDownloadedBlock::GetMissing() const
+{
+    std::vector<uint16_t> vMissing;
+    for (unsigned int i = 0; i < txn_available.size(); i++)
+        if (!IsTxAvailable(i))
+            vMissing.push_back(i);
+    return vMissing;
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vchBlockSig = vchBlockSig;
+    block.vtx.reserve(txn_available.size());
+
+    size_t nMissingOffset = 0;
+    for (unsigned int i = 0; i < txn_available.size(); i++) {
+        if (IsTxAvailable(i)) {
+            block.vtx.push_back(txn_available[i]);
+        } else {
+            if (nMissingOffset >= vtx_missing.size())
+                return READ_STATUS_INVALID;
+            block.vtx.push_back(vtx_missing[nMissingOffset++]);
+        }
+    }
+    // The peer sent more transactions than we asked for
+    if (nMissingOffset != vtx_missing.size())
+        return READ_STATUS_INVALID;
+
+    // A short id collision with a mempool transaction surfaces here as a
+    // merkle root mismatch; that is our failure, not the peer's
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != header.hashMerkleRoot || fMutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool, %lu txn from extra pool and %lu txn requested\n",
+        header.GetHash().ToString(), prefilled_count, mempool_count, extra_count, vtx_missing.size());
+
+    return READ_STATUS_OK;
+}
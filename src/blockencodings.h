@@ -0,0 +1,244 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <ios>
+#include <limits>
+#include <vector>
+
+class CTxMemPool;
+
+/** Version of the compact block encoding announced in "sendcmpct" */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Bytes kept from each salted transaction hash in a compact block */
+static const unsigned int SHORTTXIDS_LENGTH = 6;
+/** Entries allocated at a time while reading compact block encodings */
+static const unsigned int COMPACT_READ_CHUNK = 1000;
+
+/** Transaction indexes encoded as the gap since the previous index, as in "getblocktxn" */
+class CDifferentialIndexes
+{
+protected:
+    std::vector<uint16_t>& indexes;
+
+public:
+    CDifferentialIndexes(std::vector<uint16_t>& indexesIn) : indexes(indexesIn) {}
+
+    unsigned int GetSerializeSize(int, int) const
+    {
+        unsigned int nSize = GetSizeOfCompactSize(indexes.size());
+        for (unsigned int i = 0; i < indexes.size(); i++)
+            nSize += GetSizeOfCompactSize(indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1));
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int, int) const
+    {
+        WriteCompactSize(s, indexes.size());
+        for (unsigned int i = 0; i < indexes.size(); i++)
+            WriteCompactSize(s, indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int, int)
+    {
+        uint64_t nCount = ReadCompactSize(s);
+        if (nCount > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("differential index count too large");
+        // Grow in chunks as entries arrive, so a bogus count can't allocate ahead of the data
+        indexes.clear();
+        uint64_t nNext = 0;
+        unsigned int i = 0;
+        while (i < nCount) {
+            indexes.resize(std::min(nCount, (uint64_t)(i + COMPACT_READ_CHUNK)));
+            for (; i < indexes.size(); i++) {
+                nNext += ReadCompactSize(s);
+                if (nNext > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("differential index overflowed 16 bits");
+                indexes[i] = nNext++;
+            }
+        }
+    }
+};
+
+/** A transaction sent in full inside a compact block, at its absolute index in the block */
+struct PrefilledTransaction {
+    uint16_t index;
+    CTransaction tx;
+};
+
+/**
+ * A block announced as its header plus a short id per transaction ("cmpctblock").
+ *
+ * The coinbase and, for proof-of-stake blocks, the coinstake are always sent
+ * in full, since no peer can have them in its mempool. Short ids are the low
+ * six bytes of the transaction hash, keyed with a salt derived from the header
+ * and a per-announcement nonce, so collisions can't be ground ahead of time.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint256 shorttxidsalt;
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+    uint64_t nonce;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(header);
+        READWRITE(vchBlockSig);
+        READWRITE(nonce);
+
+        uint64_t nShortTxIDs = shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortTxIDs));
+        if (ser_action.ForRead()) {
+            // Transaction indexes are 16 bits, so no valid block has more
+            if (nShortTxIDs > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("too many short txids");
+            shorttxids.clear();
+        }
+        // Reading grows the vector in chunks as ids arrive, so a bogus count
+        // can't allocate ahead of the data
+        unsigned int i = 0;
+        while (i < nShortTxIDs) {
+            if (ser_action.ForRead())
+                shorttxids.resize(std::min(nShortTxIDs, (uint64_t)(i + COMPACT_READ_CHUNK)));
+            for (; i < shorttxids.size(); i++) {
+                uint32_t lsb = shorttxids[i] & 0xffffffff;
+                uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+                READWRITE(lsb);
+                READWRITE(msb);
+                shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+            }
+        }
+
+        // Prefilled indexes go on the wire as the gap since the previous one
+        uint64_t nPrefilled = prefilledtxn.size();
+        READWRITE(COMPACTSIZE(nPrefilled));
+        if (ser_action.ForRead()) {
+            if (nShortTxIDs + nPrefilled > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("too many prefilled transactions");
+            prefilledtxn.clear();
+        }
+        uint64_t nNext = 0;
+        i = 0;
+        while (i < nPrefilled) {
+            if (ser_action.ForRead())
+                prefilledtxn.resize(std::min(nPrefilled, (uint64_t)(i + COMPACT_READ_CHUNK)));
+            for (; i < prefilledtxn.size(); i++) {
+                uint64_t nOffset = prefilledtxn[i].index - nNext;
+                READWRITE(COMPACTSIZE(nOffset));
+                nNext += nOffset;
+                if (nNext > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("prefilled index overflowed 16 bits");
+                prefilledtxn[i].index = nNext++;
+                READWRITE(prefilledtxn[i].tx);
+            }
+        }
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** Request for the transactions of a compact block that couldn't be found locally ("getblocktxn") */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(REF(CDifferentialIndexes(indexes)));
+    }
+};
+
+/** Reply to a BlockTransactionsRequest, in the order requested ("blocktxn") */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+typedef enum ReadStatus_t {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // Invalid object, peer is sending bogus data
+    READ_STATUS_FAILED,  // Failed to process object, fall back to requesting the full block
+} ReadStatus;
+
+/** A block being rebuilt from a compact announcement, the mempool and a "blocktxn" round trip */
+class PartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHave;
+    size_t prefilled_count, mempool_count, extra_count;
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+public:
+    PartiallyDownloadedBlock() : prefilled_count(0), mempool_count(0), extra_count(0) {}
+
+    /** Fill what we can from the announcement, pool and vExtraTxn (e.g. SwiftTX lock requests) */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool, const std::vector<CTransaction>& vExtraTxn);
+    bool IsTxAvailable(size_t index) const;
+    /** Indexes still missing, ready to go into a BlockTransactionsRequest */
+    std::vector<uint16_t> GetMissing() const;
+    /** Complete the block with vtx_missing, in the order GetMissing() returned */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+
+    size_t GetPrefilledCount() const { return prefilled_count; }
+    size_t GetMempoolCount() const { return mempool_count; }
+    size_t GetExtraCount() const { return extra_count; }
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -5,7 +5,9 @@
 #include "bloom.h"
 
 #include "hash.h"
+#include "memusage.h"
 #include "primitives/transaction.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "streams.h"
@@ -13,6 +15,9 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <limits>
+
 #include <boost/foreach.hpp>
 
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
@@ -188,3 +193,88 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    // The ideal number of hash functions is log(fp rate) / log(0.5), kept within the protocol limit
+    nHashFuncs = max(1, min((int)round(logFpRate / log(0.5)), (int)MAX_HASH_FUNCS));
+    // Between two and three generations of nElements / 2 items are in the filter at any time
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    double nMaxElements = nEntriesPerGeneration * 3.0;
+    /**
+     * Size the filter so the fp rate still holds with three full generations:
+     * fpRate = (1 - exp(-nHashFuncs * nMaxElements / nFilterBits)) ^ nHashFuncs
+     * => nFilterBits = -nHashFuncs * nMaxElements / log(1 - exp(log(fpRate) / nHashFuncs))
+     */
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    vData.assign(((nFilterBits + 63) / 64) * 2, 0);
+    reset();
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        // Wipe the positions last set by the generation number being reused
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        for (size_t p = 0; p < vData.size(); p += 2) {
+            uint64_t p1 = vData[p], p2 = vData[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            vData[p] = p1 & mask;
+            vData[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (unsigned int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = MurmurHash3(n * 0xFBA4C795 + nTweak, vKey);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % vData.size();
+        // The lowest bit of pos selects the low or high generation bit, so it is ignored here
+        vData[pos & ~1] = (vData[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        vData[pos | 1] = (vData[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    vector<unsigned char> data(hash.begin(), hash.end());
+    insert(data);
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    for (unsigned int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = MurmurHash3(n * 0xFBA4C795 + nTweak, vKey);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % vData.size();
+        // A position set by no live generation has both of its bits clear
+        if (!(((vData[pos & ~1] | vData[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    vector<unsigned char> data(hash.begin(), hash.end());
+    return contains(data);
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(vData.begin(), vData.end(), 0);
+}
+
+size_t CRollingBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(vData);
+}
@@ -7,6 +7,7 @@
 
 #include "serialize.h"
 
+#include <stdint.h>
 #include <vector>
 
 class COutPoint;
@@ -97,4 +98,41 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive
+ * rate. Unlike CBloomFilter, it is never sent over the wire.
+ *
+ * The filter holds three generations of nElements / 2 items each. Once a
+ * generation fills up, the oldest one is wiped and reused, so contains(item)
+ * always returns true for the last nElements / 2 items inserted and usually
+ * for up to 1.5 * nElements. Memory is allocated once, at construction: two
+ * bits per filter position, which record the generation that last set it.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    //! Forget every item and pick a new hash tweak
+    void reset();
+
+    //! Heap memory used by the filter, in bytes
+    size_t DynamicMemoryUsage() const;
+
+private:
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    unsigned int nGeneration;
+    //! Filter position P is bit (P & 63) of vData[(P >> 6) * 2] (low generation bit) and vData[(P >> 6) * 2 + 1] (high bit)
+    std::vector<uint64_t> vData;
+    unsigned int nTweak;
+    unsigned int nHashFuncs;
+};
+
 #endif // BITCOIN_BLOOM_H
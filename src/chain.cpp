@@ -5,8 +5,59 @@
 
 #include "chain.h"
 
+#include <algorithm>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+
 using namespace std;
 
+/**
+ * CBlockIndexArena implementation
+ */
+
+// The fields read while walking the index must fit in the first cache line of an entry.
+static_assert(offsetof(CBlockIndex, nChainWork) + sizeof(uint256) <= 64, "CBlockIndex walk fields don't fit in one cache line");
+
+void CBlockIndexArena::NewBlock(size_t nBlockEntries)
+{
+    Block block;
+    block.pMemory = ::operator new(nBlockEntries * ENTRY_STRIDE + CACHE_LINE_SIZE - 1);
+    uintptr_t nAddress = reinterpret_cast<uintptr_t>(block.pMemory);
+    block.pBegin = static_cast<char*>(block.pMemory) + (CACHE_LINE_SIZE - nAddress % CACHE_LINE_SIZE) % CACHE_LINE_SIZE;
+    block.nUsed = 0;
+    vBlocks.push_back(block);
+    nCapacity = nBlockEntries;
+}
+
+void CBlockIndexArena::Reserve(size_t nReserve)
+{
+    if (vBlocks.empty() || nCapacity - vBlocks.back().nUsed < nReserve)
+        NewBlock(std::max(nReserve, (size_t)BLOCK_ENTRIES));
+}
+
+CBlockIndex* CBlockIndexArena::Allocate(const CBlockIndex& index)
+{
+    if (vBlocks.empty() || vBlocks.back().nUsed == nCapacity)
+        NewBlock(BLOCK_ENTRIES);
+    CBlockIndex* pindex = new (vBlocks.back().Entry(vBlocks.back().nUsed)) CBlockIndex(index);
+    vBlocks.back().nUsed++;
+    nEntries++;
+    return pindex;
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        for (size_t j = 0; j < vBlocks[i].nUsed; j++)
+            vBlocks[i].Entry(j)->~CBlockIndex();
+        ::operator delete(vBlocks[i].pMemory);
+    }
+    vBlocks.clear();
+    nCapacity = 0;
+    nEntries = 0;
+}
+
 /**
  * CChain implementation
  */
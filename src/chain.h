@@ -108,24 +108,40 @@ enum BlockStatus {
 class CBlockIndex
 {
 public:
-    //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
-    const uint256* phashBlock;
+    // The fields used while walking the index (GetAncestor, LastCommonAncestor,
+    // FindMostWorkChain and the work comparator) come first, so they share the
+    // first cache line of the entry; CBlockIndexArena aligns entries to cache
+    // lines. Header and proof-of-stake fields follow.
 
     //! pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    //! pointer to the index of the next block
-    CBlockIndex* pnext;
-
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
+    //! Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
+
+    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
+    uint32_t nSequenceId;
+
+    //! (memory only) Number of transactions in the chain up to and including this block.
+    //! This value will be non-zero only if and only if transactions for this block and all its parents are available.
+    //! Change to 64-bit type when necessary; won't happen before 2030
+    unsigned int nChainTx;
+
+    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    uint256 nChainWork;
+
+    //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
+    const uint256* phashBlock;
+
+    //! pointer to the index of the next block
+    CBlockIndex* pnext;
+
     //! Which # file this block is stored in (blk?????.dat)
     int nFile;
 
@@ -135,20 +151,16 @@ public:
     //! Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    uint256 nChainWork;
-
     //! Number of transactions in this block.
     //! Note: in a potential headers-first mode, this number cannot be relied upon
     unsigned int nTx;
 
-    //! (memory only) Number of transactions in the chain up to and including this block.
-    //! This value will be non-zero only if and only if transactions for this block and all its parents are available.
-    //! Change to 64-bit type when necessary; won't happen before 2030
-    unsigned int nChainTx;
-
-    //! Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
+    //! block header
+    int nVersion;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    uint256 hashMerkleRoot;
 
     unsigned int nFlags; // ppcoin: block index flags
     enum {
@@ -159,28 +171,19 @@ public:
 
     // proof-of-stake specific fields
     uint256 GetBlockTrust() const;
-    uint64_t nStakeModifier;             // hash modifier for proof-of-stake
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
-    COutPoint prevoutStake;
-    unsigned int nStakeTime;
-    uint256 hashProofOfStake;
+    uint64_t nStakeModifier;             // hash modifier for proof-of-stake
     int64_t nMint;
     int64_t nMoneySupply;
-
-    //! block header
-    int nVersion;
-    uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
-    unsigned int nNonce;
-
-    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
-    uint32_t nSequenceId;
+    unsigned int nStakeTime;
+    COutPoint prevoutStake;
+    uint256 hashProofOfStake;
 
     void SetNull()
     {
         phashBlock = NULL;
         pprev = NULL;
+        pnext = NULL;
         pskip = NULL;
         nHeight = 0;
         nFile = 0;
@@ -223,7 +226,6 @@ public:
         nNonce = block.nNonce;
 
         //Proof of Stake
-        bnChainTrust = uint256();
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -475,6 +477,60 @@ public:
     }
 };
 
+/**
+ * Owns the CBlockIndex entries of mapBlockIndex. Entries are carved out of
+ * large contiguous blocks instead of being allocated one by one, which saves
+ * the per-allocation overhead and keeps entries created together (the whole
+ * index at startup, in height order) next to each other in memory. Each
+ * entry starts on a cache line, so the fields CBlockIndex puts first share
+ * one. Entries are never freed individually; Clear() releases all of them at
+ * once.
+ */
+class CBlockIndexArena
+{
+private:
+    //! Entries per block when no larger reservation was asked for
+    static const size_t BLOCK_ENTRIES = 4096;
+    static const size_t CACHE_LINE_SIZE = 64;
+    //! Distance between entries: sizeof(CBlockIndex) rounded up to whole cache lines
+    static const size_t ENTRY_STRIDE = (sizeof(CBlockIndex) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+    struct Block {
+        //! Memory as allocated, and its first cache line aligned address where entries start
+        void* pMemory;
+        char* pBegin;
+        //! Number of entries constructed
+        size_t nUsed;
+
+        CBlockIndex* Entry(size_t i) const { return reinterpret_cast<CBlockIndex*>(pBegin + i * ENTRY_STRIDE); }
+    };
+
+    std::vector<Block> vBlocks;
+    //! Capacity of the last block
+    size_t nCapacity;
+    size_t nEntries;
+
+    void NewBlock(size_t nBlockEntries);
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+
+public:
+    CBlockIndexArena() : nCapacity(0), nEntries(0) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    //! Make sure the next nReserve entries are allocated from one contiguous block
+    void Reserve(size_t nReserve);
+
+    //! Construct a copy of index in the arena
+    CBlockIndex* Allocate(const CBlockIndex& index);
+
+    //! Destroy all entries and release their memory
+    void Clear();
+
+    size_t Size() const { return nEntries; }
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain
 {
@@ -176,6 +176,14 @@ CECKey::CECKey()
     assert(pkey != NULL);
 }
 
+CECKey::CECKey(const EC_GROUP* group)
+{
+    pkey = EC_KEY_new();
+    assert(pkey != NULL);
+    int ret = EC_KEY_set_group(pkey, group);
+    assert(ret);
+}
+
 CECKey::~CECKey()
 {
     EC_KEY_free(pkey);
@@ -279,6 +287,70 @@ bool CECKey::TweakPublic(const unsigned char vchTweak[32])
     return ret;
 }
 
+CECVerifier::CECVerifier(size_t nMaxKeysIn) : nMaxKeys(nMaxKeysIn)
+{
+    group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    assert(group != NULL);
+    // Only public data ever goes through this group, so the variable-time
+    // precomputed generator table is safe to use.
+    BN_CTX* ctx = BN_CTX_new();
+    assert(ctx != NULL);
+    int ret = EC_GROUP_precompute_mult(group, ctx);
+    assert(ret);
+    BN_CTX_free(ctx);
+}
+
+CECVerifier::~CECVerifier()
+{
+    mapKeys.clear();
+    lruKeys.clear();
+    EC_GROUP_free(group);
+}
+
+boost::shared_ptr<CECKey> CECVerifier::GetKey(const unsigned char* pubkey, size_t size)
+{
+    key_type vchKey(pubkey, pubkey + size);
+    {
+        boost::mutex::scoped_lock lock(cs);
+        std::map<key_type, list_type::iterator>::iterator mi = mapKeys.find(vchKey);
+        if (mi != mapKeys.end()) {
+            lruKeys.splice(lruKeys.begin(), lruKeys, mi->second);
+            return mi->second->second;
+        }
+    }
+
+    // Parse outside the lock; a concurrent miss on the same key just parses it twice.
+    boost::shared_ptr<CECKey> key(new CECKey(group));
+    if (!key->SetPubKey(pubkey, size))
+        return boost::shared_ptr<CECKey>();
+
+    boost::mutex::scoped_lock lock(cs);
+    if (nMaxKeys == 0 || mapKeys.count(vchKey))
+        return key;
+    lruKeys.push_front(std::make_pair(vchKey, key));
+    mapKeys.insert(std::make_pair(vchKey, lruKeys.begin()));
+    while (lruKeys.size() > nMaxKeys) {
+        mapKeys.erase(lruKeys.back().first);
+        lruKeys.pop_back();
+    }
+    return key;
+}
+
+bool CECVerifier::Verify(const unsigned char* pubkey, size_t size, const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    boost::shared_ptr<CECKey> key = GetKey(pubkey, size);
+    if (!key)
+        return false;
+    // Verification only reads the key, so the shared instance needs no locking.
+    return key->Verify(hash, vchSig);
+}
+
+size_t CECVerifier::GetCacheSize()
+{
+    boost::mutex::scoped_lock lock(cs);
+    return lruKeys.size();
+}
+
 bool CECKey::SanityCheck()
 {
     EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
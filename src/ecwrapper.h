@@ -6,8 +6,13 @@
 #define BITCOIN_ECWRAPPER_H
 
 #include <cstddef>
+#include <list>
+#include <map>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
 #include <openssl/ec.h>
 
 class uint256;
@@ -20,6 +25,8 @@ private:
 
 public:
     CECKey();
+    /** Construct a key on an existing group. Only use for public key operations. */
+    explicit CECKey(const EC_GROUP* group);
     ~CECKey();
 
     void GetPubKey(std::vector<unsigned char>& pubkey, bool fCompressed);
@@ -38,4 +45,34 @@ public:
     static bool SanityCheck();
 };
 
+/**
+ * Long-lived state for verifying signatures against public keys: one
+ * secp256k1 group with precomputed multiples of the generator, and an LRU
+ * cache of parsed public keys so keys that sign repeatedly (masternode,
+ * spork and staking keys) are decoded only once.
+ */
+class CECVerifier
+{
+private:
+    typedef std::vector<unsigned char> key_type;
+    typedef std::list<std::pair<key_type, boost::shared_ptr<CECKey> > > list_type;
+
+    EC_GROUP* group;
+    size_t nMaxKeys;
+
+    boost::mutex cs;
+    list_type lruKeys; //! most recently used first
+    std::map<key_type, list_type::iterator> mapKeys;
+
+    boost::shared_ptr<CECKey> GetKey(const unsigned char* pubkey, size_t size);
+
+public:
+    explicit CECVerifier(size_t nMaxKeysIn);
+    ~CECVerifier();
+
+    const EC_GROUP* GetGroup() const { return group; }
+    bool Verify(const unsigned char* pubkey, size_t size, const uint256& hash, const std::vector<unsigned char>& vchSig);
+    size_t GetCacheSize();
+};
+
 #endif // BITCOIN_ECWRAPPER_H
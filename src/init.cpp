@@ -17,6 +17,7 @@
 #include "amount.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
 #include "masternode-payments.h"
@@ -85,6 +86,16 @@ static CZMQNotificationInterface* pzmqNotificationInterface = NULL;
 #define MIN_CORE_FILEDESCRIPTORS 150
 #endif
 
+int GetMaxConnections(int nWanted, int nBind, int nDBFD, int nFDLimit)
+{
+    // Sockets must be select()able, so they share FD_SETSIZE with the core
+    // descriptors. Database files are never select()ed and only count
+    // against the process limit.
+    int nConnections = std::min(nWanted, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+    nConnections = std::min(nConnections, nFDLimit - MIN_CORE_FILEDESCRIPTORS - nDBFD);
+    return std::max(nConnections, 0);
+}
+
 /** Used to pass flags to the Bind() function */
 enum BindFlags {
     BF_NONE = 0,
@@ -141,10 +152,10 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch (const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -158,7 +169,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB* pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 static boost::thread_group threadGroup;
 
@@ -324,7 +334,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
-    strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 500));
+    strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), "xdna.conf"));
     if (mode == HMM_BITCOIND) {
 #if !defined(WIN32)
@@ -333,6 +343,9 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-dbprofile=<[db:]profile>", _("Tune LevelDB for the storage it runs on: default, ssd or hdd. Prefix with chainstate:, blockindex: or sporks: to apply to one database only (can be specified multiple times)"));
+    strUsage += HelpMessageOpt("-dboption=<[db:]key=value>", _("Override one LevelDB option of the profile: compression (0/1), maxopenfiles, bloombits, blocksize or blockcachepercent. Prefix with a database name as for -dbprofile (can be specified multiple times)"));
+    strUsage += HelpMessageOpt("-dbbackgroundflush", strprintf(_("Write the chainstate to disk from a background thread while validation continues (default: %u)"), DEFAULT_DB_BACKGROUND_FLUSH));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxreorg=<n>", strprintf(_("Set the Maximum reorg depth (default: %u)"), Params(CBaseChainParams::MAIN).MaxReorganizationDepth()));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
@@ -360,11 +373,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-dnsseed", _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)"));
     strUsage += HelpMessageOpt("-externalip=<ip>", _("Specify your own public address"));
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-headersfirst", strprintf(_("Download block headers from several peers ahead of block data and fetch blocks along the best header chain (default: %u)"), DEFAULT_HEADERS_FIRST));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
     strUsage += HelpMessageOpt("-listenonion", strprintf(_("Automatically create Tor hidden service (default: %d)"), DEFAULT_LISTEN_ONION));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-maxuploadblockreserve=<n>", strprintf(_("Upload target kept back for each block expected in the rest of the cycle, in KiB. Historical block serving stops once only this reserve is left (default: %u)"), DEFAULT_UPLOAD_BLOCK_RESERVE));
+    strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h). Historical blocks are no longer served to non-whitelisted peers once it is close; new blocks and masternode messages are still relayed. 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -428,6 +444,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-uacomment=<cmt>", _("Append comment to the user agent string"));
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+        strUsage += HelpMessageOpt("-checkblockindexhashes", strprintf("Recompute every block index entry's header hash at startup and check it against its key (default: %u)", 0));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkpoints", strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1));
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100));
@@ -573,18 +590,8 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE* file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
-        }
+        if (!ReindexBlockFiles())
+            return; // Keep the reindexing flag so the next start resumes
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -784,15 +791,28 @@ bool AppInit2()
         }
     }
 
+    // Databases allowed to keep more tables open than the default need extra file descriptors
+    int nDBFD = 0;
+    std::string strDBError;
+    if (!GetLevelDBExtraFileDescriptors(nDBFD, strDBError))
+        return InitError(strDBError);
+#ifdef WIN32
+    nDBFD = 0;
+#endif
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
-    nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
-    int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
+    int nWantedConnections = GetArg("-maxconnections", 125);
+    nWantedConnections = std::max(std::min(nWantedConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    int nFD = RaiseFileDescriptorLimit(nWantedConnections + MIN_CORE_FILEDESCRIPTORS + nDBFD);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
-    if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
-        nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
+    nMaxConnections = GetMaxConnections(nWantedConnections, nBind, nDBFD, nFD);
+    if (nDBFD > 0 && nMaxConnections < nWantedConnections) {
+        if (nMaxConnections == 0)
+            return InitError(strprintf(_("Not enough file descriptors available for connections next to the %d extra database files; lower maxopenfiles with -dboption."), nDBFD));
+        InitWarning(strprintf(_("Warning: -maxconnections lowered to %d to leave file descriptors for the databases."), nMaxConnections));
+    }
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
@@ -821,6 +841,8 @@ bool AppInit2()
     // Checkmempool and checkblockindex default to true in regtest mode
     mempool.setSanityCheck(GetBoolArg("-checkmempool", Params().DefaultConsistencyChecks()));
     fCheckBlockIndex = GetBoolArg("-checkblockindex", Params().DefaultConsistencyChecks());
+    fCheckBlockIndexHashes = GetBoolArg("-checkblockindexhashes", false);
+    fHeadersFirst = GetBoolArg("-headersfirst", DEFAULT_HEADERS_FIRST);
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
@@ -915,6 +937,9 @@ bool AppInit2()
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
+    // Pick the fastest SHA256 implementation this CPU supports before anything gets hashed
+    std::string sha256_algo = SHA256AutoDetect();
+
     // Sanity check
     if (!InitSanityCheck())
         return InitError(_("Initialization sanity check failed. XDNA Core is shutting down."));
@@ -943,6 +968,7 @@ bool AppInit2()
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("XDNA version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using the '%s' SHA256 implementation\n", sha256_algo);
 #ifdef ENABLE_WALLET
     LogPrintf("Using BerkeleyDB version %s\n", DbEnv::version(0, 0, 0));
 #endif
@@ -956,8 +982,10 @@ bool AppInit2()
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        for (int i = 0; i < nScriptCheckThreads - 1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadBlockCheck);
+        }
     }
 
     if (mapArgs.count("-sporkkey")) // spork priv key
@@ -1255,6 +1283,21 @@ bool AppInit2()
     for (string strDest : mapMultiArgs["-seednode"])
         AddOneShot(strDest);
 
+    int64_t nBlockReserve = GetArg("-maxuploadblockreserve", DEFAULT_UPLOAD_BLOCK_RESERVE);
+    if (nBlockReserve < 0)
+        return InitError(strprintf(_("Invalid amount for -maxuploadblockreserve=<n>: '%s'"), mapArgs["-maxuploadblockreserve"]));
+    CNode::SetMaxOutboundBlockReserve(nBlockReserve * 1024);
+    if (mapArgs.count("-maxuploadtarget")) {
+        int64_t nTargetMiB = GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET);
+        if (nTargetMiB < 0)
+            return InitError(strprintf(_("Invalid amount for -maxuploadtarget=<n>: '%s'"), mapArgs["-maxuploadtarget"]));
+        uint64_t nTarget = nTargetMiB * 1024 * 1024;
+        CNode::SetMaxOutboundTarget(nTarget);
+        uint64_t nReserve = CNode::GetMaxOutboundCycleReserve();
+        if (nTarget > 0 && nTarget <= nReserve)
+            InitWarning(strprintf(_("Warning: -maxuploadtarget is not above the %u MiB kept back for new blocks per 24h (-maxuploadblockreserve); historical blocks will not be served."), nReserve / (1024 * 1024)));
+    }
+
 #if ENABLE_ZMQ
     pzmqNotificationInterface = CZMQNotificationInterface::CreateWithArguments(mapArgs);
 
@@ -1304,10 +1347,10 @@ bool AppInit2()
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the coins cache is accounted for in bytes
 
     bool fLoaded = false;
-    while (!fLoaded) {
+    while (!fLoaded && !ShutdownRequested()) {
         bool fReset = fReindex;
         std::string strLoadError;
 
@@ -1332,6 +1375,14 @@ bool AppInit2()
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
 
+                // Convert a chainstate written with per-transaction coin records.
+                uiInterface.InitMessage(_("Upgrading UTXO database..."));
+                // An interrupted upgrade resumes on the next start.
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 // MERGE: load previous sessions sporks if we have them.
                 uiInterface.InitMessage(_("Loading sporks..."));
                 LoadSporksFromDB();
@@ -1379,6 +1430,10 @@ bool AppInit2()
                         }
                     }
 
+                    if (!CVerifyDB().VerifyDB(pcoinsdbview, STARTUP_CHECKLEVEL, GetArg("-checkblocks", DEFAULT_CHECKBLOCKS))) {
+                        strLoadError = _("Corrupted block database detected");
+                        break;
+                    }
                 }
             } catch (std::exception& e) {
                 if (fDebug) LogPrintf("%s\n", e.what());
@@ -1391,7 +1446,7 @@ bool AppInit2()
             fLoaded = true;
         } while (false);
 
-        if (!fLoaded) {
+        if (!fLoaded && !ShutdownRequested()) {
             // first suggest a reindex
             if (!fReset) {
                 bool fRet = uiInterface.ThreadSafeMessageBox(
@@ -1413,7 +1468,7 @@ bool AppInit2()
     // As LoadBlockIndex can take several minutes, it's possible the user
     // requested to kill the GUI during the last operation. If so, exit.
     // As the program has not fully started yet, Shutdown() is possibly overkill.
-    if (fRequestShutdown) {
+    if (ShutdownRequested()) {
         LogPrintf("Shutdown requested. Exiting.\n");
         return false;
     }
@@ -1556,6 +1611,9 @@ bool AppInit2()
     if (mapArgs.count("-blocknotify"))
         uiInterface.NotifyBlockTip.connect(BlockNotifyCallback);
 
+    if (GetBoolArg("-dbbackgroundflush", DEFAULT_DB_BACKGROUND_FLUSH))
+        threadGroup.create_thread(&ThreadFlushChainstate);
+
     // scan for better chains in the block chain database, that are not yet connected in the active best chain
     CValidationState state;
     if (!ActivateBestChain(state))
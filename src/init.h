@@ -24,6 +24,8 @@ void Shutdown();
 void Interrupt();
 void PrepareShutdown();
 bool AppInit2();
+/** Connections the FD_SETSIZE and process file descriptor limits leave room for, given nDBFD descriptors for database files */
+int GetMaxConnections(int nWanted, int nBind, int nDBFD, int nFDLimit);
 
 /** The help message mode determines what help message to show */
 enum HelpMessageMode {
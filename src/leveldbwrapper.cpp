@@ -2,9 +2,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/xdna-config.h"
+#endif
+
 #include "leveldbwrapper.h"
 
 #include "util.h"
+#include "utilstrencodings.h"
 
 #include <boost/filesystem.hpp>
 
@@ -27,14 +32,146 @@ void HandleError(const leveldb::Status& status)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CLevelDBOptions::CLevelDBOptions()
+{
+    SetProfile("default");
+}
+
+bool CLevelDBOptions::SetProfile(const std::string& strProfileIn)
+{
+    if (strProfileIn == "default") {
+        nMaxOpenFiles = DEFAULT_LEVELDB_MAX_OPEN_FILES;
+        nBloomBits = 10;
+        nBlockSize = 4096;
+        fCompression = false;
+        nBlockCachePercent = 50;
+    } else if (strProfileIn == "ssd") {
+        // Random reads are cheap: keep more tables open instead of re-opening them.
+        nMaxOpenFiles = 1000;
+        nBloomBits = 10;
+        nBlockSize = 4096;
+        fCompression = true;
+        nBlockCachePercent = 50;
+    } else if (strProfileIn == "hdd") {
+        // Seeks are expensive: read larger blocks and cache more of them.
+        nMaxOpenFiles = DEFAULT_LEVELDB_MAX_OPEN_FILES;
+        nBloomBits = 16;
+        nBlockSize = 65536;
+        fCompression = true;
+        nBlockCachePercent = 75;
+    } else {
+        return false;
+    }
+    strProfile = strProfileIn;
+    return true;
+}
+
+bool CLevelDBOptions::Set(const std::string& strKey, const std::string& strValue)
+{
+    int64_t n = 0;
+    if (strKey != "compression" && !ParseInt64(strValue, &n))
+        return false;
+    if (strKey == "compression") {
+        if (strValue != "0" && strValue != "1")
+            return false;
+        fCompression = strValue == "1";
+    } else if (strKey == "maxopenfiles" && n >= 16 && n <= 100000) {
+        nMaxOpenFiles = n;
+    } else if (strKey == "bloombits" && n >= 0 && n <= 64) {
+        nBloomBits = n;
+    } else if (strKey == "blocksize" && n >= 1024 && n <= 4 * 1024 * 1024) {
+        nBlockSize = n;
+    } else if (strKey == "blockcachepercent" && n >= 10 && n <= 90) {
+        nBlockCachePercent = n;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Split "<db>:<value>" into its parts. A value without a database prefix
+ * applies to every database and is reported with an empty strDB. Returns
+ * false if the prefix isn't one of LEVELDB_NAMES.
+ */
+static bool SplitDatabaseArg(const std::string& strArg, std::string& strDB, std::string& strValue)
+{
+    size_t nColon = strArg.find(':');
+    if (nColon == std::string::npos) {
+        strDB.clear();
+        strValue = strArg;
+        return true;
+    }
+    strDB = strArg.substr(0, nColon);
+    strValue = strArg.substr(nColon + 1);
+    for (unsigned int i = 0; i < ARRAYLEN(LEVELDB_NAMES); i++) {
+        if (strDB == LEVELDB_NAMES[i])
+            return true;
+    }
+    return false;
+}
+
+bool GetLevelDBOptions(const std::string& strName, CLevelDBOptions& options, std::string& strError)
+{
+    options = CLevelDBOptions();
+    // Settings for all databases go first, so the database specific ones win.
+    for (int fSpecific = 0; fSpecific < 2; fSpecific++) {
+        std::map<std::string, std::vector<std::string> >::const_iterator mi = mapMultiArgs.find("-dbprofile");
+        for (unsigned int i = 0; mi != mapMultiArgs.end() && i < mi->second.size(); i++) {
+            std::string strDB, strProfile;
+            if (!SplitDatabaseArg(mi->second[i], strDB, strProfile)) {
+                strError = strprintf("Unknown database '%s' in -dbprofile '%s'", strDB, mi->second[i]);
+                return false;
+            }
+            if (strDB != (fSpecific ? strName : ""))
+                continue;
+            if (!options.SetProfile(strProfile)) {
+                strError = strprintf("Unknown -dbprofile '%s'", mi->second[i]);
+                return false;
+            }
+        }
+    }
+    for (int fSpecific = 0; fSpecific < 2; fSpecific++) {
+        std::map<std::string, std::vector<std::string> >::const_iterator mi = mapMultiArgs.find("-dboption");
+        for (unsigned int i = 0; mi != mapMultiArgs.end() && i < mi->second.size(); i++) {
+            std::string strDB, strOption;
+            if (!SplitDatabaseArg(mi->second[i], strDB, strOption)) {
+                strError = strprintf("Unknown database '%s' in -dboption '%s'", strDB, mi->second[i]);
+                return false;
+            }
+            if (strDB != (fSpecific ? strName : ""))
+                continue;
+            size_t nEquals = strOption.find('=');
+            if (nEquals == std::string::npos || !options.Set(strOption.substr(0, nEquals), strOption.substr(nEquals + 1))) {
+                strError = strprintf("Invalid -dboption '%s'", mi->second[i]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool GetLevelDBExtraFileDescriptors(int& nExtraFD, std::string& strError)
+{
+    nExtraFD = 0;
+    for (unsigned int i = 0; i < ARRAYLEN(LEVELDB_NAMES); i++) {
+        CLevelDBOptions dboptions;
+        if (!GetLevelDBOptions(LEVELDB_NAMES[i], dboptions, strError))
+            return false;
+        nExtraFD += std::max(0, dboptions.nMaxOpenFiles - DEFAULT_LEVELDB_MAX_OPEN_FILES);
+    }
+    return true;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBOptions& dboptions)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize * dboptions.nBlockCachePercent / 100);
+    options.write_buffer_size = nCacheSize * (100 - dboptions.nBlockCachePercent) / 200; // up to two write buffers may be held in memory simultaneously
+    options.filter_policy = dboptions.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(dboptions.nBloomBits) : NULL;
+    options.compression = dboptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dboptions.nMaxOpenFiles;
+    options.block_size = dboptions.nBlockSize;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -43,14 +180,24 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const std::string& strNameIn) : strName(strNameIn)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    std::string strError;
+    if (!GetLevelDBOptions(strName, dboptions, strError)) {
+        // Init rejects bad options before opening any database; don't fail here.
+        LogPrintf("%s, using the default profile\n", strError);
+        dboptions = CLevelDBOptions();
+    }
+#ifndef HAVE_SNAPPY
+    if (dboptions.fCompression)
+        LogPrintf("LevelDB was built without Snappy, %s will not be compressed\n", path.string());
+#endif
+    options = GetOptions(nCacheSize, dboptions);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -61,7 +208,7 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
             leveldb::DestroyDB(path.string(), options);
         }
         TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        LogPrintf("Opening LevelDB in %s (profile %s, max_open_files=%d, compression=%d)\n", path.string(), dboptions.strProfile, dboptions.nMaxOpenFiles, dboptions.fCompression);
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
@@ -86,3 +233,20 @@ bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync)
     HandleError(status);
     return true;
 }
+
+std::string CLevelDBWrapper::GetProperty(const std::string& strProperty) const
+{
+    std::string strValue;
+    if (!pdb->GetProperty(strProperty, &strValue))
+        strValue.clear();
+    return strValue;
+}
+
+uint64_t CLevelDBWrapper::GetApproximateSize() const
+{
+    // Every key starts with a printable type character.
+    leveldb::Range range(leveldb::Slice(), leveldb::Slice("\xff", 1));
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
@@ -33,6 +33,11 @@ private:
     leveldb::WriteBatch batch;
 
 public:
+    void Clear()
+    {
+        batch.Clear();
+    }
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -61,9 +66,48 @@ public:
     }
 };
 
+/**
+ * Tunable options of one LevelDB database. They start from the profile chosen
+ * with -dbprofile and can be overridden one by one with -dboption, either for
+ * all databases or for a single one (chainstate, blockindex, sporks).
+ */
+struct CLevelDBOptions {
+    std::string strProfile;
+    int nMaxOpenFiles;
+    int nBloomBits;
+    size_t nBlockSize;
+    bool fCompression;
+    //! share of the cache (in percent) given to the block cache; the rest goes to the write buffers
+    int nBlockCachePercent;
+
+    CLevelDBOptions();
+    //! Load the named profile ("default", "ssd" or "hdd"); returns false if it doesn't exist
+    bool SetProfile(const std::string& strProfileIn);
+    //! Set one option from its name and value; returns false if either is invalid
+    bool Set(const std::string& strKey, const std::string& strValue);
+};
+
+//! max_open_files of the default profile, accounted for in the core file descriptors
+static const int DEFAULT_LEVELDB_MAX_OPEN_FILES = 64;
+
+/** Databases whose name can prefix -dbprofile and -dboption */
+static const char* const LEVELDB_NAMES[] = {"chainstate", "blockindex", "sporks"};
+
+/** Resolve the options of the named database from -dbprofile and -dboption; unknown database prefixes are an error */
+bool GetLevelDBOptions(const std::string& strName, CLevelDBOptions& options, std::string& strError);
+
+/** File descriptors all databases may keep open beyond DEFAULT_LEVELDB_MAX_OPEN_FILES each */
+bool GetLevelDBExtraFileDescriptors(int& nExtraFD, std::string& strError);
+
 class CLevelDBWrapper
 {
 private:
+    //! name used to look up per-database options and in statistics
+    std::string strName;
+
+    //! options this database was opened with
+    CLevelDBOptions dboptions;
+
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
 
@@ -86,11 +130,20 @@ private:
     leveldb::DB* pdb;
 
 public:
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const std::string& strNameIn = "");
     ~CLevelDBWrapper();
 
+    const std::string& GetName() const { return strName; }
+    const CLevelDBOptions& GetDBOptions() const { return dboptions; }
+
+    //! Value of a LevelDB property such as "leveldb.stats"; empty if it doesn't exist
+    std::string GetProperty(const std::string& strProperty) const;
+
+    //! Approximate space the whole database takes on disk
+    uint64_t GetApproximateSize() const;
+
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const
+    bool Read(const K& key, V& value, const leveldb::Snapshot* snapshot = NULL) const
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
@@ -98,7 +151,14 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status;
+        if (snapshot) {
+            leveldb::ReadOptions options = readoptions;
+            options.snapshot = snapshot;
+            status = pdb->Get(options, slKey, &strValue);
+        } else {
+            status = pdb->Get(readoptions, slKey, &strValue);
+        }
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -168,6 +228,25 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    //! Iterate over the database as it was when snapshot was taken
+    leveldb::Iterator* NewIterator(const leveldb::Snapshot* snapshot) const
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot;
+        return pdb->NewIterator(options);
+    }
+
+    //! Take a consistent read-only view of the database; pass it to ReleaseSnapshot when done
+    const leveldb::Snapshot* GetSnapshot() const
+    {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot* snapshot) const
+    {
+        pdb->ReleaseSnapshot(snapshot);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
@@ -10,9 +10,12 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "init.h"
 #include "kernel.h"
 #include "masternode-payments.h"
@@ -31,13 +34,17 @@
 #include "utilmoneystr.h"
 #include "validationinterface.h"
 
+#include <deque>
 #include <sstream>
+#include <utility>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/thread.hpp>
 #include <boost/foreach.hpp>
+#include <boost/function.hpp>
 #include <atomic>
 #include <queue>
 
@@ -59,6 +66,7 @@ using namespace std;
 CCriticalSection cs_main;
 CCriticalSection cs_mapstake;
 
+CBlockIndexArena blockIndexArena;
 BlockMap mapBlockIndex;
 map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
@@ -75,8 +83,10 @@ bool fReindex = false;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
+bool fHeadersFirst = DEFAULT_HEADERS_FIRST;
+bool fCheckBlockIndexHashes = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 bool fClearSpendCache = false;
 
@@ -103,6 +113,8 @@ map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 map<uint256, int64_t> mapRejectedBlocks;
 
 void EraseOrphansFor(NodeId peer);
+void EvictPeerHeaders(NodeId nodeid);
+bool CheckBestHeadersServed(NodeId nodeLeaving, bool fStalled = false);
 
 static void CheckBlockIndex();
 
@@ -172,12 +184,25 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    std::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Set while the block is rebuilt from a "cmpctblock".
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
+/** Peers asked to push new blocks as "cmpctblock" without an inv, oldest first. */
+list<NodeId> lNodesAnnouncingCompactBlocks;
+
+/** A block from the header chain that arrived before its parent, and the peer that sent it. */
+struct CUnconnectedBlock {
+    uint256 hash;
+    NodeId nodeid;
+    CBlock block;
+};
+/** Blocks waiting for their parent, keyed by parent hash. Requires cs_main. */
+multimap<uint256, CUnconnectedBlock> mapBlocksUnconnected;
+
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
@@ -188,6 +213,30 @@ set<CBlockIndex*> setDirtyBlockIndex;
 set<int> setDirtyFileInfo;
 } // anon namespace
 
+/**
+ * A validated header whose block we don't have yet. These are kept out of
+ * mapBlockIndex, since the proof-of-stake fields of a CBlockIndex are derived
+ * from the block's transactions.
+ */
+struct CHeaderEntry {
+    uint256 hashPrev;
+    int nHeight;
+    uint256 nChainWork;
+    unsigned int nTime;
+    NodeId nodeid; //! The peer that sent it first, whose header limit it counts against.
+};
+/** Headers ahead of mapBlockIndex. Requires cs_main. */
+map<uint256, CHeaderEntry> mapBlockHeaders;
+
+/** The download chain in mapBlockHeaders, oldest first; the parent of its first entry is in mapBlockIndex. */
+std::deque<uint256> vBestHeaders;
+/** Height of vBestHeaders.front(). */
+int nBestHeadersBase = 0;
+/** Chain work of vBestHeaders.back(). */
+uint256 nBestHeadersWork = 0;
+/** Time vBestHeaders was started or last moved forward by a connected block. */
+int64_t nBestHeadersProgressTime = 0;
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -303,6 +352,12 @@ struct CNodeState {
     uint256 hashLastUnknownBlock;
     //! The last full block we both have.
     CBlockIndex* pindexLastCommonBlock;
+    //! The most-work header this peer has sent us, with its height and chain work.
+    uint256 hashBestHeader;
+    int nBestHeaderHeight;
+    uint256 nBestHeaderWork;
+    //! Entries of mapBlockHeaders this peer sent first.
+    int nHeadersStored;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
     //! Since when we're stalling block download progress (in microseconds), or 0.
@@ -311,6 +366,13 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Moving average of the time (in microseconds) this peer took per requested block while it had some in flight, 0 until measured.
+    int64_t nAvgBlockTime;
+    //! When the last block we requested from this peer arrived (in microseconds).
+    int64_t nLastBlockReceived;
+    //! Requested blocks this peer delivered, and their size in bytes.
+    int nBlocksDelivered;
+    uint64_t nBytesDelivered;
 
     CNodeBlocks nodeBlocks;
 
@@ -322,10 +384,18 @@ struct CNodeState {
         pindexBestKnownBlock = NULL;
         hashLastUnknownBlock = uint256(0);
         pindexLastCommonBlock = NULL;
+        hashBestHeader = uint256(0);
+        nBestHeaderHeight = -1;
+        nBestHeaderWork = 0;
+        nHeadersStored = 0;
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        nAvgBlockTime = 0;
+        nLastBlockReceived = 0;
+        nBlocksDelivered = 0;
+        nBytesDelivered = 0;
     }
 };
 
@@ -386,17 +456,48 @@ void FinalizeNode(NodeId nodeid)
     for (const QueuedBlock& entry : state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
+    EvictPeerHeaders(nodeid);
+    CheckBestHeadersServed(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingCompactBlocks.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
 
 // Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
+void UpdateBlockTime(CNodeState* state, int64_t nBlockTime)
+{
+    if (state->nAvgBlockTime == 0)
+        state->nAvgBlockTime = nBlockTime;
+    else
+        state->nAvgBlockTime = (state->nAvgBlockTime * 4 + nBlockTime) / 5;
+}
+
+} // anon namespace
+
+/** Number of blocks to keep in flight from a peer taking nAvgBlockTime per block: enough to cover BLOCK_DOWNLOAD_TARGET_TIME. */
+int GetDownloadWindow(int64_t nAvgBlockTime)
+{
+    if (nAvgBlockTime <= 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nWindow = BLOCK_DOWNLOAD_TARGET_TIME * 1000000 / nAvgBlockTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, nWindow));
+}
+
+// Requires cs_main. nodeFrom and nBlockSize describe a delivery, if this is one.
+void MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, unsigned int nBlockSize = 0)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState* state = State(itInFlight->second.first);
+        if (nodeFrom == itInFlight->second.first) {
+            // Only count the time since the previous delivery, so a deep queue doesn't look slow
+            int64_t nNow = GetTimeMicros();
+            UpdateBlockTime(state, nNow - std::max(itInFlight->second.second->nTime, state->nLastBlockReceived));
+            state->nLastBlockReceived = nNow;
+            state->nBlocksDelivered++;
+            state->nBytesDelivered += nBlockSize;
+        }
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
@@ -406,21 +507,58 @@ void MarkBlockAsReceived(const uint256& hash)
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL, std::shared_ptr<PartiallyDownloadedBlock> partialBlock = std::shared_ptr<PartiallyDownloadedBlock>())
 {
     CNodeState* state = State(nodeid);
     assert(state != NULL);
 
+    // A block taken over from another peer counts as slow delivery there.
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first != nodeid) {
+        LogPrint("net", "Reassigning block %s from peer=%d to peer=%d\n", hash.ToString(), itInFlight->second.first, nodeid);
+        UpdateBlockTime(State(itInFlight->second.first), GetTimeMicros() - itInFlight->second.second->nTime);
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL, partialBlock};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+namespace
+{
+/**
+ * Ask a peer that just gave us a new tip to push future blocks as compact blocks,
+ * dropping the longest-serving such peer if there are already enough. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingCompactBlocks(CNode* pfrom)
+{
+    if (!pfrom->fSupportsCompactBlocks)
+        return;
+    if (std::find(lNodesAnnouncingCompactBlocks.begin(), lNodesAnnouncingCompactBlocks.end(), pfrom->GetId()) != lNodesAnnouncingCompactBlocks.end())
+        return;
+
+    uint64_t nCMPCTBLOCKVersion = CMPCTBLOCKS_VERSION;
+    if (lNodesAnnouncingCompactBlocks.size() >= MAX_CMPCT_ANNOUNCING_PEERS) {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingCompactBlocks.front()) {
+                pnode->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingCompactBlocks.pop_front();
+    }
+    bool fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    lNodesAnnouncingCompactBlocks.push_back(pfrom->GetId());
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid)
 {
@@ -515,6 +653,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    int64_t nNow = GetTimeMicros();
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -553,8 +692,20 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     return;
                 }
             } else if (waitingfor == -1) {
-                // This is the first already-in-flight block.
-                waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                // This is the first already-in-flight block. If it is held by a peer much slower
+                // than this one, take it over rather than wait for the stall detector.
+                const pair<NodeId, list<QueuedBlock>::iterator>& inFlight = mapBlocksInFlight[pindex->GetBlockHash()];
+                waitingfor = inFlight.first;
+                if (waitingfor != nodeid && state->nAvgBlockTime > 0) {
+                    const CNodeState* stateHolder = State(waitingfor);
+                    int64_t nWaited = nNow - inFlight.second->nTime;
+                    if (nWaited > std::max(BLOCK_REASSIGN_SLOWDOWN * state->nAvgBlockTime, BLOCK_REASSIGN_MIN_WAIT * 1000000) &&
+                        (stateHolder->nAvgBlockTime == 0 || stateHolder->nAvgBlockTime > BLOCK_REASSIGN_SLOWDOWN * state->nAvgBlockTime)) {
+                        vBlocks.push_back(pindex);
+                        if (vBlocks.size() == count)
+                            return;
+                    }
+                }
             }
         }
     }
@@ -562,6 +713,530 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
 } // anon namespace
 
+/** Height and chain work of a block we know the header of. Requires cs_main. */
+bool LookupHeader(const uint256& hash, int& nHeight, uint256& nChainWork)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end()) {
+        nHeight = mi->second->nHeight;
+        nChainWork = mi->second->nChainWork;
+        return true;
+    }
+    map<uint256, CHeaderEntry>::iterator it = mapBlockHeaders.find(hash);
+    if (it != mapBlockHeaders.end()) {
+        nHeight = it->second.nHeight;
+        nChainWork = it->second.nChainWork;
+        return true;
+    }
+    return false;
+}
+
+/** Whether our best header chain is as far ahead of the active chain as we let it get. Requires cs_main. */
+bool HeadersAheadFull()
+{
+    return !vBestHeaders.empty() && nBestHeadersBase + (int)vBestHeaders.size() > chainActive.Height() + MAX_HEADERS_AHEAD;
+}
+
+/** Locator for "getheaders": hashLast (by default the end of our best header chain), then the active chain. Requires cs_main. */
+CBlockLocator GetHeadersLocator(uint256 hashLast = uint256(0))
+{
+    CBlockLocator locator = chainActive.GetLocator();
+    if (hashLast == 0 && !vBestHeaders.empty())
+        hashLast = vBestHeaders.back();
+    if (hashLast != 0) {
+        BlockMap::iterator mi = mapBlockIndex.find(hashLast);
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            locator.vHave.insert(locator.vHave.begin(), hashLast);
+    }
+    return locator;
+}
+
+/** Whether hash, a header at nHeight, is on vBestHeaders. Requires cs_main. */
+bool IsBestHeader(const uint256& hash, int nHeight)
+{
+    int nOffset = nHeight - nBestHeadersBase;
+    return nOffset >= 0 && nOffset < (int)vBestHeaders.size() && vBestHeaders[nOffset] == hash;
+}
+
+/** Remove a header from mapBlockHeaders and from the count of the peer that sent it. Requires cs_main. */
+void EraseBlockHeader(map<uint256, CHeaderEntry>::iterator it)
+{
+    CNodeState* state = State(it->second.nodeid);
+    if (state != NULL)
+        state->nHeadersStored--;
+    mapBlockHeaders.erase(it);
+}
+
+/** Forget headers whose parent was forgotten, as their blocks could never connect. Requires cs_main. */
+void EraseOrphanedHeaders()
+{
+    // Parents sort before their children, so one pass removes whole branches
+    vector<pair<int, uint256> > vByHeight;
+    vByHeight.reserve(mapBlockHeaders.size());
+    for (const PAIRTYPE(const uint256, CHeaderEntry) & item : mapBlockHeaders)
+        vByHeight.push_back(make_pair(item.second.nHeight, item.first));
+    sort(vByHeight.begin(), vByHeight.end());
+    for (const PAIRTYPE(int, uint256) & item : vByHeight) {
+        map<uint256, CHeaderEntry>::iterator it = mapBlockHeaders.find(item.second);
+        if (!mapBlockIndex.count(it->second.hashPrev) && !mapBlockHeaders.count(it->second.hashPrev))
+            EraseBlockHeader(it);
+    }
+}
+
+/** Forget headers off the best header chain that the active chain has moved past. Requires cs_main. */
+void PruneBlockHeaders()
+{
+    static int nPrunedHeight = -1;
+    if (chainActive.Height() == nPrunedHeight)
+        return;
+    nPrunedHeight = chainActive.Height();
+
+    map<uint256, CHeaderEntry>::iterator it = mapBlockHeaders.begin();
+    while (it != mapBlockHeaders.end()) {
+        if (!IsBestHeader(it->first, it->second.nHeight) && it->second.nHeight <= nPrunedHeight)
+            EraseBlockHeader(it++);
+        else
+            it++;
+    }
+}
+
+/** Forget vBestHeaders and every header built on it. Requires cs_main. */
+void DropBestHeaders()
+{
+    for (const uint256& hash : vBestHeaders) {
+        map<uint256, CHeaderEntry>::iterator it = mapBlockHeaders.find(hash);
+        if (it != mapBlockHeaders.end())
+            EraseBlockHeader(it);
+    }
+    vBestHeaders.clear();
+    nBestHeadersWork = 0;
+    EraseOrphanedHeaders();
+}
+
+/** Forget the headers nodeid sent first that aren't on vBestHeaders, and the headers built on them. Requires cs_main. */
+void EvictPeerHeaders(NodeId nodeid)
+{
+    map<uint256, CHeaderEntry>::iterator it = mapBlockHeaders.begin();
+    while (it != mapBlockHeaders.end()) {
+        if (it->second.nodeid == nodeid && !IsBestHeader(it->first, it->second.nHeight))
+            EraseBlockHeader(it++);
+        else
+            it++;
+    }
+    EraseOrphanedHeaders();
+}
+
+/**
+ * Make the branch of mapBlockHeaders ending in hash the download chain, walking it back to
+ * the block index. Returns false, leaving vBestHeaders as it was, if part of the branch was
+ * pruned, as its blocks could never connect. Requires cs_main.
+ */
+bool SetBestHeaders(const uint256& hash)
+{
+    std::deque<uint256> vBranch;
+    int nBranchBase = 0;
+    uint256 hashWalk = hash;
+    map<uint256, CHeaderEntry>::iterator it;
+    while ((it = mapBlockHeaders.find(hashWalk)) != mapBlockHeaders.end()) {
+        vBranch.push_front(hashWalk);
+        nBranchBase = it->second.nHeight;
+        hashWalk = it->second.hashPrev;
+    }
+    if (vBranch.empty() || !mapBlockIndex.count(hashWalk))
+        return false;
+    vBestHeaders.swap(vBranch);
+    nBestHeadersBase = nBranchBase;
+    nBestHeadersWork = mapBlockHeaders[hash].nChainWork;
+    nBestHeadersProgressTime = GetTime();
+    return true;
+}
+
+/**
+ * Make hash, in mapBlockHeaders, the end of vBestHeaders if it has more work. Only the first
+ * proof-of-stake header past the block index has its difficulty checked, so proof-of-stake
+ * headers may start vBestHeaders on the block index or extend it, but never move it to
+ * another branch; only CheckHeadersProgress does that, once vBestHeaders stalls. Requires cs_main.
+ */
+void UpdateBestHeaders(const uint256& hash, const CHeaderEntry& entry)
+{
+    if (entry.nChainWork <= (vBestHeaders.empty() ? chainActive.Tip()->nChainWork : nBestHeadersWork))
+        return;
+
+    if (vBestHeaders.empty() ? mapBlockIndex.count(entry.hashPrev) > 0 : entry.hashPrev == vBestHeaders.back()) {
+        if (vBestHeaders.empty()) {
+            nBestHeadersBase = entry.nHeight;
+            nBestHeadersProgressTime = GetTime();
+        }
+        vBestHeaders.push_back(hash);
+        nBestHeadersWork = entry.nChainWork;
+        return;
+    }
+    if (entry.nHeight > Params().LAST_POW_BLOCK())
+        return;
+
+    // A better proof-of-work branch
+    SetBestHeaders(hash);
+}
+
+/**
+ * Check a new header whose parent is in mapBlockIndex or mapBlockHeaders, and fill in its
+ * entry for mapBlockHeaders. Requires cs_main.
+ */
+bool CheckNewHeader(const CBlockHeader& header, CValidationState& state, CHeaderEntry& entry)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = header.GetHash();
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nTime = header.nTime;
+    BlockMap::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+    if (mi != mapBlockIndex.end()) {
+        CBlockIndex* pindexPrev = mi->second;
+        if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+            return state.DoS(100, error("%s : prev block %s is invalid", __func__, header.hashPrevBlock.ToString()),
+                REJECT_INVALID, "bad-prevblk");
+        if (!ContextualCheckBlockHeader(header, state, pindexPrev))
+            return false;
+        if (header.nBits != GetNextWorkRequired(pindexPrev, header.nTime, &header))
+            return state.DoS(100, error("%s : incorrect difficulty at %d", __func__, pindexPrev->nHeight + 1),
+                REJECT_INVALID, "bad-diffbits");
+        entry.nHeight = pindexPrev->nHeight + 1;
+        entry.nChainWork = pindexPrev->nChainWork;
+    } else {
+        map<uint256, CHeaderEntry>::iterator itPrev = mapBlockHeaders.find(header.hashPrevBlock);
+        if (itPrev == mapBlockHeaders.end())
+            return state.DoS(0, error("%s : prev block %s not found", __func__, header.hashPrevBlock.ToString()), 0, "bad-prevblk");
+        entry.nHeight = itPrev->second.nHeight + 1;
+        entry.nChainWork = itPrev->second.nChainWork;
+
+        // The parts of ContextualCheckBlockHeader that don't need the parent's index entry
+        if (!Checkpoints::CheckBlock(entry.nHeight, hash))
+            return state.DoS(100, error("%s : rejected by checkpoint lock-in at %d", __func__, entry.nHeight),
+                REJECT_CHECKPOINT, "checkpoint mismatch");
+        if (header.nVersion < 2)
+            return state.Invalid(error("%s : rejected nVersion=1 block", __func__),
+                REJECT_OBSOLETE, "bad-version");
+    }
+
+    // Below the last proof-of-work height the header alone carries its proof
+    bool fProofOfWork = entry.nHeight <= Params().LAST_POW_BLOCK();
+    if (!CheckBlockHeader(header, state, fProofOfWork))
+        return false;
+    if (header.GetBlockTime() > GetAdjustedTime() + (fProofOfWork ? 7200 : 180))
+        return state.Invalid(error("%s : block timestamp too far in the future", __func__),
+            REJECT_INVALID, "time-too-new");
+
+    CBlockIndex indexDummy;
+    indexDummy.nBits = header.nBits;
+    entry.nChainWork += GetBlockProof(indexDummy);
+    return true;
+}
+
+/**
+ * Check a header from nodeid that extends mapBlockIndex or mapBlockHeaders and add it to
+ * mapBlockHeaders. Proof-of-stake headers can't be fully checked without their block, so the
+ * header chain only decides what we download next; every block is still fully validated when
+ * it arrives. Requires cs_main.
+ */
+bool AcceptHeader(const CBlockHeader& header, NodeId nodeid, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = header.GetHash();
+    BlockMap::iterator miSelf = mapBlockIndex.find(hash);
+    if (miSelf != mapBlockIndex.end()) {
+        if (miSelf->second->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("%s : block is marked invalid", __func__), 0, "duplicate");
+        return true;
+    }
+    map<uint256, CHeaderEntry>::iterator itSelf = mapBlockHeaders.find(hash);
+    if (itSelf != mapBlockHeaders.end()) {
+        // It may extend a header chain started since we first saw it
+        UpdateBestHeaders(hash, itSelf->second);
+        return true;
+    }
+
+    // A peer at its limit only makes room by giving up its own headers
+    CNodeState* nodestate = State(nodeid);
+    assert(nodestate != NULL);
+    if (nodestate->nHeadersStored >= MAX_HEADERS_PER_PEER) {
+        EvictPeerHeaders(nodeid);
+        if (nodestate->nHeadersStored >= MAX_HEADERS_PER_PEER)
+            return state.DoS(0, error("%s : too many headers from peer=%d", __func__, nodeid), 0, "too-many-headers");
+    }
+    if (mapBlockHeaders.size() >= 2 * MAX_HEADERS_AHEAD) {
+        PruneBlockHeaders();
+        if (mapBlockHeaders.size() >= 2 * MAX_HEADERS_AHEAD) {
+            // Then at the expense of the peer that sent the most
+            NodeId nodeLargest = nodeid;
+            for (const PAIRTYPE(const NodeId, CNodeState) & item : mapNodeState) {
+                if (item.second.nHeadersStored > State(nodeLargest)->nHeadersStored)
+                    nodeLargest = item.first;
+            }
+            EvictPeerHeaders(nodeLargest);
+        }
+        if (mapBlockHeaders.size() >= 2 * MAX_HEADERS_AHEAD)
+            return state.DoS(0, error("%s : too many headers ahead of the block index", __func__), 0, "too-many-headers");
+    }
+
+    CHeaderEntry entry;
+    if (!CheckNewHeader(header, state, entry))
+        return false;
+
+    entry.nodeid = nodeid;
+    mapBlockHeaders.insert(make_pair(hash, entry));
+    nodestate->nHeadersStored++;
+    UpdateBestHeaders(hash, entry);
+    return true;
+}
+
+/** Remember the most-work header a peer has sent us. Requires cs_main. */
+void UpdatePeerBestHeader(NodeId nodeid, const uint256& hash)
+{
+    CNodeState* state = State(nodeid);
+    assert(state != NULL);
+
+    int nHeight;
+    uint256 nChainWork;
+    if (!LookupHeader(hash, nHeight, nChainWork) || nChainWork <= state->nBestHeaderWork)
+        return;
+    state->hashBestHeader = hash;
+    state->nBestHeaderHeight = nHeight;
+    state->nBestHeaderWork = nChainWork;
+}
+
+/** Whether the block hash, child of hashPrev, is waiting in mapBlocksUnconnected. Requires cs_main. */
+bool IsBlockUnconnected(const uint256& hashPrev, const uint256& hash)
+{
+    pair<multimap<uint256, CUnconnectedBlock>::iterator, multimap<uint256, CUnconnectedBlock>::iterator> range = mapBlocksUnconnected.equal_range(hashPrev);
+    for (multimap<uint256, CUnconnectedBlock>::iterator it = range.first; it != range.second; ++it) {
+        if (it->second.hash == hash)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * The blocks to fetch for a header announcement, as for an inv: the announced block and, if it
+ * builds on headers we don't have the blocks of, those blocks too. Returns false if it is more
+ * than MAX_OUT_OF_ORDER_BLOCKS past the block index. Requires cs_main.
+ */
+bool FindAnnouncedBlocksToFetch(const uint256& hash, const uint256& hashPrev, std::vector<uint256>& vBlocks)
+{
+    if (mapBlockIndex.count(hash))
+        return true;
+
+    std::deque<uint256> vBranch(1, hash);
+    uint256 hashWalk = hashPrev;
+    map<uint256, CHeaderEntry>::iterator it;
+    while (!mapBlockIndex.count(hashWalk)) {
+        if (vBranch.size() >= MAX_OUT_OF_ORDER_BLOCKS || (it = mapBlockHeaders.find(hashWalk)) == mapBlockHeaders.end())
+            return false;
+        vBranch.push_front(hashWalk);
+        hashWalk = it->second.hashPrev;
+    }
+    for (const uint256& hashBlock : vBranch) {
+        if (!mapBlocksInFlight.count(hashBlock) && !IsBlockUnconnected(hashWalk, hashBlock))
+            vBlocks.push_back(hashBlock);
+        hashWalk = hashBlock;
+    }
+    return true;
+}
+
+/** Forget peers' best headers that are gone and sync headers again from every peer. Requires cs_main. */
+void RestartHeadersSync()
+{
+    for (PAIRTYPE(const NodeId, CNodeState) & item : mapNodeState) {
+        CNodeState& state = item.second;
+        int nHeight;
+        uint256 nChainWork;
+        if (state.hashBestHeader != 0 && !LookupHeader(state.hashBestHeader, nHeight, nChainWork)) {
+            state.hashBestHeader = uint256(0);
+            state.nBestHeaderHeight = -1;
+            state.nBestHeaderWork = 0;
+        }
+        state.fSyncStarted = false;
+    }
+    nSyncStarted = 0;
+}
+
+/**
+ * Punish the peer that sent the end of vBestHeaders, about to be given up on because its blocks
+ * don't arrive, so it can't keep starting header chains that go nowhere. Requires cs_main.
+ */
+void PunishBestHeadersSource(int howmuch)
+{
+    map<uint256, CHeaderEntry>::iterator it = mapBlockHeaders.find(vBestHeaders.back());
+    if (it != mapBlockHeaders.end())
+        Misbehaving(it->second.nodeid, howmuch);
+}
+
+/**
+ * The most-work best header of a peer that isn't stalling, among those off vBestHeaders with
+ * more work than the active chain, or 0 if there is none. Requires cs_main.
+ */
+uint256 FindCompetingBestHeader()
+{
+    uint256 hashBest = 0;
+    uint256 nBestWork = chainActive.Tip()->nChainWork;
+    for (const PAIRTYPE(const NodeId, CNodeState) & item : mapNodeState) {
+        const CNodeState& state = item.second;
+        if (state.hashBestHeader == 0 || state.nStallingSince != 0 || state.nBestHeaderWork <= nBestWork)
+            continue;
+        if (IsBestHeader(state.hashBestHeader, state.nBestHeaderHeight) || !mapBlockHeaders.count(state.hashBestHeader))
+            continue;
+        hashBest = state.hashBestHeader;
+        nBestWork = state.nBestHeaderWork;
+    }
+    return hashBest;
+}
+
+/**
+ * Handle a vBestHeaders none of whose blocks has connected for a while. After
+ * HEADERS_STALL_TIMEOUT seconds it gives way to a competing branch another peer has its best
+ * header on, whatever its work. After HEADERS_DOWNLOAD_TIMEOUT seconds it is dropped, e.g.
+ * because no peer can serve it, and headers are synced again from every peer. Either way its
+ * source is punished, enough to be banned if it happens twice or on a drop. Returns whether
+ * vBestHeaders changed. Requires cs_main.
+ */
+bool CheckHeadersProgress(int64_t nNow)
+{
+    if (vBestHeaders.empty() || nNow - nBestHeadersProgressTime <= HEADERS_STALL_TIMEOUT)
+        return false;
+
+    uint256 hashCompeting = FindCompetingBestHeader();
+    if (hashCompeting != 0) {
+        LogPrintf("No block of the header chain at height %d arrived for %d seconds, switching to the branch of %s\n",
+            nBestHeadersBase, nNow - nBestHeadersProgressTime, hashCompeting.ToString());
+        PunishBestHeadersSource(50);
+        if (SetBestHeaders(hashCompeting)) {
+            nBestHeadersProgressTime = nNow;
+            return true;
+        }
+    }
+    if (nNow - nBestHeadersProgressTime <= HEADERS_DOWNLOAD_TIMEOUT)
+        return false;
+
+    LogPrintf("No block of the header chain at height %d arrived for %d seconds, dropping it\n",
+        nBestHeadersBase, nNow - nBestHeadersProgressTime);
+    PunishBestHeadersSource(100);
+    DropBestHeaders();
+    RestartHeadersSync();
+    return true;
+}
+
+/**
+ * Drop vBestHeaders as soon as no peer but nodeLeaving has its best header on it, as only those
+ * peers are asked for its blocks, and sync headers again from every peer. If nodeLeaving leaves
+ * because it stalled the download, the source of vBestHeaders is punished. Requires cs_main.
+ */
+bool CheckBestHeadersServed(NodeId nodeLeaving, bool fStalled)
+{
+    if (vBestHeaders.empty())
+        return false;
+    for (const PAIRTYPE(const NodeId, CNodeState) & item : mapNodeState) {
+        if (item.first != nodeLeaving && IsBestHeader(item.second.hashBestHeader, item.second.nBestHeaderHeight))
+            return false;
+    }
+
+    LogPrintf("No peer left to serve the header chain at height %d, dropping it\n", nBestHeadersBase);
+    if (fStalled)
+        PunishBestHeadersSource(100);
+    DropBestHeaders();
+    RestartHeadersSync();
+    return true;
+}
+
+/**
+ * Keep a block from our header chain that arrived before its parent. Returns false if its
+ * header isn't known, so the caller can fall back to "getblocks". Requires cs_main.
+ */
+bool StashUnconnectedBlock(NodeId nodeid, const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    if (!mapBlockHeaders.count(hash))
+        return false;
+    MarkBlockAsReceived(hash, nodeid, ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+
+    if (mapBlocksUnconnected.size() >= MAX_OUT_OF_ORDER_BLOCKS) {
+        // Drop blocks whose header chain was abandoned
+        multimap<uint256, CUnconnectedBlock>::iterator it = mapBlocksUnconnected.begin();
+        while (it != mapBlocksUnconnected.end()) {
+            if (!mapBlockHeaders.count(it->second.hash))
+                mapBlocksUnconnected.erase(it++);
+            else
+                it++;
+        }
+    }
+    if (mapBlocksUnconnected.size() >= MAX_OUT_OF_ORDER_BLOCKS || IsBlockUnconnected(block.hashPrevBlock, hash)) {
+        // It will be fetched again once it fits
+        LogPrint("net", "Not keeping unconnected block %s from peer=%d\n", hash.ToString(), nodeid);
+        return true;
+    }
+
+    CUnconnectedBlock entry;
+    entry.hash = hash;
+    entry.nodeid = nodeid;
+    entry.block = block;
+    mapBlocksUnconnected.insert(make_pair(block.hashPrevBlock, entry));
+    LogPrint("net", "Keeping block %s from peer=%d until its parent connects\n", hash.ToString(), nodeid);
+    return true;
+}
+
+/**
+ * Like FindNextBlocksToDownload, for the blocks of vBestHeaders that the peer has the header of.
+ * Blocks are fetched up to MAX_OUT_OF_ORDER_BLOCKS past the block index, so several peers can
+ * download in parallel while the ones that arrive early wait in mapBlocksUnconnected.
+ */
+void FindNextHeaderBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<uint256>& vBlocks, NodeId& nodeStaller)
+{
+    if (count == 0 || vBestHeaders.empty() || nBestHeadersWork <= chainActive.Tip()->nChainWork)
+        return;
+
+    CNodeState* state = State(nodeid);
+    assert(state != NULL);
+
+    // Only peers on our best header chain can serve it
+    int nPeerOffset = state->nBestHeaderHeight - nBestHeadersBase;
+    if (nPeerOffset < 0 || nPeerOffset >= (int)vBestHeaders.size() || vBestHeaders[nPeerOffset] != state->hashBestHeader)
+        return;
+
+    map<uint256, CHeaderEntry>::iterator itFirst = mapBlockHeaders.find(vBestHeaders.front());
+    BlockMap::iterator miParent = itFirst != mapBlockHeaders.end() ? mapBlockIndex.find(itFirst->second.hashPrev) : mapBlockIndex.end();
+    if (miParent == mapBlockIndex.end() || (miParent->second->nStatus & BLOCK_FAILED_MASK)) {
+        // The header chain builds on a block that turned out invalid
+        LogPrintf("Dropping header chain above invalid block at height %d\n", nBestHeadersBase - 1);
+        DropBestHeaders();
+        return;
+    }
+
+    // Never fetch further than the peer's best header, or more than MAX_OUT_OF_ORDER_BLOCKS + 1
+    // beyond the block index; the +1 is to detect stalling, as in FindNextBlocksToDownload.
+    int nWindowEnd = nBestHeadersBase - 1 + MAX_OUT_OF_ORDER_BLOCKS;
+    int nMaxHeight = std::min(state->nBestHeaderHeight, nWindowEnd + 1);
+    NodeId waitingfor = -1;
+    uint256 hashPrev = miParent->first;
+    for (int nHeight = nBestHeadersBase; nHeight <= nMaxHeight; nHeight++) {
+        const uint256& hash = vBestHeaders[nHeight - nBestHeadersBase];
+        if (!IsBlockUnconnected(hashPrev, hash)) {
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            if (itInFlight != mapBlocksInFlight.end()) {
+                if (waitingfor == -1)
+                    waitingfor = itInFlight->second.first;
+            } else {
+                if (nHeight > nWindowEnd) {
+                    // We reached the end of the window.
+                    if (vBlocks.size() == 0 && waitingfor != nodeid)
+                        nodeStaller = waitingfor;
+                    return;
+                }
+                vBlocks.push_back(hash);
+                if (vBlocks.size() == count)
+                    return;
+            }
+        }
+        hashPrev = hash;
+    }
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
 {
     LOCK(cs_main);
@@ -575,6 +1250,10 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksDelivered = state->nBlocksDelivered;
+    stats.nBytesDelivered = state->nBytesDelivered;
+    stats.nAvgBlockTime = state->nAvgBlockTime;
+    stats.nDownloadWindow = GetDownloadWindow(state->nAvgBlockTime);
     return true;
 }
 
@@ -610,6 +1289,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
     return chain.Genesis();
 }
 
+CCoinsViewDB* pcoinsdbview = NULL;
 CCoinsViewCache* pcoinsTip = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CSporkDB* pSporkDB = NULL;
@@ -897,12 +1577,11 @@ int GetInputAge(CTxIn& vin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
-        } else
+        if (!coin.IsSpent())
+            return (chainActive.Tip()->nHeight + 1) - (int)coin.nHeight;
+        else
             return -1;
     }
 }
@@ -1111,7 +1790,34 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
     return nMinFee;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+/**
+ * CheckInputs for a mempool candidate that runs the script checks of a
+ * multi-input transaction on the script verification threads. If any of
+ * them fails, the inputs are checked again serially so that state gets the
+ * same reject reason and DoS score as a plain CheckInputs call.
+ */
+static bool CheckMempoolInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads || tx.vin.size() < 2)
+        return CheckInputs(tx, state, view, true, flags, true);
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, view, true, flags, true, &vChecks))
+        return false;
+
+    // ConnectBlock only uses the queue under cs_main as well, so it is idle here
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    if (control.Wait())
+        return true;
+
+    return CheckInputs(tx, state, view, true, flags, true);
+}
+
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, std::vector<COutPoint>& vCoinsToUncache)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1159,15 +1865,19 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
             view.SetBackend(viewMemPool);
 
-            // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
-
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
+            // Spent and missing outputs look the same in the per-output UTXO set, so a
+            // transaction spending an already spent output is treated as an orphan here.
             for (const CTxIn& txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                    vCoinsToUncache.push_back(txin.prevout);
+                if (!view.HaveCoin(txin.prevout)) {
+                    // are inputs missing because we already have the tx? Only the
+                    // cache is checked, so this costs no database lookups.
+                    for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                        if (pcoinsTip->HaveCoinInCache(COutPoint(hash, o)))
+                            return false;
+                    }
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -1222,7 +1932,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+        if (!CheckMempoolInputs(tx, state, view, STANDARD_SCRIPT_VERIFY_FLAGS)) {
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
 
@@ -1235,7 +1945,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
+        if (!CheckMempoolInputs(tx, state, view, MANDATORY_SCRIPT_VERIFY_FLAGS)) {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
@@ -1248,7 +1958,19 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
-bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    std::vector<COutPoint> vCoinsToUncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees, vCoinsToUncache);
+    // Don't let rejected transactions fill the coins cache with their inputs
+    if (!res) {
+        for (const COutPoint& outpoint : vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
+    }
+    return res;
+}
+
+static bool AcceptableInputsWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX, std::vector<COutPoint>& vCoinsToUncache)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1286,15 +2008,19 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
             CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
             view.SetBackend(viewMemPool);
 
-            // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
-
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
-            for (const CTxIn txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+            // Spent and missing outputs look the same in the per-output UTXO set, so a
+            // transaction spending an already spent output is treated as an orphan here.
+            for (const CTxIn& txin : tx.vin) {
+                if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                    vCoinsToUncache.push_back(txin.prevout);
+                if (!view.HaveCoin(txin.prevout)) {
+                    // are inputs missing because we already have the tx? Only the
+                    // cache is checked, so this costs no database lookups.
+                    for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                        if (pcoinsTip->HaveCoinInCache(COutPoint(hash, o)))
+                            return false;
+                    }
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -1415,6 +2141,17 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     return true;
 }
 
+bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
+{
+    std::vector<COutPoint> vCoinsToUncache;
+    bool res = AcceptableInputsWorker(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, isDSTX, vCoinsToUncache);
+    if (!res) {
+        for (const COutPoint& outpoint : vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
+    }
+    return res;
+}
+
 bool GetOutput(const uint256& hash, unsigned int index, CValidationState& state, CTxOut& out)
 {
     CTransaction txPrev;
@@ -1468,10 +2205,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
-                CCoinsViewCache& view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1793,20 +2529,21 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         for (const CTxIn& txin : tx.vin) {
-            txundo.vprevout.push_back(CTxInUndo());
-            bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
-            assert(ret);
+            Coin coin;
+            bool is_spent = inputs.SpendCoin(txin.prevout, &coin);
+            assert(is_spent);
+            txundo.vprevout.push_back(CTxInUndo(coin.out, coin.fCoinBase, coin.fCoinStake, coin.nHeight));
         }
     }
 
     // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 bool CScriptCheck::operator()()
 {
     const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, sighashCache.get()), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
@@ -1831,20 +2568,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                if (nSpendHeight - coins->nHeight < Params().COINBASE_MATURITY())
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                if (nSpendHeight - (int)coin.nHeight < Params().COINBASE_MATURITY())
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coins->nHeight, coins->IsCoinStake()),
+                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - (int)coin.nHeight, coin.IsCoinStake()),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                     REJECT_INVALID, "bad-txns-inputvalues-outofrange");
         }
@@ -1872,13 +2609,18 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Share the signature hash midstates between all inputs of multi-input transactions
+            boost::shared_ptr<const CTransactionSigHashCache> sighashCache;
+            if (tx.vin.size() > 1)
+                sighashCache.reset(new CTransactionSigHashCache(tx));
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, sighashCache);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1890,8 +2632,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
-                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                        CScriptCheck check(coin.out, tx, i,
+                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, sighashCache);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1911,6 +2653,33 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
+/**
+ * Restore the output spent by a transaction input from its undo record.
+ * Returns false if the record can not be applied at all; fClean is cleared
+ * when it was applied on top of an unexpected UTXO state.
+ */
+static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out, bool& fClean)
+{
+    bool fOverwrite = view.HaveCoin(out);
+    if (fOverwrite)
+        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
+
+    Coin coin(undo.txout, undo.nHeight, undo.fCoinBase, undo.fCoinStake);
+    if (undo.nHeight == 0) {
+        // Undo records written by the per-transaction UTXO set only carry the
+        // metadata for the last spent output of a transaction, so it must still
+        // be present on some other output of the same transaction.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return error("DisconnectBlock() : undo data adding output to missing transaction");
+        coin.nHeight = alternate.nHeight;
+        coin.fCoinBase = alternate.fCoinBase;
+        coin.fCoinStake = alternate.fCoinStake;
+    }
+    view.AddCoin(out, std::move(coin), fOverwrite);
+    return true;
+}
+
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     if (pindex->GetBlockHash() != view.GetBestBlock())
@@ -1939,25 +2708,16 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly. Note that transactions with only provably unspendable outputs won't
-        // have outputs available even in the block itself, so we handle that case
-        // specially with outsEmpty.
-        {
-            CCoins outsEmpty;
-            CCoinsModifier outs = view.ModifyCoins(hash);
-            outs->ClearUnspendable();
-
-            CCoins outsBlock(tx, pindex->nHeight);
-            // The CCoins serialization does not serialize negative numbers.
-            // No network rules currently depend on the version here, so an inconsistency is harmless
-            // but it must be corrected before txout nversion ever influences a network rule.
-            if (outsBlock.nVersion < 0)
-                outs->nVersion = outsBlock.nVersion;
-            if (*outs != outsBlock)
+        // exactly, removing them from the view. Provably unspendable outputs were never
+        // added, so they are skipped.
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            if (tx.vout[o].scriptPubKey.IsUnspendable())
+                continue;
+            Coin coin;
+            bool is_spent = view.SpendCoin(COutPoint(hash, o), &coin);
+            if (!is_spent || tx.vout[o] != coin.out || (unsigned int)pindex->nHeight != coin.nHeight ||
+                tx.IsCoinBase() != coin.IsCoinBase() || tx.IsCoinStake() != coin.IsCoinStake())
                 fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-            // remove outputs
-            outs->Clear();
         }
 
         // restore inputs
@@ -1968,24 +2728,8 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint& out = tx.vin[j].prevout;
                 const CTxInUndo& undo = txundo.vprevout[j];
-                CCoinsModifier coins = view.ModifyCoins(out.hash);
-                if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
-                } else {
-                    if (coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
-                }
-                if (coins->IsAvailable(out.n))
-                    fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins->vout.size() < out.n + 1)
-                    coins->vout.resize(out.n + 1);
-                coins->vout[out.n] = undo.txout;
+                if (!ApplyTxInUndo(undo, view, out, fClean))
+                    return false;
 
                 LOCK(cs_mapstake);
                 // erase the spent input
@@ -2030,8 +2774,6 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck()
 {
     RenameThread("xdna-scriptch");
@@ -2086,10 +2828,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         for(const CTransaction& tx : block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                    REJECT_INVALID, "bad-txns-BIP30");
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
+                        REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -2260,50 +3003,146 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+/**
+ * A flush handed to ThreadFlushChainstate: the block index records queued
+ * here, followed by the coins staged in pcoinsdbview.
+ */
+static boost::mutex cs_flushQueue;
+static boost::condition_variable cvFlushQueue;
+static CLevelDBBatch* pbatchFlushQueued = NULL;
+static bool fFlushQueued = false;
+//! Held by whichever thread is writing the queued flush
+static boost::mutex cs_flushWrite;
+//! Set while ThreadFlushChainstate is running and able to take flushes
+static std::atomic<bool> fBackgroundFlush(false);
+
+/** Write the queued flush, if any. Block index entries are synced before the coins that may refer to them. */
+static bool WriteQueuedFlush()
+{
+    boost::mutex::scoped_lock lockWrite(cs_flushWrite);
+    CLevelDBBatch* pbatch;
+    {
+        boost::mutex::scoped_lock lock(cs_flushQueue);
+        if (!fFlushQueued)
+            return true;
+        pbatch = pbatchFlushQueued;
+    }
+    int64_t nStart = GetTimeMicros();
+    // On failure everything stays queued, so a later attempt writes it again.
+    if (!pblocktree->WriteBatch(*pbatch, true))
+        return false;
+    if (!pcoinsdbview->WriteStaged())
+        return false;
+    {
+        boost::mutex::scoped_lock lock(cs_flushQueue);
+        delete pbatchFlushQueued;
+        pbatchFlushQueued = NULL;
+        fFlushQueued = false;
+    }
+    cvFlushQueue.notify_all();
+    LogPrint("bench", "  - Chainstate write: %.2fms\n", 0.001 * (GetTimeMicros() - nStart));
+    return true;
+}
+
+void ThreadFlushChainstate()
+{
+    RenameThread("xdna-flush");
+    fBackgroundFlush = true;
+    try {
+        while (true) {
+            {
+                boost::mutex::scoped_lock lock(cs_flushQueue);
+                while (!fFlushQueued)
+                    cvFlushQueue.wait(lock);
+            }
+            if (!WriteQueuedFlush()) {
+                AbortNode("Failed to write chainstate in the background");
+                break;
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        fBackgroundFlush = false;
+        throw;
+    } catch (const std::runtime_error& e) {
+        AbortNode(std::string("System error while flushing: ") + e.what());
+    }
+    // Anything still queued is written by the next synchronous flush.
+    fBackgroundFlush = false;
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
  * fast is not set and it's been a while since the last write.
+ * Unless mode is FLUSH_STATE_ALWAYS and while the background flush thread
+ * runs, the dirty state is snapshotted and written by that thread, and
+ * validation continues on an empty coins cache in the meantime.
  */
 bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
     try {
+        size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // Coins staged for the flush thread stay in memory until they are written,
+        // so they count against the cache limit too. When together they exceed it,
+        // wait for that write instead of staging a second, small batch behind it.
+        if (mode != FLUSH_STATE_ALWAYS && cacheSize <= nCoinCacheUsage &&
+            cacheSize + pcoinsdbview->GetStagedUsage() > nCoinCacheUsage) {
+            if (!WriteQueuedFlush())
+                return state.Abort("Failed to write to coin database");
+        }
         if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && cacheSize > nCoinCacheUsage) ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
-            // Typical CCoins structures on disk are around 100 bytes in size.
+            // A previous flush still in flight has to be on disk before this one.
+            if (!WriteQueuedFlush())
+                return state.Abort("Failed to write to coin database");
+            // Typical Coin structures on disk are around 48 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
             // an overestimation, as most will delete an existing entry or
             // overwrite one. Still, use a conservative safety factor of 2.
-            if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+            if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
             FlushBlockFile();
-            // Then update all block file information (which may refer to block and undo files).
+            // Then collect all block file information (which may refer to block and undo files)
+            // and the dirty block index entries.
+            std::unique_ptr<CLevelDBBatch> pbatch(new CLevelDBBatch());
             bool fileschanged = false;
             for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end();) {
-                if (!pblocktree->WriteBlockFileInfo(*it, vinfoBlockFile[*it])) {
-                    return state.Abort("Failed to write to block index");
-                }
+                pblocktree->WriteBlockFileInfo(*pbatch, *it, vinfoBlockFile[*it]);
                 fileschanged = true;
                 setDirtyFileInfo.erase(it++);
             }
-            if (fileschanged && !pblocktree->WriteLastBlockFile(nLastBlockFile)) {
-                return state.Abort("Failed to write to block index");
-            }
+            if (fileschanged)
+                pblocktree->WriteLastBlockFile(*pbatch, nLastBlockFile);
             for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end();) {
-                if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(*it))) {
-                    return state.Abort("Failed to write to block index");
-                }
+                pblocktree->WriteBlockIndex(*pbatch, CDiskBlockIndex(*it));
                 setDirtyBlockIndex.erase(it++);
             }
-            pblocktree->Sync();
-            // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
-                return state.Abort("Failed to write to coin database");
+            if (fBackgroundFlush && mode != FLUSH_STATE_ALWAYS) {
+                // Hand the dirty coins over to the database view, which keeps serving
+                // them until the flush thread has written them after the block index.
+                pcoinsdbview->SetStageWrites(true);
+                bool fStaged = pcoinsTip->Flush();
+                pcoinsdbview->SetStageWrites(false);
+                {
+                    boost::mutex::scoped_lock lock(cs_flushQueue);
+                    pbatchFlushQueued = pbatch.release();
+                    fFlushQueued = true;
+                }
+                cvFlushQueue.notify_all();
+                if (!fStaged)
+                    return state.Abort("Failed to write to coin database");
+            } else {
+                if (!pblocktree->WriteBatch(*pbatch, true))
+                    return state.Abort("Failed to write to block index");
+                // Finally flush the chainstate (which may refer to block index entries).
+                if (!pcoinsTip->Flush())
+                    return state.Abort("Failed to write to coin database");
+            }
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
                 GetMainSignals().SetBestChain(chainActive.GetLocator());
@@ -2331,10 +3170,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d version=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d version=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utxo)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), chainActive.Tip()->nVersion, log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2754,10 +3593,34 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
+                // Peers that asked for it get the block itself as a compact block, saving the inv/getdata round trip
+                bool fHaveNewTip = pblock && pblock->GetHash() == hashNewTip;
+                CBlockHeaderAndShortTxIDs cmpctblock;
+                bool fCompactBuilt = false;
                 LOCK(cs_vNodes);
-                for (CNode* pnode : vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                for (CNode* pnode : vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    bool fKnown;
+                    {
+                        LOCK(pnode->cs_inventory);
+                        fKnown = pnode->filterInventoryKnown.contains(CNode::GetInventoryKey(CInv(MSG_BLOCK, hashNewTip)));
+                    }
+                    if (fHaveNewTip && pnode->fPreferCompactBlocks && !fKnown) {
+                        if (!fCompactBuilt) {
+                            cmpctblock = CBlockHeaderAndShortTxIDs(*pblock);
+                            fCompactBuilt = true;
+                        }
+                        pnode->PushMessage("cmpctblock", cmpctblock);
+                        pnode->AddInventoryKnown(CInv(MSG_BLOCK, hashNewTip));
+                    } else if (pnode->fPreferHeaders && !fKnown) {
+                        // A header lets the peer extend its header chain and fetch the block in one round trip
+                        pnode->PushMessage("headers", vector<CBlock>(1, pindexNewTip->GetBlockHeader()));
+                        pnode->AddInventoryKnown(CInv(MSG_BLOCK, hashNewTip));
+                    } else {
                         pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -2861,8 +3724,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(CBlockIndex(block));
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -2883,9 +3745,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
         // ppcoin: compute stake entropy bit for stake modifier
         if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
@@ -2912,6 +3771,18 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
 
+    // The header chain now starts above this block
+    map<uint256, CHeaderEntry>::iterator itHeader = mapBlockHeaders.find(hash);
+    if (itHeader != mapBlockHeaders.end())
+        EraseBlockHeader(itHeader);
+    if (!vBestHeaders.empty() && vBestHeaders.front() == hash) {
+        vBestHeaders.pop_front();
+        nBestHeadersBase++;
+        nBestHeadersProgressTime = GetTime();
+        if (vBestHeaders.empty())
+            nBestHeadersWork = 0;
+    }
+
     //update previous block pointer
     if (pindexNew->nHeight)
         pindexNew->pprev->pnext = pindexNew;
@@ -3056,9 +3927,168 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+/** Minimum number of transactions for CheckBlock to use the block check threads */
+static const unsigned int MIN_PARALLEL_CHECKBLOCK_TXS = 64;
+/** Number of transactions per CheckTransaction job */
+static const unsigned int CHECKBLOCK_TXS_PER_JOB = 16;
+/** Number of merkle node pairs hashed per job */
+static const unsigned int CHECKBLOCK_MERKLE_PAIRS_PER_JOB = 128;
+
+/** A unit of context-free block validation work for the block check threads */
+class CBlockCheck
 {
-    // These are checks that are independent of context.
+private:
+    boost::function<void()> func;
+
+public:
+    CBlockCheck() {}
+    explicit CBlockCheck(const boost::function<void()>& funcIn) : func(funcIn) {}
+
+    bool operator()()
+    {
+        func();
+        return true;
+    }
+
+    void swap(CBlockCheck& check) { func.swap(check.func); }
+};
+
+static CCheckQueue<CBlockCheck> blockcheckqueue(4);
+//! CheckBlock can run on several threads at once, but a queue only supports one master
+static boost::mutex cs_blockcheckqueue;
+
+void ThreadBlockCheck()
+{
+    RenameThread("xdna-blockchk");
+    blockcheckqueue.Thread();
+}
+
+static void HashMerkleNodes(std::vector<uint256>* pvMerkleTree, int nLevel, int nSize, int nBegin, int nEnd)
+{
+    std::vector<uint256>& vMerkleTree = *pvMerkleTree;
+    int nPairs = (std::min(nEnd, nSize & ~1) - nBegin) / 2;
+    SHA256D64(vMerkleTree[nLevel + nSize + nBegin / 2].begin(), vMerkleTree[nLevel + nBegin].begin(), nPairs);
+    if (nEnd == nSize && nSize % 2) {
+        // An odd level pairs its last hash with itself
+        const uint256& last = vMerkleTree[nLevel + nSize - 1];
+        vMerkleTree[nLevel + nSize + nSize / 2] = Hash(BEGIN(last), END(last), BEGIN(last), END(last));
+    }
+}
+
+/**
+ * Check transactions [nBegin, nEnd) of a block and count their legacy sigops, lowering
+ * *pnFirstInvalid to the first one that fails. Transactions after a known failure are
+ * skipped. Nothing is logged; CheckTransactionsParallel reports the failure.
+ */
+static void CheckTransactionRange(const CBlock* pblock, unsigned int nBegin, unsigned int nEnd, std::atomic<unsigned int>* pnFirstInvalid, std::vector<unsigned int>* pvSigOps)
+{
+    SuppressThreadLog(true);
+    for (unsigned int i = nBegin; i < nEnd && i < *pnFirstInvalid; i++) {
+        CValidationState state;
+        if (!CheckTransaction(pblock->vtx[i], state, pblock->GetBlockTime())) {
+            unsigned int nFirstInvalid = *pnFirstInvalid;
+            while (i < nFirstInvalid && !pnFirstInvalid->compare_exchange_weak(nFirstInvalid, i)) {
+            }
+            break;
+        }
+        (*pvSigOps)[i] = GetLegacySigOpCount(pblock->vtx[i]);
+    }
+    SuppressThreadLog(false);
+}
+
+/**
+ * Build the merkle tree of a block on the block check threads. Fills
+ * block.vMerkleTree and fMutated exactly like CBlock::BuildMerkleTree. Returns
+ * false without doing anything if the block is too small or the threads are
+ * unavailable.
+ */
+static bool BuildMerkleTreeParallel(const CBlock& block, bool* fMutated)
+{
+    if (!nScriptCheckThreads || block.vtx.size() < MIN_PARALLEL_CHECKBLOCK_TXS)
+        return false;
+    boost::unique_lock<boost::mutex> lock(cs_blockcheckqueue, boost::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+    CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+
+    size_t nNodes = 0;
+    for (int nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        nNodes += nSize;
+    std::vector<uint256>& vMerkleTree = block.vMerkleTree;
+    vMerkleTree.clear();
+    vMerkleTree.resize(nNodes + 1);
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        vMerkleTree[i] = block.vtx[i].GetHash();
+
+    // Each level only depends on the one below it, so hash a level at a time
+    int j = 0;
+    bool mutated = false;
+    for (int nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2) {
+        // Two identical hashes at the end of the list at a particular level (CVE-2012-2459)
+        if (nSize % 2 == 0 && vMerkleTree[j + nSize - 2] == vMerkleTree[j + nSize - 1])
+            mutated = true;
+        std::vector<CBlockCheck> vChecks;
+        for (int i = 0; i < nSize; i += 2 * CHECKBLOCK_MERKLE_PAIRS_PER_JOB) {
+            int nEnd = std::min(i + 2 * (int)CHECKBLOCK_MERKLE_PAIRS_PER_JOB, nSize);
+            vChecks.push_back(CBlockCheck(boost::bind(&HashMerkleNodes, &vMerkleTree, j, nSize, i, nEnd)));
+        }
+        control.Add(vChecks);
+        control.Wait();
+        j += nSize;
+    }
+    if (fMutated)
+        *fMutated = mutated;
+    return true;
+}
+
+/**
+ * Run CheckTransaction and count legacy sigops for the transactions of a
+ * block on the block check threads. fValid and state report the first
+ * failing transaction, like checking them in order would, and only its
+ * error is logged. Returns false
+ * without doing anything if the block is too small or the threads are
+ * unavailable.
+ */
+static bool CheckTransactionsParallel(const CBlock& block, CValidationState& state, bool& fValid, unsigned int& nSigOps)
+{
+    if (!nScriptCheckThreads || block.vtx.size() < MIN_PARALLEL_CHECKBLOCK_TXS)
+        return false;
+    boost::unique_lock<boost::mutex> lock(cs_blockcheckqueue, boost::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+
+    std::atomic<unsigned int> nFirstInvalid(block.vtx.size());
+    std::vector<unsigned int> vSigOps(block.vtx.size(), 0);
+    {
+        CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+        std::vector<CBlockCheck> vChecks;
+        for (unsigned int i = 0; i < block.vtx.size(); i += CHECKBLOCK_TXS_PER_JOB) {
+            unsigned int nEnd = std::min(i + CHECKBLOCK_TXS_PER_JOB, (unsigned int)block.vtx.size());
+            vChecks.push_back(CBlockCheck(boost::bind(&CheckTransactionRange, &block, i, nEnd, &nFirstInvalid, &vSigOps)));
+        }
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    if (nFirstInvalid < block.vtx.size()) {
+        // Check the failing transaction again here, so its error is logged once and
+        // state is filled in exactly as by the serial loop.
+        CheckTransaction(block.vtx[nFirstInvalid], state, block.GetBlockTime());
+        fValid = false;
+        return true;
+    }
+    fValid = true;
+    nSigOps = 0;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        nSigOps += vSigOps[i];
+    return true;
+}
+
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig, bool fCheckChainState)
+{
+    // These are checks that are independent of context, except for the
+    // reward and payment checks of blocks on top of the active chain, which
+    // fCheckChainState turns off.
 
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
@@ -3075,7 +4105,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // Check the merkle root.
     if (fCheckMerkleRoot) {
         bool mutated;
-        uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
+        uint256 hashMerkleRoot2;
+        if (BuildMerkleTreeParallel(block, &mutated))
+            hashMerkleRoot2 = block.vMerkleTree.back();
+        else
+            hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
             return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"),
                 REJECT_INVALID, "bad-txnmrklroot", true);
@@ -3121,7 +4155,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     }
     else {
             int nHeight = 0;
-            CBlockIndex* pindexPrev = chainActive.Tip();
+            CBlockIndex* pindexPrev = fCheckChainState ? chainActive.Tip() : NULL;
             if (!pindexPrev)
                 nHeight = 0;
             else
@@ -3167,7 +4201,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     }
 
     // masternode payments
-    CBlockIndex* pindexPrev = chainActive.Tip();
+    CBlockIndex* pindexPrev = fCheckChainState ? chainActive.Tip() : NULL;
     int nHeight = 0;
     if (pindexPrev != NULL) {
         if (pindexPrev->GetBlockHash() == block.hashPrevBlock) {
@@ -3197,13 +4231,19 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     }
 
     // Check transactions
-    for (const CTransaction& tx : block.vtx)
-        if (!CheckTransaction(tx, state, block.GetBlockTime()))
+    unsigned int nSigOps = 0;
+    bool fTransactionsValid;
+    if (CheckTransactionsParallel(block, state, fTransactionsValid, nSigOps)) {
+        if (!fTransactionsValid)
             return error("CheckBlock() : CheckTransaction failed");
+    } else {
+        for (const CTransaction& tx : block.vtx)
+            if (!CheckTransaction(tx, state, block.GetBlockTime()))
+                return error("CheckBlock() : CheckTransaction failed");
 
-    unsigned int nSigOps = 0;
-    for (const CTransaction& tx : block.vtx) {
-        nSigOps += GetLegacySigOpCount(tx);
+        for (const CTransaction& tx : block.vtx) {
+            nSigOps += GetLegacySigOpCount(tx);
+        }
     }
 
     unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE / 50;
@@ -3670,7 +4710,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     {
         LOCK(cs_main);   // Replaces the former TRY_LOCK loop because busy waiting wastes too much resources
 
-        MarkBlockAsReceived (pblock->GetHash ());
+        MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1, ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
         if (!checked) {
             return error ("%s : CheckBlock FAILED for block %s", __func__, pblock->GetHash().GetHex());
         }
@@ -3867,9 +4907,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(CBlockIndex());
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
     //mark as PoS seen
@@ -3881,10 +4919,19 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+/** Compute the proofs of vSortedByHeight[nBegin], vSortedByHeight[nBegin + nStep], ... into *pvProof. */
+static void ComputeBlockProofs(const vector<pair<int, CBlockIndex*> >* pvSortedByHeight, vector<uint256>* pvProof, size_t nBegin, size_t nStep)
+{
+    for (size_t i = nBegin; i < pvSortedByHeight->size(); i += nStep)
+        (*pvProof)[i] = GetBlockProof(*(*pvSortedByHeight)[i].second);
+}
+
 bool static LoadBlockIndexDB(string& strError)
 {
+    int64_t nStart = GetTimeMillis();
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
+    int64_t nLoaded = GetTimeMillis();
 
     boost::this_thread::interruption_point();
 
@@ -3896,9 +4943,20 @@ bool static LoadBlockIndexDB(string& strError)
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    for (const PAIRTYPE(int, CBlockIndex*) & item : vSortedByHeight) {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+
+    // The per-block proofs are independent 256-bit divisions, so compute them
+    // on all cores; only the running sum below has to follow the chain.
+    vector<uint256> vProof(vSortedByHeight.size());
+    {
+        unsigned int nThreads = std::max(1u, boost::thread::hardware_concurrency());
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&ComputeBlockProofs, &vSortedByHeight, &vProof, i, nThreads));
+        threads.join_all();
+    }
+    for (size_t i = 0; i < vSortedByHeight.size(); i++) {
+        CBlockIndex* pindex = vSortedByHeight[i].second;
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + vProof[i];
         if (pindex->nStatus & BLOCK_HAVE_DATA) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
@@ -3920,6 +4978,7 @@ bool static LoadBlockIndexDB(string& strError)
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    int64_t nLinked = GetTimeMillis();
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -3953,6 +5012,8 @@ bool static LoadBlockIndexDB(string& strError)
             return false;
         }
     }
+    LogPrintf("%s: block index loaded in %dms (entries %dms, chain work %dms, block files %dms)\n", __func__,
+        GetTimeMillis() - nStart, nLoaded - nStart, nLinked - nLoaded, GetTimeMillis() - nLinked);
 
     //Check if the shutdown procedure was followed on last client exit
     bool fLastShutdownWasPrepared = true;
@@ -4053,67 +5114,120 @@ bool static LoadBlockIndexDB(string& strError)
     return true;
 }
 
-CVerifyDB::CVerifyDB()
+/** Work shared by the threads running the context-free VerifyDB checks (levels 0 to 2). */
+struct CVerifyDBJob {
+    const std::vector<CBlockIndex*>& vIndex;
+    int nCheckLevel;
+    std::atomic<size_t> nNext;
+    std::atomic<size_t> nDone;
+    std::atomic<unsigned int> nRunning;
+    boost::mutex cs;
+    //! Position in vIndex of the failed block nearest to the tip, or vIndex.size()
+    size_t nFailed;
+    std::string strError;
+
+    CVerifyDBJob(const std::vector<CBlockIndex*>& vIndexIn, int nCheckLevelIn, unsigned int nThreads) : vIndex(vIndexIn), nCheckLevel(nCheckLevelIn), nNext(0), nDone(0), nRunning(nThreads), nFailed(vIndexIn.size()) {}
+};
+
+/**
+ * Read and check the blocks of job->vIndex handed out in turn. This runs
+ * without cs_main, so CheckBlock leaves out its checks against the active
+ * chain and the masternode payments, which also record rejected blocks.
+ */
+static void VerifyBlocksContextFree(CVerifyDBJob* job)
 {
-    uiInterface.ShowProgress(_("Verifying blocks..."), 0);
+    const std::vector<CBlockIndex*>& vIndex = job->vIndex;
+    for (size_t i = job->nNext++; i < vIndex.size() && !ShutdownRequested(); i = job->nNext++) {
+        {
+            boost::mutex::scoped_lock lock(job->cs);
+            if (i > job->nFailed)
+                break;
+        }
+        CBlockIndex* pindex = vIndex[i];
+        std::string strError;
+        CBlock block;
+        CValidationState state;
+        // check level 0: read from disk
+        if (!ReadBlockFromDisk(block, pindex))
+            strError = strprintf("ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        // check level 1: verify block validity
+        else if (job->nCheckLevel >= 1 && !CheckBlock(block, state, true, true, true, false))
+            strError = strprintf("found bad block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        // check level 2: verify undo validity
+        else if (job->nCheckLevel >= 2) {
+            CBlockUndo undo;
+            CDiskBlockPos pos = pindex->GetUndoPos();
+            if (!pos.IsNull() && !undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                strError = strprintf("found bad undo data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        }
+        if (!strError.empty()) {
+            boost::mutex::scoped_lock lock(job->cs);
+            if (i < job->nFailed) {
+                job->nFailed = i;
+                job->strError = strError;
+            }
+        }
+        job->nDone++;
+    }
+    job->nRunning--;
 }
 
-CVerifyDB::~CVerifyDB()
+/**
+ * Run the VerifyDB checks up to level 2, which don't depend on the coins, on the blocks of
+ * vIndex (tip first) on nThreads threads, each reading ahead of the others. On failure the
+ * error of the failed block nearest the tip is returned, the one a walk from the tip would
+ * have found first.
+ */
+bool CheckBlocksContextFree(const std::vector<CBlockIndex*>& vIndex, int nCheckLevel, unsigned int nThreads, int nProgressSpan, std::string& strError)
 {
-    uiInterface.ShowProgress("", 100);
+    CVerifyDBJob job(vIndex, nCheckLevel, nThreads);
+    {
+        // The workers use this stack frame, so don't let an interruption end it early.
+        boost::this_thread::disable_interruption di;
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&VerifyBlocksContextFree, &job));
+        while (job.nRunning > 0) {
+            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)((double)job.nDone / (double)vIndex.size() * nProgressSpan))));
+            MilliSleep(100);
+        }
+        threads.join_all();
+    }
+    if (job.nFailed < vIndex.size()) {
+        strError = job.strError;
+        return false;
+    }
+    return true;
 }
 
-bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
+/** VerifyDB levels 3 and 4, which disconnect and reconnect the blocks in chain order. Requires cs_main. */
+static bool VerifyDBCoins(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
 {
-    LOCK(cs_main);
-    if (chainActive.Tip() == NULL || chainActive.Tip()->pprev == NULL)
-        return true;
-
-    // Verify blocks in the best chain
-    if (nCheckDepth <= 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > chainActive.Height())
-        nCheckDepth = chainActive.Height();
-    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
     CCoinsViewCache coins(coinsview);
     CBlockIndex* pindexState = chainActive.Tip();
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
+    // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
     for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
         boost::this_thread::interruption_point();
-        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
+        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 50 + (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 25 : 50)))));
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex))
-            return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state))
-            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            }
-        }
-        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
-            bool fClean = true;
-            if (!DisconnectBlock(block, state, pindex, coins, &fClean))
-                return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexState = pindex->pprev;
-            if (!fClean) {
-                nGoodTransactions = 0;
-                pindexFailure = pindex;
-            } else
-                nGoodTransactions += block.vtx.size();
-        }
+        if (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage)
+            break;
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        bool fClean = true;
+        if (!DisconnectBlock(block, state, pindex, coins, &fClean))
+            return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        pindexState = pindex->pprev;
+        if (!fClean) {
+            nGoodTransactions = 0;
+            pindexFailure = pindex;
+        } else
+            nGoodTransactions += block.vtx.size();
         if (ShutdownRequested())
             return true;
     }
@@ -4125,7 +5239,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         CBlockIndex* pindex = pindexState;
         while (pindex != chainActive.Tip()) {
             boost::this_thread::interruption_point();
-            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))));
+            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 25))));
             pindex = chainActive.Next(pindex);
             CBlock block;
             if (!ReadBlockFromDisk(block, pindex))
@@ -4140,6 +5254,67 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
     return true;
 }
 
+CVerifyDB::CVerifyDB()
+{
+    uiInterface.ShowProgress(_("Verifying blocks..."), 0);
+}
+
+CVerifyDB::~CVerifyDB()
+{
+    uiInterface.ShowProgress("", 100);
+}
+
+bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
+{
+    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
+    for (int nTry = 1;; nTry++) {
+        std::vector<CBlockIndex*> vIndex;
+        CBlockIndex* pindexTip;
+        int nDepth = nCheckDepth;
+        {
+            LOCK(cs_main);
+            pindexTip = chainActive.Tip();
+            if (pindexTip == NULL || pindexTip->pprev == NULL)
+                return true;
+
+            // Verify blocks in the best chain
+            if (nDepth <= 0)
+                nDepth = 1000000000; // suffices until the year 19000
+            if (nDepth > chainActive.Height())
+                nDepth = chainActive.Height();
+            LogPrintf("Verifying last %i blocks at level %i\n", nDepth, nCheckLevel);
+            for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev; pindex = pindex->pprev) {
+                if (pindex->nHeight < chainActive.Height() - nDepth)
+                    break;
+                vIndex.push_back(pindex);
+            }
+        }
+
+        // Levels 0 to 2 run without cs_main, on several threads.
+        int64_t nStart = GetTimeMillis();
+        unsigned int nThreads = std::max(1u, std::min(boost::thread::hardware_concurrency(), MAX_VERIFYDB_THREADS));
+        std::string strError;
+        bool fCheckedBlocks = CheckBlocksContextFree(vIndex, nCheckLevel, nThreads, nCheckLevel >= 3 ? 50 : 100, strError);
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return true;
+        if (!fCheckedBlocks)
+            return error("VerifyDB() : *** %s", strError);
+        LogPrintf("Checked %u blocks on %u threads in %dms\n", vIndex.size(), nThreads, GetTimeMillis() - nStart);
+        if (nCheckLevel < 3)
+            return true;
+
+        // Disconnecting and reconnecting has to follow the chain in order, from the tip the
+        // blocks above were taken from.
+        LOCK(cs_main);
+        if (chainActive.Tip() == pindexTip)
+            return VerifyDBCoins(coinsview, nCheckLevel, nDepth);
+        if (nTry >= MAX_VERIFYDB_TRIES)
+            return error("VerifyDB() : *** the chain tip kept moving, giving up after %d tries", nTry);
+        LogPrintf("VerifyDB(): the chain tip moved from height %d to %d while verifying, starting over\n", pindexTip->nHeight, chainActive.Height());
+    }
+}
+
 void UnloadBlockIndex()
 {
     LOCK(cs_main);
@@ -4158,15 +5333,21 @@ void UnloadBlockIndex()
     mapBlockSource.clear();
     mapBlocksInFlight.clear();
     nQueuedValidatedHeaders = 0;
+    mapBlockHeaders.clear();
+    vBestHeaders.clear();
+    nBestHeadersBase = 0;
+    nBestHeadersWork = 0;
+    nBestHeadersProgressTime = 0;
+    for (PAIRTYPE(const NodeId, CNodeState) & item : mapNodeState)
+        item.second.nHeadersStored = 0;
+    mapBlocksUnconnected.clear();
     nPreferredDownload = 0;
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
     mapNodeState.clear();
 
-    for (BlockMap::value_type& entry : mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
 }
 
 bool LoadBlockIndex(string& strError)
@@ -4318,6 +5499,241 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
     return nLoaded > 0;
 }
 
+/** Move nOffset to the next message start in file, at or after nOffset. Returns false at the end of the file. */
+static bool FindMessageStart(FILE* file, const unsigned char* pchMessageStart, uint64_t& nOffset)
+{
+    std::vector<unsigned char> vBuf(1 << 16);
+    while (!ShutdownRequested()) {
+        if (fseek(file, nOffset, SEEK_SET))
+            return false;
+        size_t nRead = fread(&vBuf[0], 1, vBuf.size(), file);
+        if (nRead < MESSAGE_START_SIZE)
+            return false;
+        const unsigned char* pBegin = &vBuf[0];
+        const unsigned char* pStart = std::search(pBegin, pBegin + nRead, pchMessageStart, pchMessageStart + MESSAGE_START_SIZE);
+        if (pStart != pBegin + nRead) {
+            nOffset += pStart - pBegin;
+            return true;
+        }
+        // Keep the tail, it may hold the beginning of a message start.
+        nOffset += nRead - (MESSAGE_START_SIZE - 1);
+    }
+    return false;
+}
+
+/**
+ * Record the hash, parent and position of every block in blk file nFile.
+ * Only the record and block headers are read; block bodies are skipped.
+ */
+void ScanBlockFile(int nFile, std::vector<CReindexEntry>* pvEntries)
+{
+    FILE* file = OpenBlockFile(CDiskBlockPos(nFile, 0), true);
+    if (!file)
+        return;
+    const unsigned char* pchMessageStart = Params().MessageStart();
+    const size_t nRecordHeaderSize = MESSAGE_START_SIZE + sizeof(uint32_t);
+    const size_t nBlockHeaderSize = ::GetSerializeSize(CBlockHeader(), SER_DISK, CLIENT_VERSION);
+    std::vector<unsigned char> vBuf(nRecordHeaderSize + nBlockHeaderSize);
+    uint64_t nOffset = 0;
+    while (!ShutdownRequested()) {
+        // Records normally follow each other, so only the record and block
+        // headers are read, at the offset where the next record should start.
+        if (fseek(file, nOffset, SEEK_SET) || fread(&vBuf[0], 1, vBuf.size(), file) != vBuf.size())
+            break;
+        bool fRecord = std::equal(pchMessageStart, pchMessageStart + MESSAGE_START_SIZE, vBuf.begin());
+        uint32_t nSize = ReadLE32(&vBuf[MESSAGE_START_SIZE]);
+        CBlockHeader header;
+        if (fRecord && nSize >= nBlockHeaderSize && nSize <= MAX_BLOCK_SIZE) {
+            try {
+                CDataStream ssHeader((const char*)&vBuf[nRecordHeaderSize], (const char*)&vBuf[0] + vBuf.size(), SER_DISK, CLIENT_VERSION);
+                ssHeader >> header;
+            } catch (const std::exception&) {
+                fRecord = false;
+            }
+        } else {
+            fRecord = false;
+        }
+        if (!fRecord) {
+            // Only search for the message start when it isn't where expected.
+            nOffset++;
+            if (!FindMessageStart(file, pchMessageStart, nOffset))
+                break;
+            continue;
+        }
+        CReindexEntry entry;
+        entry.hash = header.GetHash();
+        entry.hashPrev = header.hashPrevBlock;
+        entry.pos = CDiskBlockPos(nFile, nOffset + nRecordHeaderSize);
+        pvEntries->push_back(entry);
+        nOffset += nRecordHeaderSize + nSize;
+    }
+    fclose(file);
+}
+
+static void ScanBlockFilesThread(int nFiles, std::atomic<int>* pnNext, std::vector<std::vector<CReindexEntry> >* pvFileEntries)
+{
+    for (int nFile = (*pnNext)++; nFile < nFiles; nFile = (*pnNext)++)
+        ScanBlockFile(nFile, &(*pvFileEntries)[nFile]);
+}
+
+/** Blocks read ahead of ProcessNewBlock during -reindex */
+struct CReindexQueue {
+    boost::mutex cs;
+    boost::condition_variable cond;
+    //! Blocks in processing order; a null block stands for one that couldn't be read
+    std::deque<CBlock> queue;
+    bool fStop;
+
+    CReindexQueue() : fStop(false) {}
+};
+
+static void ReindexReadAheadThread(const std::vector<CReindexEntry>* pvEntries, const std::vector<size_t>* pvOrder, CReindexQueue* pqueue)
+{
+    RenameThread("xdna-reindexrd");
+    for (size_t i = 0; i < pvOrder->size(); i++) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, (*pvEntries)[(*pvOrder)[i]].pos))
+            block.SetNull();
+        boost::mutex::scoped_lock lock(pqueue->cs);
+        while (pqueue->queue.size() >= REINDEX_READAHEAD_BLOCKS && !pqueue->fStop)
+            pqueue->cond.wait(lock);
+        if (pqueue->fStop)
+            return;
+        pqueue->queue.push_back(std::move(block));
+        pqueue->cond.notify_all();
+    }
+}
+
+/**
+ * Put the entries of vEntries in the order to process them, every block after its parent.
+ * Where a block was stored twice, the first copy is used. Blocks whose ancestry doesn't lead
+ * back to a known block are left out, so they are never read.
+ */
+void OrderReindexEntries(const std::vector<CReindexEntry>& vEntries, std::vector<size_t>& vOrder)
+{
+    boost::unordered_map<uint256, size_t, BlockHasher> mapEntries;
+    boost::unordered_multimap<uint256, size_t, BlockHasher> mapChildren;
+    mapEntries.reserve(vEntries.size());
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        if (mapEntries.insert(std::make_pair(vEntries[i].hash, i)).second)
+            mapChildren.insert(std::make_pair(vEntries[i].hashPrev, i));
+    }
+    vOrder.clear();
+    vOrder.reserve(mapEntries.size());
+    {
+        LOCK(cs_main);
+        for (boost::unordered_map<uint256, size_t, BlockHasher>::const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it) {
+            const CReindexEntry& entry = vEntries[it->second];
+            if (mapEntries.count(entry.hashPrev))
+                continue;
+            if (entry.hash == Params().HashGenesisBlock() || mapBlockIndex.count(entry.hashPrev))
+                vOrder.push_back(it->second);
+        }
+    }
+    for (size_t i = 0; i < vOrder.size(); i++) {
+        std::pair<boost::unordered_multimap<uint256, size_t, BlockHasher>::const_iterator, boost::unordered_multimap<uint256, size_t, BlockHasher>::const_iterator> range = mapChildren.equal_range(vEntries[vOrder[i]].hash);
+        for (; range.first != range.second; ++range.first)
+            vOrder.push_back(range.first->second);
+    }
+}
+
+bool ReindexBlockFiles()
+{
+    int64_t nStart = GetTimeMillis();
+    int nFiles = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFiles, 0), "blk")))
+        nFiles++;
+
+    // Scan the files in parallel, reading headers only.
+    std::vector<std::vector<CReindexEntry> > vFileEntries(nFiles);
+    std::atomic<int> nNextFile(0);
+    unsigned int nThreads = std::max(1u, std::min(boost::thread::hardware_concurrency(), MAX_REINDEX_SCAN_THREADS));
+    {
+        // The workers use this stack frame, so don't let an interruption end it early.
+        boost::this_thread::disable_interruption di;
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&ScanBlockFilesThread, nFiles, &nNextFile, &vFileEntries));
+        threads.join_all();
+    }
+    boost::this_thread::interruption_point();
+    if (ShutdownRequested())
+        return false;
+
+    std::vector<CReindexEntry> vEntries;
+    for (int nFile = 0; nFile < nFiles; nFile++) {
+        vEntries.insert(vEntries.end(), vFileEntries[nFile].begin(), vFileEntries[nFile].end());
+        std::vector<CReindexEntry>().swap(vFileEntries[nFile]);
+    }
+    int64_t nScanned = GetTimeMillis();
+
+    std::vector<size_t> vOrder;
+    OrderReindexEntries(vEntries, vOrder);
+    LogPrintf("%s: found %u blocks in %d files in %dms, %u without a known parent\n", __func__,
+        vEntries.size(), nFiles, nScanned - nStart, vEntries.size() - vOrder.size());
+
+    // Feed the blocks to ProcessNewBlock in that order, reading ahead on another thread.
+    CReindexQueue queue;
+    boost::thread threadRead(boost::bind(&ReindexReadAheadThread, &vEntries, &vOrder, &queue));
+    int nLoaded = 0;
+    bool fComplete = false;
+    bool fError = false;
+    try {
+        for (size_t i = 0; i < vOrder.size(); i++) {
+            boost::this_thread::interruption_point();
+            CBlock block;
+            {
+                boost::mutex::scoped_lock lock(queue.cs);
+                while (queue.queue.empty())
+                    queue.cond.wait(lock);
+                block = std::move(queue.queue.front());
+                queue.queue.pop_front();
+                queue.cond.notify_all();
+            }
+            const CReindexEntry& entry = vEntries[vOrder[i]];
+            if (block.IsNull())
+                continue;
+            bool fHaveData;
+            {
+                LOCK(cs_main);
+                BlockMap::iterator mi = mapBlockIndex.find(entry.hash);
+                fHaveData = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+            }
+            if (!fHaveData) {
+                CValidationState state;
+                CDiskBlockPos pos = entry.pos;
+                if (ProcessNewBlock(state, NULL, &block, &pos))
+                    nLoaded++;
+                if (state.IsError()) {
+                    // Keep the reindexing flag so the next start retries
+                    LogPrintf("%s: failed to connect block %s: %s\n", __func__, entry.hash.ToString(), state.GetRejectReason());
+                    fError = true;
+                    break;
+                }
+            }
+            if (i % 10000 == 0)
+                LogPrintf("%s: processed %u of %u blocks\n", __func__, i, vOrder.size());
+        }
+        fComplete = !fError && !ShutdownRequested();
+    } catch (...) {
+        {
+            boost::mutex::scoped_lock lock(queue.cs);
+            queue.fStop = true;
+            queue.cond.notify_all();
+        }
+        threadRead.join();
+        throw;
+    }
+    {
+        boost::mutex::scoped_lock lock(queue.cs);
+        queue.fStop = true;
+        queue.cond.notify_all();
+    }
+    threadRead.join();
+    LogPrintf("Reindexed %i blocks in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    return fComplete;
+}
+
 void static CheckBlockIndex()
 {
     if (!fCheckBlockIndex) {
@@ -4525,8 +5941,10 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
+        // Best effort: only outputs 0 and 1 are looked up, and only in the cache
         return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
     }
     case MSG_DSTX:
         return mapObfuscationBroadcastTxes.count(inv.hash);
@@ -4577,7 +5995,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -4594,6 +6012,14 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // Historical blocks are the first traffic dropped once the upload target is near;
+                // whitelisted peers are still served
+                if (send && !pfrom->fWhitelisted && CNode::OutboundTargetReached(true) &&
+                    (pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > HISTORICAL_BLOCK_AGE)) {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
                     // Send block from disk
@@ -4602,7 +6028,13 @@ void static ProcessGetData(CNode* pfrom)
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    else if (inv.type == MSG_CMPCT_BLOCK) {
+                        // Older blocks are unlikely to be rebuilt from the peer's mempool, so send them whole
+                        if (pfrom->fSupportsCompactBlocks && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    } else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
@@ -4616,7 +6048,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             for (PairType& pair : merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(CNode::GetInventoryKey(CInv(MSG_TX, pair.second))))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -4736,7 +6168,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4755,8 +6187,70 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Validate the blocks that were waiting in mapBlocksUnconnected for hashParent, and their own children. */
+void static ProcessUnconnectedBlocks(const uint256& hashParent)
+{
+    std::deque<uint256> vParents(1, hashParent);
+    while (!vParents.empty()) {
+        vector<CUnconnectedBlock> vChildren;
+        {
+            LOCK(cs_main);
+            if (mapBlockIndex.count(vParents.front())) {
+                pair<multimap<uint256, CUnconnectedBlock>::iterator, multimap<uint256, CUnconnectedBlock>::iterator> range = mapBlocksUnconnected.equal_range(vParents.front());
+                for (multimap<uint256, CUnconnectedBlock>::iterator it = range.first; it != range.second; ++it)
+                    vChildren.push_back(it->second);
+                mapBlocksUnconnected.erase(range.first, range.second);
+            }
+        }
+        vParents.pop_front();
+
+        for (CUnconnectedBlock& child : vChildren) {
+            CValidationState state;
+            ProcessNewBlock(state, NULL, &child.block);
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(child.nodeid, nDoS);
+            }
+            vParents.push_back(child.hash);
+        }
+    }
+}
+
 bool fRequestedSporksIDB = false;
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+/** Validate and connect a block a peer sent us, whole or rebuilt from a compact block. */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block, const string& strCommand)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    if (!mapBlockIndex.count(inv.hash)) {
+        ProcessNewBlock(state, pfrom, &block);
+        int nDoS;
+        if(state.IsInvalid(nDoS)) {
+            pfrom->PushMessage("reject", strCommand, (unsigned char)state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+            if(nDoS > 0) {
+                TRY_LOCK(cs_main, lockMain);
+                if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+            }
+        } else {
+            // The first peer to give us a new tip is a good source of the next one
+            LOCK(cs_main);
+            if (chainActive.Tip()->GetBlockHash() == inv.hash && !IsInitialBlockDownload())
+                MaybeSetPeerAsAnnouncingCompactBlocks(pfrom);
+        }
+        //disconnect this node if its old protocol version
+        pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+    } else {
+        LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+    }
+
+    ProcessUnconnectedBlocks(inv.hash);
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CNetMessage& msg)
 {
     RandAddSeedPerfmon();
     if (fDebug)
@@ -4901,6 +6395,32 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION) {
+            // Tell the peer we understand compact blocks; we only ask it to push
+            // them unannounced once it has been first to give us a new block
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = CMPCTBLOCKS_VERSION;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+
+        // With headers-first sync, new blocks announced as headers extend our header chain directly
+        if (fHeadersFirst && pfrom->nVersion >= HEADERS_FIRST_VERSION)
+            pfrom->PushMessage("sendheaders");
+    }
+
+    else if (strCommand == "sendheaders") {
+        pfrom->fPreferHeaders = true;
+    }
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            pfrom->fSupportsCompactBlocks = true;
+            pfrom->fPreferCompactBlocks = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
     else if (strCommand == "addr") {
@@ -4932,7 +6452,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -4993,8 +6513,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
+                    // Add this to the list of blocks to request; near the tip, most of
+                    // its transactions should already be in our mempool
+                    if (pfrom->fSupportsCompactBlocks && !IsInitialBlockDownload())
+                        vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                    else
+                        vToFetch.push_back(inv);
                     LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
                 }
             }
@@ -5033,7 +6557,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks" || (strCommand == "getheaders" && pfrom->nVersion < HEADERS_FIRST_VERSION)) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -5065,16 +6589,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders" && pfrom->nVersion >= HEADERS_FIRST_VERSION) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
+        // Only our active chain is served, so there's no need to hold back during initial download
         LOCK(cs_main);
 
-        if (IsInitialBlockDownload())
-            return true;
-
         CBlockIndex* pindex = NULL;
         if (locator.IsNull()) {
             // If locator is null, return the hashStop block
@@ -5092,8 +6614,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
         int nLimit = MAX_HEADERS_RESULTS;
-        if (fDebug)
-            LogPrintf("getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+        LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
         for (; pindex; pindex = chainActive.Next(pindex)) {
             vHeaders.push_back(pindex->GetBlockHeader());
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
@@ -5115,7 +6636,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         int64_t sigTime;
 
         if (strCommand == "tx") {
-            vRecv >> tx;
+            if (msg.ptx)
+                tx = *msg.ptx;
+            else
+                vRecv >> tx;
         } else if (strCommand == "dstx") {
             //these allow masternodes to publish a limited amount of free transactions
             vRecv >> tx >> vin >> vchSig >> sigTime;
@@ -5253,7 +6777,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
+    else if (strCommand == "headers" && fHeadersFirst && !fImporting && !fReindex) // Ignore headers received while importing
     {
         std::vector<CBlockHeader> headers;
 
@@ -5271,57 +6795,113 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         LOCK(cs_main);
+        CNodeState* nodestate = State(pfrom->GetId());
 
         if (nCount == 0) {
             // Nothing interesting. Stop asking this peers for more headers.
             return true;
         }
-        CBlockIndex* pindexLast = NULL;
+
+        if (!mapBlockIndex.count(headers[0].hashPrevBlock) && !mapBlockHeaders.count(headers[0].hashPrevBlock)) {
+            // An announcement on top of blocks we haven't heard of yet; ask for the gap
+            LogPrint("net", "unconnecting headers from peer=%d, sending getheaders\n", pfrom->id);
+            pfrom->PushMessage("getheaders", GetHeadersLocator(), uint256(0));
+            return true;
+        }
+
+        uint256 hashLast = 0;
+        bool fAheadFull = false;
+        bool fRefused = false;
         for (const CBlockHeader& header : headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+            if (hashLast != 0 && header.hashPrevBlock != hashLast) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
+            if (HeadersAheadFull()) {
+                fAheadFull = true;
+                break;
+            }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
+            CValidationState state;
+            if (!AcceptHeader(header, pfrom->GetId(), state)) {
                 int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
-                    return error(strError.c_str());
+                if (state.IsInvalid(nDoS) && nDoS > 0) {
+                    Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received %s", header.GetHash().ToString());
                 }
+                // Not known to be invalid, we just won't keep it
+                LogPrint("net", "header %s from peer=%d not kept: %s\n", header.GetHash().ToString(), pfrom->id, state.GetRejectReason());
+                fRefused = true;
+                break;
             }
+            hashLast = header.GetHash();
         }
 
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+        if (hashLast != 0) {
+            UpdatePeerBestHeader(pfrom->GetId(), hashLast);
+            UpdateBlockAvailability(pfrom->GetId(), hashLast);
+        }
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        if (fAheadFull) {
+            // Let the blocks catch up; SendMessages restarts the sync from our best header
+            LogPrint("net", "header chain %d blocks ahead, pausing getheaders to peer=%d\n", MAX_HEADERS_AHEAD, pfrom->id);
+            if (nodestate->fSyncStarted) {
+                nodestate->fSyncStarted = false;
+                nSyncStarted--;
+            }
+        } else if (nCount == MAX_HEADERS_RESULTS && !fRefused) {
             // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+            LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", nodestate->nBestHeaderHeight, pfrom->id, pfrom->nStartingHeight);
+            pfrom->PushMessage("getheaders", GetHeadersLocator(hashLast), uint256(0));
+        } else if (nCount <= MAX_BLOCKS_TO_ANNOUNCE && !fImporting && !fReindex) {
+            // New blocks: fetch them now rather than wait for SendMessages, as a compact block
+            // when it is the only one and most of its transactions should be in our mempool
+            const CBlockHeader& header = headers.back();
+            uint256 hashAnnounced = header.GetHash();
+            vector<uint256> vBlocks;
+            vector<CInv> vGetData;
+            if (FindAnnouncedBlocksToFetch(hashAnnounced, header.hashPrevBlock, vBlocks)) {
+                bool fCompact = vBlocks.size() == 1 && vBlocks[0] == hashAnnounced && mapBlockIndex.count(header.hashPrevBlock) &&
+                                pfrom->fSupportsCompactBlocks && !IsInitialBlockDownload();
+                for (const uint256& hash : vBlocks) {
+                    vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, hash));
+                    MarkBlockAsInFlight(pfrom->GetId(), hash);
+                }
+            } else if (fRefused) {
+                // Headers we couldn't keep still announce blocks; fetch them as for an inv
+                for (const CBlockHeader& headerAnnounced : headers) {
+                    CInv inv(MSG_BLOCK, headerAnnounced.GetHash());
+                    if (!AlreadyHave(inv) && !mapBlocksInFlight.count(inv.hash))
+                        vGetData.push_back(inv);
+                }
+            }
+            if (!vGetData.empty())
+                pfrom->PushMessage("getdata", vGetData);
         }
-
-        CheckBlockIndex();
     }
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
-        vRecv >> block;
+        if (msg.pblock)
+            block = std::move(*msg.pblock);
+        else
+            vRecv >> block;
         uint256 hashBlock = block.GetHash();
         CInv inv(MSG_BLOCK, hashBlock);
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
+        bool fStashed = false;
+        {
+            // A block from our header chain that overtook its parent waits for it
+            LOCK(cs_main);
+            if (!mapBlockIndex.count(block.hashPrevBlock))
+                fStashed = StashUnconnectedBlock(pfrom->GetId(), block);
+        }
+        if (fStashed) {
+            pfrom->AddInventoryKnown(inv);
+        } else if (!mapBlockIndex.count(block.hashPrevBlock)) {
             if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
@@ -5332,26 +6912,161 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->vBlockRequested.push_back(hashBlock);
             }
         } else {
-            pfrom->AddInventoryKnown(inv);
+            ProcessBlockFromPeer(pfrom, block, strCommand);
+        }
+    }
 
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                return true;
+
+            // Fall back to the full block whenever we can't rebuild this one; the
+            // "block" path knows how to fetch a missing parent
+            vector<CInv> vGetFull(1, CInv(MSG_BLOCK, hashBlock));
+            BlockMap::iterator miPrev = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+            if (miPrev == mapBlockIndex.end()) {
+                pfrom->PushMessage("getdata", vGetFull);
+                return true;
+            }
+
+            // Check the header before spending any work on the transactions
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            CHeaderEntry entry;
+            if (!CheckNewHeader(cmpctblock.header, state, entry)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, (unsigned char)state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid compact block header received %s", hashBlock.ToString());
+            }
+
+            // Only rebuild blocks we asked this peer for, or new blocks near our tip
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fRequested = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+            if (!fRequested && miPrev->second->nHeight + MAX_CMPCTBLOCK_DEPTH < chainActive.Height()) {
+                LogPrint("net", "Ignoring unrequested compact block %s at height %d from peer=%d\n", hashBlock.ToString(), entry.nHeight, pfrom->id);
+                return true;
+            }
+
+            // Transactions SwiftTX locked are relayed ahead of the block but may not have reached the mempool
+            vector<CTransaction> vExtraTxn;
+            vExtraTxn.reserve(mapTxLockReq.size());
+            for (const PAIRTYPE(const uint256, CTransaction) & item : mapTxLockReq)
+                vExtraTxn.push_back(item.second);
+
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock());
+            ReadStatus status = partialBlock->InitData(cmpctblock, mempool, vExtraTxn);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us invalid compact block %s", pfrom->id, hashBlock.ToString());
+            } else if (status == READ_STATUS_FAILED) {
+                pfrom->PushMessage("getdata", vGetFull);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            req.blockhash = hashBlock;
+            req.indexes = partialBlock->GetMissing();
+            if (req.indexes.empty()) {
+                status = partialBlock->FillBlock(block, vector<CTransaction>());
+                if (status == READ_STATUS_OK)
+                    fBlockReconstructed = true;
+                else
+                    pfrom->PushMessage("getdata", vGetFull);
+            } else {
+                if (itInFlight != mapBlocksInFlight.end() && !fRequested) {
+                    // Someone else is already sending the whole block
+                    return true;
                 }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock, mi != mapBlockIndex.end() ? mi->second : NULL, partialBlock);
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Not a relay round trip any more; serve it like any other block request
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (unsigned int i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+                itInFlight->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = itInFlight->second.second->partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us invalid compact block/non-matching block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // A short id matched the wrong mempool transaction; get the whole block
+                itInFlight->second.second->partialBlock.reset();
+                vector<CInv> vGetFull(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vGetFull);
             } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                fBlockReconstructed = true;
             }
         }
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, strCommand);
     }
 
 
@@ -5663,12 +7378,12 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, verified by the socket thread in CNetMessage::Prepare
         CDataStream& vRecv = msg.vRecv;
-        const uint256& hash = msg.GetMessageHash();
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum) {
+        if (!msg.fChecksumValid) {
+            const uint256& hash = msg.GetMessageHash();
+            unsigned int nChecksum = 0;
+            memcpy(&nChecksum, &hash, sizeof(nChecksum));
             LogPrintf("ProcessMessages(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
                 SanitizeString(strCommand), nMessageSize, nChecksum, hdr.nChecksum);
             continue;
@@ -5687,7 +7402,7 @@ bool ProcessMessages(CNode* pfrom)
     }
     /////////////////////////////////////////////////
         try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, msg);
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
             pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
@@ -5766,9 +7481,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             for (CNode* pnode : vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->addrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertiseLocal(pnode);
@@ -5784,8 +7499,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -5800,6 +7515,21 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         }
 
         CNodeState& state = *State(pto->GetId());
+
+        // Give up on a header chain whose blocks never arrive; a source punished for it is banned below
+        CheckHeadersProgress(GetTime());
+
+        // Detect whether we're stalling
+        int64_t nNow = GetTimeMicros();
+        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
+            // Stalling only triggers when the block download window cannot move. During normal steady state,
+            // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
+            // should only happen during initial block download.
+            LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
+            pto->fDisconnect = true;
+            CheckBestHeadersServed(pto->GetId(), true);
+        }
+
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
                 LogPrintf("Warning: not punishing whitelisted peer %s!\n", pto->addr.ToString());
@@ -5822,14 +7552,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pindexBestHeader == NULL)
             pindexBestHeader = chainActive.Tip();
         bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
+        bool fHeadersSync = fHeadersFirst && pto->nVersion >= HEADERS_FIRST_VERSION;
         if (!state.fSyncStarted && !pto->fClient && fFetch /*&& !fImporting*/ && !fReindex) {
-            // Only actively request headers from a single peer, unless we're close to end of initial download.
-            if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
+            // Only actively request headers from a few peers (blocks from a single one without
+            // headers-first), unless we're close to end of initial download.
+            int64_t nBestHeaderTime = vBestHeaders.empty() ? pindexBestHeader->GetBlockTime() : mapBlockHeaders[vBestHeaders.back()].nTime;
+            bool fCloseToToday = nBestHeaderTime > GetAdjustedTime() - 6 * 60 * 60; // NOTE: was "close to today" and 24h in Bitcoin
+            if (fHeadersSync) {
+                if ((nSyncStarted < MAX_HEADERS_SYNC_PEERS || fCloseToToday) && !HeadersAheadFull()) {
+                    state.fSyncStarted = true;
+                    nSyncStarted++;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", nBestHeadersBase + (int)vBestHeaders.size() - 1, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", GetHeadersLocator(), uint256(0));
+                }
+            } else if (nSyncStarted == 0 || fCloseToToday) {
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
                 pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
             }
         }
@@ -5851,7 +7589,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
             for (const CInv& inv : pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                std::vector<unsigned char> vKey = CNode::GetInventoryKey(inv);
+                if (pto->filterInventoryKnown.contains(vKey))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -5870,8 +7609,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
+                if (!pto->filterInventoryKnown.contains(vKey)) {
+                    pto->filterInventoryKnown.insert(vKey);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000) {
                         pto->PushMessage("inv", vInv);
@@ -5884,15 +7623,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
-        // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
-        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
-            // Stalling only triggers when the block download window cannot move. During normal steady state,
-            // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
-            // should only happen during initial block download.
-            LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
-            pto->fDisconnect = true;
-        }
         // In case there is a block that has been in flight from this peer for (2 + 0.5 * N) times the block interval
         // (with N the number of validated blocks that were in flight at the time it was requested), disconnect due to
         // timeout. We compensate for in-flight blocks to prevent killing off peers due to our own downstream link
@@ -5907,16 +7637,27 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nDownloadWindow = GetDownloadWindow(state.nAvgBlockTime);
+        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < nDownloadWindow) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), nDownloadWindow - state.nBlocksInFlight, vToDownload, staller);
             for (CBlockIndex* pindex : vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
                 LogPrintf("Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
+            if (fHeadersSync) {
+                vector<uint256> vHeaderBlocks;
+                FindNextHeaderBlocksToDownload(pto->GetId(), nDownloadWindow - state.nBlocksInFlight, vHeaderBlocks, staller);
+                for (const uint256& hash : vHeaderBlocks) {
+                    vGetData.push_back(CInv(MSG_BLOCK, hash));
+                    MarkBlockAsInFlight(pto->GetId(), hash);
+                    LogPrint("net", "Requesting block %s (%d) from the header chain peer=%d\n", hash.ToString(),
+                        mapBlockHeaders[hash].nHeight, pto->id);
+                }
+            }
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
@@ -6013,11 +7754,9 @@ public:
     CMainCleanup() {}
     ~CMainCleanup()
     {
-        // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+        // block headers, which live in blockIndexArena
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
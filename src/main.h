@@ -39,10 +39,12 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CSporkDB;
 class CBloomFilter;
 class CInv;
@@ -82,15 +84,58 @@ static const int COINBASE_MATURITY = 100;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -checkblocks default (number of blocks verified at startup, 0 = all) */
+static const int DEFAULT_CHECKBLOCKS = 500;
+/** VerifyDB level run at startup: the block checks VerifyDB spreads over threads, without reconnecting blocks */
+static const int STARTUP_CHECKLEVEL = 2;
+/** Maximum number of threads reading and checking blocks in VerifyDB */
+static const unsigned int MAX_VERIFYDB_THREADS = 16;
+/** Times VerifyDB starts over when blocks connect while it checks them without cs_main */
+static const int MAX_VERIFYDB_TRIES = 3;
+/** Maximum number of threads scanning the block files for -reindex */
+static const unsigned int MAX_REINDEX_SCAN_THREADS = 16;
+/** Number of blocks -reindex reads ahead of validation */
+static const unsigned int REINDEX_READAHEAD_BLOCKS = 64;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until its delivery rate is measured. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds of the adaptive per-peer in-flight window once the delivery rate is known. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Seconds of deliveries, at the peer's measured rate, that its in-flight window should cover. */
+static const int64_t BLOCK_DOWNLOAD_TARGET_TIME = 4;
+/** A block is requested from a faster peer once it has been in flight this many times longer than that peer needs per block... */
+static const int BLOCK_REASSIGN_SLOWDOWN = 4;
+/** ...and at least this many seconds. */
+static const int64_t BLOCK_REASSIGN_MIN_WAIT = 2;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Blocks deeper than this below our tip are answered with the full block when asked for a compact one. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Blocks deeper than this below our tip are answered with the full block when asked for missing transactions. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers asked to push new blocks to us as compact blocks without announcing them first. */
+static const unsigned int MAX_CMPCT_ANNOUNCING_PEERS = 3;
+/** Default for -headersfirst: download and validate headers ahead of block data. */
+static const bool DEFAULT_HEADERS_FIRST = true;
+/** Number of peers we download headers from in parallel, until we are close to the network's tip. */
+static const int MAX_HEADERS_SYNC_PEERS = 3;
+/** How far (in blocks) our best header chain may run ahead of the active chain before we stop asking for more. */
+static const int MAX_HEADERS_AHEAD = 20000;
+/** Blocks fetched from the header chain that may arrive before their parent and wait to be connected. */
+static const unsigned int MAX_OUT_OF_ORDER_BLOCKS = 64;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers a single peer may keep in our header tree: a full header chain and one more batch. */
+static const int MAX_HEADERS_PER_PEER = MAX_HEADERS_AHEAD + (int)MAX_HEADERS_RESULTS;
+/** Seconds our best header chain may go without one of its blocks connecting before a branch another peer is on takes over. */
+static const int64_t HEADERS_STALL_TIMEOUT = 2 * 60;
+/** Seconds our best header chain may go without one of its blocks connecting before we drop it. */
+static const int64_t HEADERS_DOWNLOAD_TIMEOUT = 10 * 60;
+/** A headers message with at most this many headers announces new blocks, which we fetch right away. */
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -98,6 +143,8 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
+/** Default for -dbbackgroundflush: write the chainstate from a background thread. */
+static const bool DEFAULT_DB_BACKGROUND_FLUSH = true;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 
@@ -133,6 +180,7 @@ extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+extern CBlockIndexArena blockIndexArena;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -146,7 +194,9 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern bool fCheckBlockIndexHashes;
+extern bool fHeadersFirst;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
@@ -206,6 +256,14 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** A block found while scanning the block files for -reindex */
+struct CReindexEntry {
+    uint256 hash;
+    uint256 hashPrev;
+    CDiskBlockPos pos;
+};
+/** Rebuild the block index from the blk files (-reindex); false if interrupted or failed */
+bool ReindexBlockFiles();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -225,6 +283,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread for context-free CheckBlock work */
+void ThreadBlockCheck();
+/** Run the thread that writes chainstate flushes queued by FlushStateToDisk */
+void ThreadFlushChainstate();
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -276,6 +338,10 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksDelivered;
+    uint64_t nBytesDelivered;
+    int64_t nAvgBlockTime;
+    int nDownloadWindow;
 };
 
 struct CDiskTxPos : public CDiskBlockPos {
@@ -409,11 +475,13 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    boost::shared_ptr<const CTransactionSigHashCache> sighashCache;
 
 public:
     CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-                                                                                                                                ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn,
+        const boost::shared_ptr<const CTransactionSigHashCache>& sighashCacheIn = boost::shared_ptr<const CTransactionSigHashCache>()) : scriptPubKey(outIn.scriptPubKey),
+                                                                                                                                          ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), sighashCache(sighashCacheIn) {}
 
     bool operator()();
 
@@ -425,6 +493,7 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        sighashCache.swap(check.sighashCache);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -453,7 +522,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
+/** Unless fCheckChainState is set, leave out the checks against the active chain, so cs_main isn't needed */
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true, bool fCheckChainState = true);
 bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev);
 
 /** Context-dependent validity checks */
@@ -620,6 +690,9 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex);
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/** Global variable that points to the coins database view (protected by cs_main) */
+extern CCoinsViewDB* pcoinsdbview;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
@@ -578,6 +578,7 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
         }
 
         mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        mapPayeeVotesByHeight[winnerIn.nBlockHeight].push_back(winnerIn.GetHash());
 
         if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
@@ -743,19 +744,16 @@ void CMasternodePayments::CleanPaymentList()
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size() * 1.25), 1000);
 
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-
-        if (nHeight - winner.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
-            mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-        } else {
-            ++it;
+    std::map<int, std::vector<uint256> >::iterator itEnd = mapPayeeVotesByHeight.lower_bound(nHeight - nLimit);
+    for (std::map<int, std::vector<uint256> >::iterator it = mapPayeeVotesByHeight.begin(); it != itEnd; ++it) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing %u old Masternode payments - block %d\n", it->second.size(), it->first);
+        for (const uint256& hash : it->second) {
+            masternodeSync.mapSeenSyncMNW.erase(hash);
+            mapMasternodePayeeVotes.erase(hash);
         }
+        mapMasternodeBlocks.erase(it->first);
     }
+    mapPayeeVotesByHeight.erase(mapPayeeVotesByHeight.begin(), itEnd);
 }
 
 bool CMasternodePaymentWinner::IsValid(CNode* pnode, std::string& strError)
@@ -920,28 +918,31 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
 
     auto mn_counts = mnodeman.CountEnabledByLevels();
     unsigned max_mn_count = 0u;
+    int nMaxDepth = 0;
 
     for(auto& count : mn_counts) {
         max_mn_count = std::max(max_mn_count, unsigned(count.second * 1.25));
         count.second = unsigned(count.second * 1.25) + 1;
+        nMaxDepth = std::max(nMaxDepth, count.second);
     }
     if(max_mn_count > nCountNeeded) max_mn_count = nCountNeeded;
 
     int nInvCount = 0;
 
-    for(const auto& vote : mapMasternodePayeeVotes) {
-        const CMasternodePaymentWinner& winner = vote.second;
-
-        bool push = winner.nBlockHeight >= nHeight - mn_counts[winner.payeeLevel]
-                  && winner.nBlockHeight <= nHeight + 20;
+    // only the heights some level still needs, up to 20 blocks ahead
+    std::map<int, std::vector<uint256> >::const_iterator itEnd = mapPayeeVotesByHeight.upper_bound(nHeight + 20);
+    for (std::map<int, std::vector<uint256> >::const_iterator it = mapPayeeVotesByHeight.lower_bound(nHeight - nMaxDepth); it != itEnd; ++it) {
+        for (const uint256& hash : it->second) {
+            const CMasternodePaymentWinner& winner = mapMasternodePayeeVotes[hash];
 
-        if(!push)
-            continue;
+            if (winner.nBlockHeight < nHeight - mn_counts[winner.payeeLevel])
+                continue;
 
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
+            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, hash));
             ++nInvCount;
         }
-        node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
+    }
+    node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
 }
 
 std::string CMasternodePayments::ToString() const
@@ -958,17 +959,10 @@ int CMasternodePayments::GetOldestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nOldestBlock = std::numeric_limits<int>::max();
+    if (mapMasternodeBlocks.empty())
+        return std::numeric_limits<int>::max();
 
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while (it != mapMasternodeBlocks.end()) {
-        if ((*it).first < nOldestBlock) {
-            nOldestBlock = (*it).first;
-        }
-        it++;
-    }
-
-    return nOldestBlock;
+    return mapMasternodeBlocks.begin()->first;
 }
 
 
@@ -976,15 +970,8 @@ int CMasternodePayments::GetNewestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nNewestBlock = 0;
-
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while (it != mapMasternodeBlocks.end()) {
-        if ((*it).first > nNewestBlock) {
-            nNewestBlock = (*it).first;
-        }
-        it++;
-    }
+    if (mapMasternodeBlocks.empty())
+        return 0;
 
-    return nNewestBlock;
+    return std::max(0, mapMasternodeBlocks.rbegin()->first);
 }
@@ -265,6 +265,16 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // hashes of mapMasternodePayeeVotes bucketed by block height, so syncing and pruning are range operations
+    std::map<int, std::vector<uint256> > mapPayeeVotesByHeight;
+
+    void RebuildPayeeVoteIndex()
+    {
+        mapPayeeVotesByHeight.clear();
+        for (const auto& vote : mapMasternodePayeeVotes)
+            mapPayeeVotesByHeight[vote.second.nBlockHeight].push_back(vote.first);
+    }
+
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
@@ -281,6 +291,7 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeVotesByHeight.clear();
         mapMasternodesLastVote.clear();
     }
 
@@ -325,6 +336,8 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead())
+            RebuildPayeeVoteIndex();
     }
 };
 
@@ -138,6 +138,7 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
     protocolVersion = mnb.protocolVersion;
     addr = mnb.addr;
     lastTimeChecked = 0;
+    mnodeman.InvalidateAnnounceInventory();
     int nDoS = 0;
     if (mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
         lastPing = mnb.lastPing;
@@ -179,6 +180,14 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
 }
 
 void CMasternode::Check(bool forceCheck)
+{
+    int nPrevState = activeState;
+    UpdateState(forceCheck);
+    if (activeState != nPrevState)
+        mnodeman.InvalidateAnnounceInventory();
+}
+
+void CMasternode::UpdateState(bool forceCheck)
 {
     if(ShutdownRequested())
         return;
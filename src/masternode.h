@@ -238,6 +238,10 @@ public:
 
     void Check(bool forceCheck = false);
 
+private:
+    void UpdateState(bool forceCheck);
+
+public:
     bool IsBroadcastedWithin(int seconds)
     {
         return (GetAdjustedTime() - sigTime) < seconds;
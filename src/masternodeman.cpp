@@ -195,6 +195,8 @@ void DumpMasternodes()
 CMasternodeMan::CMasternodeMan()
 {
     nDsqCount = 0;
+    nAnnounceVersion = 1;
+    nAnnounceInventoryVersion = 0;
 }
 
 CValidationState CMasternodeMan::GetInputCheckingTx(const CTxIn& vin, CMutableTransaction& tx)
@@ -228,6 +230,7 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
     LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
     vMasternodes.push_back(mn);
+    InvalidateAnnounceInventory();
     return true;
 }
 
@@ -304,6 +307,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             it = vMasternodes.erase(it);
+            InvalidateAnnounceInventory();
         } else {
             ++it;
         }
@@ -365,6 +369,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
         if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
             mapSeenMasternodeBroadcast.erase(it3++);
             masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
+            // the inventory re-adds broadcasts for Masternodes that are still listed
+            InvalidateAnnounceInventory();
         } else {
             ++it3;
         }
@@ -393,6 +399,7 @@ void CMasternodeMan::Clear()
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
     nDsqCount = 0;
+    InvalidateAnnounceInventory();
 }
 
 int CMasternodeMan::size(unsigned mnlevel)
@@ -1011,21 +1018,16 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
 
         int nInvCount = 0;
-
-        for (CMasternode& mn : vMasternodes) {
-            if (mn.addr.IsRFC1918()) continue; //local network
-
-            if (mn.IsEnabled(true)) {
-                if (vin == CTxIn() || vin == mn.vin) {
-                    LogPrint("masternode", "dseg - Sending Masternode entry to peer=%i ip=%s - %s \n", pfrom->GetId(), pfrom->addr.ToString().c_str(), mn.vin.prevout.hash.ToString());
-                    CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
-                    uint256 hash = mnb.GetHash();
-                    pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
+        {
+            LOCK(cs);
+            UpdateAnnounceInventory();
+            for (const std::pair<CTxIn, uint256>& entry : vAnnounceInventory) {
+                if (vin == CTxIn() || vin == entry.first) {
+                    LogPrint("masternode", "dseg - Sending Masternode entry to peer=%i ip=%s - %s \n", pfrom->GetId(), pfrom->addr.ToString().c_str(), entry.first.prevout.hash.ToString());
+                    pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, entry.second));
                     nInvCount++;
 
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
-
-                    if (vin == mn.vin) {
+                    if (vin == entry.first) {
                         LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
                         return;
                     }
@@ -1071,6 +1073,29 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
 }
 
+void CMasternodeMan::UpdateAnnounceInventory()
+{
+    AssertLockHeld(cs);
+
+    uint64_t nVersion = nAnnounceVersion;
+    if (nVersion == nAnnounceInventoryVersion)
+        return;
+
+    vAnnounceInventory.clear();
+    for (CMasternode& mn : vMasternodes) {
+        if (mn.addr.IsRFC1918()) continue; //local network
+        if (!mn.IsEnabled(true)) continue;
+
+        CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
+        uint256 hash = mnb.GetHash();
+        // keep the broadcast around so getdata requests for the hash can be served
+        if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+        vAnnounceInventory.push_back(std::make_pair(mn.vin, hash));
+    }
+    nAnnounceInventoryVersion = nVersion;
+    LogPrint("masternode", "CMasternodeMan: Rebuilt announcement inventory - %u entries\n", vAnnounceInventory.size());
+}
+
 void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
@@ -1080,6 +1105,7 @@ void CMasternodeMan::Remove(CTxIn vin)
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
             vMasternodes.erase(it);
+            InvalidateAnnounceInventory();
             break;
         }
         ++it;
@@ -14,6 +14,8 @@
 #include "sync.h"
 #include "util.h"
 
+#include <atomic>
+
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_MNGET_SECONDS (1 * 1 * 60)
@@ -71,6 +73,16 @@ private:
     // who we asked for the winning Masternode list and the last time
     std::map<CNetAddr, int64_t> mWeAskedForWinnerMasternodeList;
 
+    // bumped whenever an entry joins, leaves or changes the announcement it would be served as
+    std::atomic<uint64_t> nAnnounceVersion;
+    // version vAnnounceInventory was built at
+    uint64_t nAnnounceInventoryVersion;
+    // vin and broadcast hash of every Masternode served to dseg requests
+    std::vector<std::pair<CTxIn, uint256> > vAnnounceInventory;
+
+    /// Rebuild vAnnounceInventory if it is out of date
+    void UpdateAnnounceInventory();
+
 public:
     // Keep track of all broadcasts I've seen
     std::map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -121,6 +133,9 @@ public:
     /// Clear Masternode vector
     void Clear();
 
+    /// Mark the dseg announcement inventory as out of date
+    void InvalidateAnnounceInventory() { ++nAnnounceVersion; }
+
     unsigned CountEnabled(unsigned mnlevel = CMasternode::LevelValue::UNSPECIFIED, int protocolVersion = -1);
     std::map<unsigned, int> CountEnabledByLevels(int protocolVersion = -1);
 
@@ -7,9 +7,12 @@
 #include "merkleblock.h"
 
 #include "hash.h"
+#include "crypto/sha256.h"
 #include "primitives/block.h" // for MAX_BLOCK_SIZE
 #include "utilstrencodings.h"
 
+#include <algorithm>
+
 using namespace std;
 
 CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
@@ -37,20 +40,19 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
 uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256>& vTxid)
 {
-    if (height == 0) {
-        // hash at height 0 is the txids themself
-        return vTxid[pos];
-    } else {
-        // calculate left hash
-        uint256 left = CalcHash(height - 1, pos * 2, vTxid), right;
-        // calculate right hash if not beyond the end of the array - copy left hash otherwise1
-        if (pos * 2 + 1 < CalcTreeWidth(height - 1))
-            right = CalcHash(height - 1, pos * 2 + 1, vTxid);
-        else
-            right = left;
-        // combine subhashes
-        return Hash(BEGIN(left), END(left), BEGIN(right), END(right));
+    // hash at height 0 is the txids themself
+    unsigned int nBegin = pos << height;
+    unsigned int nEnd = std::min((pos + 1) << height, nTransactions);
+    std::vector<uint256> vLevel(vTxid.begin() + nBegin, vTxid.begin() + nEnd);
+    // hash the subtree a level at a time, so each level's pairs go through SHA256D64 together.
+    // a level can only be odd at the right edge of the tree, where the last hash is paired with itself
+    while (height-- > 0) {
+        if (vLevel.size() % 2)
+            vLevel.push_back(vLevel.back());
+        SHA256D64(vLevel[0].begin(), vLevel[0].begin(), vLevel.size() / 2);
+        vLevel.resize(vLevel.size() / 2);
     }
+    return vLevel[0];
 }
 
 void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256>& vTxid, const std::vector<bool>& vMatch)
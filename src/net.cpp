@@ -17,6 +17,7 @@
 #include "clientversion.h"
 #include "miner.h"
 #include "obfuscation.h"
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "ui_interface.h"
 #ifdef ENABLE_WALLET
@@ -340,10 +341,17 @@ void AddressCurrentlyConnected(const CService& addr)
 }
 
 
+CMessageBufferPool messageBufferPool;
+
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
+uint64_t CNode::nMaxOutboundBlockReserve = DEFAULT_UPLOAD_BLOCK_RESERVE * 1024;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -688,6 +696,7 @@ void CNode::copyStats(CNodeStats& stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(fWhitelisted);
+    stats.nKnownFilterBytes = addrKnown.DynamicMemoryUsage() + filterInventoryKnown.DynamicMemoryUsage();
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -716,7 +725,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            vRecvMsg.emplace_back(SER_NETWORK, nRecvVersion);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -740,6 +749,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            msg.Prepare();
             messageHandlerCondition.notify_one();
         }
     }
@@ -771,7 +781,12 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
         return -1;
 
-    // switch state to reading message data
+    // switch state to reading message data, with room for the payload up to
+    // the first readData step so small messages never reallocate
+    CSerializeData buffer;
+    messageBufferPool.Get(buffer, std::min(hdr.nMessageSize, CMessageBufferPool::MAX_CLASS_SIZE));
+    vRecv.Swap(buffer);
+    messageBufferPool.Put(buffer);
     in_data = true;
 
     return nCopy;
@@ -802,6 +817,127 @@ const uint256& CNetMessage::GetMessageHash() const
     return data_hash;
 }
 
+CNetMessage::~CNetMessage()
+{
+    CSerializeData buffer;
+    hdrbuf.Swap(buffer);
+    messageBufferPool.Put(buffer);
+    vRecv.Swap(buffer);
+    messageBufferPool.Put(buffer);
+}
+
+CMessageBufferPool::CMessageBufferPool() : nReused(0), nAllocated(0), nPooledBytes(0)
+{
+    for (unsigned int i = 0; i < NUM_CLASSES; i++)
+        vFreeBytes[i] = 0;
+}
+
+void CMessageBufferPool::Get(CSerializeData& data, unsigned int nSize)
+{
+    unsigned int nClass = 0;
+    size_t nClassSize = MIN_CLASS_SIZE;
+    while (nClassSize < nSize && nClass < NUM_CLASSES) {
+        nClass++;
+        nClassSize *= 4;
+    }
+    if (nClass < NUM_CLASSES) {
+        LOCK(cs);
+        if (!vFree[nClass].empty()) {
+            data.swap(vFree[nClass].back());
+            vFree[nClass].pop_back();
+            vFreeBytes[nClass] -= data.capacity();
+            nPooledBytes -= data.capacity();
+            nReused++;
+            return;
+        }
+        nAllocated++;
+    } else {
+        // Larger than any class, so it won't be pooled either
+        nClassSize = nSize;
+        LOCK(cs);
+        nAllocated++;
+    }
+    CSerializeData().swap(data);
+    data.reserve(nClassSize);
+}
+
+void CMessageBufferPool::Put(CSerializeData& data)
+{
+    // File the buffer under the largest class it can hold. Buffers too large
+    // for the largest class would never be handed out again, so drop them.
+    size_t nCapacity = data.capacity();
+    if (nCapacity < MIN_CLASS_SIZE || nCapacity >= (size_t)MAX_CLASS_SIZE * 4) {
+        CSerializeData().swap(data);
+        return;
+    }
+    unsigned int nClass = 0;
+    size_t nClassSize = MIN_CLASS_SIZE;
+    while (nClass + 1 < NUM_CLASSES && nClassSize * 4 <= nCapacity) {
+        nClass++;
+        nClassSize *= 4;
+    }
+    data.clear();
+    {
+        LOCK(cs);
+        // Charge the real capacity, which may be up to four times the class size
+        if (vFreeBytes[nClass] + nCapacity <= MAX_CLASS_BYTES) {
+            vFree[nClass].push_back(CSerializeData());
+            vFree[nClass].back().swap(data);
+            vFreeBytes[nClass] += nCapacity;
+            nPooledBytes += nCapacity;
+            return;
+        }
+    }
+    CSerializeData().swap(data);
+}
+
+uint64_t CMessageBufferPool::GetReused() const
+{
+    LOCK(cs);
+    return nReused;
+}
+
+uint64_t CMessageBufferPool::GetAllocated() const
+{
+    LOCK(cs);
+    return nAllocated;
+}
+
+size_t CMessageBufferPool::GetPooledBytes() const
+{
+    LOCK(cs);
+    return nPooledBytes;
+}
+
+void CNetMessage::Prepare()
+{
+    const uint256& hash = GetMessageHash();
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    fChecksumValid = (nChecksum == hdr.nChecksum);
+    if (!fChecksumValid)
+        return;
+
+    // Block and transaction encodings don't depend on the stream version, so
+    // a version message processed after this point doesn't change the result.
+    std::string strCommand = hdr.GetCommand();
+    unsigned int nSize = vRecv.size();
+    try {
+        if (strCommand == "block") {
+            std::shared_ptr<CBlock> pblockNew = std::make_shared<CBlock>();
+            vRecv >> *pblockNew;
+            pblock = pblockNew;
+        } else if (strCommand == "tx") {
+            std::shared_ptr<CTransaction> ptxNew = std::make_shared<CTransaction>();
+            vRecv >> *ptxNew;
+            ptx = ptxNew;
+        }
+    } catch (const std::exception&) {
+        // Leave the payload for the message handler, which reports the parse error
+        vRecv.Rewind(nSize - vRecv.size());
+    }
+}
+
 
 
 
@@ -1565,9 +1701,9 @@ void ThreadMessageHandler()
 
                     if(performRebroadcast) {
 
-                        // Periodically clear setAddrKnown to allow refresh broadcasts
+                        // Periodically clear addrKnown to allow refresh broadcasts
                         if (nLastRebroadcast)
-                            pnode->setAddrKnown.clear();
+                            pnode->addrKnown.reset();
 
                         // Logging from quato
                         LogPrintf("Rebroadcast our address with AdvertiseLocal\n");
@@ -1946,6 +2082,92 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now) {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = limit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+void CNode::SetMaxOutboundBlockReserve(uint64_t reserve)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundBlockReserve = reserve;
+}
+
+uint64_t CNode::GetMaxOutboundCycleReserve()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe / std::max<int64_t>(Params().TargetSpacing(), 1) * nMaxOutboundBlockReserve;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit) {
+        // keep the block reserve for every target spacing left in the cycle
+        uint64_t timeLeftInCycle = 0;
+        if (nMaxOutboundCycleStartTime == 0) {
+            timeLeftInCycle = nMaxOutboundTimeframe;
+        } else {
+            uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+            uint64_t now = GetTime();
+            timeLeftInCycle = (cycleEndTime < now) ? 0 : cycleEndTime - now;
+        }
+        uint64_t buffer = timeLeftInCycle / std::max<int64_t>(Params().TargetSpacing(), 1) * nMaxOutboundBlockReserve;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    } else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -2057,7 +2279,9 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+                                                                                            addrKnown(ADDR_KNOWN_FILTER_SIZE, ADDR_KNOWN_FILTER_FP_RATE),
+                                                                                            filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, INVENTORY_KNOWN_FILTER_FP_RATE)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2086,7 +2310,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
+    fSupportsCompactBlocks = false;
+    fPreferCompactBlocks = false;
+    fPreferHeaders = false;
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
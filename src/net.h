@@ -12,7 +12,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -22,6 +21,7 @@
 #include "utilstrencodings.h"
 
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -33,6 +33,8 @@
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
+class CBlock;
+class CTransaction;
 class CBlockIndex;
 class CNode;
 
@@ -49,6 +51,14 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Number of recent inventory items each peer's known-inventory filter is sure to remember */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 20000;
+/** False-positive rate of the known-inventory filter; a false positive means an item is not announced to that peer */
+static const double INVENTORY_KNOWN_FILTER_FP_RATE = 0.000001;
+/** Number of recent addresses each peer's known-address filter is sure to remember */
+static const unsigned int ADDR_KNOWN_FILTER_SIZE = 5000;
+/** False-positive rate of the known-address filter */
+static const double ADDR_KNOWN_FILTER_FP_RATE = 0.001;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
 /** Maximum length of strSubVer in `version` message */
@@ -61,6 +71,14 @@ static const bool DEFAULT_UPNP = USE_UPNP;
 #else
 static const bool DEFAULT_UPNP = false;
 #endif
+/** -maxuploadtarget default, in MiB per MAX_UPLOAD_TIMEFRAME (0 = no limit) */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** -maxuploadblockreserve default, in KiB of upload target kept back per block expected in the rest of the cycle */
+static const uint64_t DEFAULT_UPLOAD_BLOCK_RESERVE = 64;
+/** Length of an upload target cycle, in seconds */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Blocks older than this (in seconds) count as historical; serving them is the first traffic cut when the upload target is near */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 
@@ -175,8 +193,47 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    uint64_t nKnownFilterBytes;
+};
+
+
+/**
+ * Size-classed free lists of network message buffers. Receive buffers come
+ * from here and go back when the message is destroyed, so a stream of
+ * small messages reuses a handful of allocations instead of making new ones.
+ */
+class CMessageBufferPool
+{
+public:
+    //! Smallest size class; classes grow by a factor of four from here
+    static const unsigned int MIN_CLASS_SIZE = 256;
+    static const unsigned int NUM_CLASSES = 6;
+    //! Largest size class, and the most CNetMessage asks Get for
+    static const unsigned int MAX_CLASS_SIZE = MIN_CLASS_SIZE << (2 * (NUM_CLASSES - 1));
+    //! Bytes of capacity each size class may keep on its free list
+    static const size_t MAX_CLASS_BYTES = 4 * 1024 * 1024;
+
+    //! Replace data (which should be empty) with a buffer of at least nSize bytes capacity
+    void Get(CSerializeData& data, unsigned int nSize);
+    //! Take data's buffer back for reuse; data is left empty
+    void Put(CSerializeData& data);
+
+    uint64_t GetReused() const;
+    uint64_t GetAllocated() const;
+    size_t GetPooledBytes() const;
+
+    CMessageBufferPool();
+
+private:
+    mutable CCriticalSection cs;
+    std::vector<CSerializeData> vFree[NUM_CLASSES];
+    size_t vFreeBytes[NUM_CLASSES];
+    uint64_t nReused;
+    uint64_t nAllocated;
+    size_t nPooledBytes;
 };
 
+extern CMessageBufferPool messageBufferPool;
 
 class CNetMessage
 {
@@ -196,15 +253,28 @@ public:
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
+    // Set by the socket thread in Prepare() once the message is complete
+    bool fChecksumValid;
+    std::shared_ptr<CBlock> pblock;             // decoded "block" payload, if it parsed
+    std::shared_ptr<const CTransaction> ptx;    // decoded "tx" payload, if it parsed
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
     {
+        CSerializeData buffer;
+        messageBufferPool.Get(buffer, 24);
+        hdrbuf.Swap(buffer);
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        fChecksumValid = false;
     }
 
+    CNetMessage(CNetMessage&&) = default;
+    CNetMessage& operator=(CNetMessage&&) = default;
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -212,6 +282,12 @@ public:
         return (hdr.nMessageSize == nDataPos);
     }
 
+    /** Payload bytes this message holds in the receive queue, counted as received even once Prepare() has decoded them */
+    unsigned int GetRecvSize() const
+    {
+        return complete() ? hdr.nMessageSize : vRecv.size();
+    }
+
     const uint256& GetMessageHash() const;
 
     void SetVersion(int nVersionIn)
@@ -222,6 +298,9 @@ public:
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+
+    /** Verify the checksum and decode block and tx payloads, so the message handler thread only dispatches */
+    void Prepare();
 };
 
 typedef enum BanReason
@@ -330,6 +409,12 @@ public:
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
     bool fRelayTxes;
+    // Set by "sendcmpct": the peer understands compact blocks, and wants new
+    // blocks pushed to it as "cmpctblock" without an inv first
+    bool fSupportsCompactBlocks;
+    bool fPreferCompactBlocks;
+    // Set by "sendheaders": announce new blocks to the peer with their header instead of an inv
+    bool fPreferHeaders;
     // Should be 'true' only if we connected to this node to actually mix funds.
     // In this case node will be released automatically via CMasternodeMan::ProcessMasternodeConnections().
     // Connecting to verify connectability/status or connecting for sending/relaying single message
@@ -365,12 +450,12 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -396,6 +481,13 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Upload target, protected by cs_totalBytesSent
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+    static uint64_t nMaxOutboundBlockReserve;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -416,7 +508,7 @@ public:
     {
         unsigned int total = 0;
         for (const CNetMessage& msg : vRecvMsg)
-            total += msg.vRecv.size() + 24;
+            total += msg.GetRecvSize() + 24;
         return total;
     }
 
@@ -445,7 +537,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -453,7 +545,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -463,11 +555,21 @@ public:
     }
 
 
+    //! Key of inv in filterInventoryKnown. It includes the type, as some hashes are relayed
+    //! under more than one type, like a transaction and its lock request.
+    static std::vector<unsigned char> GetInventoryKey(const CInv& inv)
+    {
+        std::vector<unsigned char> vKey(inv.hash.begin(), inv.hash.end());
+        for (int i = 0; i < 4; i++)
+            vKey.push_back((inv.type >> (8 * i)) & 0xff);
+        return vKey;
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(GetInventoryKey(inv));
         }
     }
 
@@ -475,7 +577,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(GetInventoryKey(inv)))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -735,6 +837,28 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! Set the upload target in bytes per timeframe (0 = no limit)
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+    static uint64_t GetMaxOutboundTimeframe();
+    //! Set the bytes kept back for each block expected in the rest of the cycle
+    static void SetMaxOutboundBlockReserve(uint64_t reserve);
+    //! Bytes kept back for new blocks over a whole cycle
+    static uint64_t GetMaxOutboundCycleReserve();
+
+    /**
+     * True if the upload target has been reached for this cycle. With
+     * historicalBlockServingLimit, the block reserve for the rest of the
+     * cycle is kept back, so historical block serving stops
+     * first and relay of new blocks, masternode messages and SwiftTX locks
+     * keeps going.
+     */
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+    //! Bytes left in the current cycle, 0 if there is no limit
+    static uint64_t GetOutboundTargetBytesLeft();
+    //! Seconds left in the current cycle, 0 if there is no limit
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 class CExplicitNetCleanup
@@ -7,6 +7,7 @@
 #include "block.h"
 
 #include "../hash.h"
+#include "../crypto/sha256.h"
 #include "../script/standard.h"
 #include "../script/sign.h"
 #include "../tinyformat.h"
@@ -78,15 +79,17 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if (nSize % 2 == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // The pairs of a level are contiguous 64-byte blobs, so hash them all in one go.
+        int nPairs = nSize / 2;
+        vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[j+nSize].begin(), vMerkleTree[j].begin(), nPairs);
+        if (nSize % 2) {
+            const uint256& last = vMerkleTree[j+nSize-1];
+            vMerkleTree[j+nSize+nPairs] = Hash(BEGIN(last), END(last), BEGIN(last), END(last));
         }
         j += nSize;
     }
@@ -170,7 +170,9 @@ enum {
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // Only valid in getdata, from peers that sent "sendcmpct"; answered with "cmpctblock"
+    MSG_CMPCT_BLOCK
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -12,6 +12,20 @@
 #include "ecwrapper.h"
 #endif
 
+#ifndef USE_SECP256K1
+namespace
+{
+/** Maximum number of parsed public keys kept by the shared verifier */
+const size_t MAX_VERIFIER_KEYS = 4096;
+
+CECVerifier& GetVerifier()
+{
+    static CECVerifier verifier(MAX_VERIFIER_KEYS);
+    return verifier;
+}
+} // anon namespace
+#endif
+
 bool CPubKey::Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const
 {
     if (!IsValid())
@@ -20,10 +34,7 @@ bool CPubKey::Verify(const uint256& hash, const std::vector<unsigned char>& vchS
     if (secp256k1_ecdsa_verify((const unsigned char*)&hash, 32, &vchSig[0], vchSig.size(), begin(), size()) != 1)
         return false;
 #else
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
-        return false;
-    if (!key.Verify(hash, vchSig))
+    if (!GetVerifier().Verify(begin(), size(), hash, vchSig))
         return false;
 #endif
     return true;
@@ -41,7 +52,7 @@ bool CPubKey::RecoverCompact(const uint256& hash, const std::vector<unsigned cha
         return false;
     assert((int)size() == pubkeylen);
 #else
-    CECKey key;
+    CECKey key(GetVerifier().GetGroup());
     if (!key.Recover(hash, &vchSig[1], recid))
         return false;
     std::vector<unsigned char> pubkey;
@@ -340,11 +340,11 @@ bool MultisigDialog::createMultisigTransaction(vector<CTxIn> vUserIn, vector<CTx
         bool fFirst = true;
 
         for(CTxIn in : vUserIn){
-            const CCoins* coins = view.AccessCoins(in.prevout.hash);
-            if(!coins->IsAvailable(in.prevout.n) || coins == NULL){
+            const Coin& coin = view.AccessCoin(in.prevout);
+            if(coin.IsSpent()){
                 continue;
             }
-            CTxOut prevout = coins->vout[in.prevout.n];
+            CTxOut prevout = coin.out;
             CScript privKey = prevout.scriptPubKey;
 
             vInputVals.push_back(prevout.nValue);
@@ -390,13 +390,13 @@ bool MultisigDialog::createMultisigTransaction(vector<CTxIn> vUserIn, vector<CTx
         tx.vin = vUserIn;
         tx.vout = vUserOut;
 
-        const CCoins* coins = view.AccessCoins(tx.vin[0].prevout.hash);
+        const Coin& coin = view.AccessCoin(tx.vin[0].prevout);
 
-        if(coins == NULL || !coins->IsAvailable(tx.vin[0].prevout.n)){
+        if(coin.IsSpent()){
             throw runtime_error("Coins unavailable (unconfirmed/spent)");
         }
 
-        CScript prevPubKey = coins->vout[tx.vin[0].prevout.n].scriptPubKey;
+        CScript prevPubKey = coin.out.scriptPubKey;
 
         //get payment destination
         CTxDestination address;
@@ -526,8 +526,7 @@ CCoinsViewCache MultisigDialog::getInputsCoinsViewCache(const vector<CTxIn>& vin
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
         for(const CTxIn& txin : vin) {
-            const uint256& prevHash = txin.prevout.hash;
-            view.AccessCoins(prevHash); // this is certainly allowed to fail
+            view.AccessCoin(txin.prevout); // this is certainly allowed to fail
         }
 
         view.SetBackend(viewDummy); // switch back to avoid locking mempool for too long
@@ -683,10 +682,11 @@ void MultisigDialog::commitMultisigTx()
 #else
         uint256 hashTx = tx.GetHash();
         CCoinsViewCache& view = *pcoinsTip;
-        const CCoins* existingCoins = view.AccessCoins(hashTx);
         bool fOverrideFees = false;
         bool fHaveMempool = mempool.exists(hashTx);
-        bool fHaveChain = existingCoins && existingCoins->nHeight < 1000000000;
+        bool fHaveChain = false;
+        for (unsigned int o = 0; !fHaveChain && o < tx.vout.size(); o++)
+            fHaveChain = !view.AccessCoin(COutPoint(hashTx, o)).IsSpent();
 
         if (!fHaveMempool && !fHaveChain) {
             // push to local node and sync with wallets
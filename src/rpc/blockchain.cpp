@@ -9,9 +9,12 @@
 #include "checkpoints.h"
 #include "main.h"
 #include "rpc/server.h"
+#include "sporkdb.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
+#include <sstream>
 #include <stdint.h>
 #include <univalue.h>
 
@@ -396,13 +399,13 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("gettxoutsetinfo", "") + HelpExampleRpc("gettxoutsetinfo", ""));
 
-    LOCK(cs_main);
-
     UniValue ret(UniValue::VOBJ);
 
+    // Only the flush needs cs_main; the statistics are computed from a
+    // database snapshot while validation carries on.
     CCoinsStats stats;
     FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
+    if (pcoinsdbview->GetStats(stats)) {
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
@@ -414,6 +417,93 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+/** Options, size and per-level compaction statistics of one LevelDB database */
+static UniValue DBStatsToJSON(const CLevelDBWrapper& db)
+{
+    const CLevelDBOptions& dboptions = db.GetDBOptions();
+    UniValue options(UniValue::VOBJ);
+    options.push_back(Pair("profile", dboptions.strProfile));
+    options.push_back(Pair("compression", dboptions.fCompression));
+    options.push_back(Pair("maxopenfiles", dboptions.nMaxOpenFiles));
+    options.push_back(Pair("bloombits", dboptions.nBloomBits));
+    options.push_back(Pair("blocksize", (uint64_t)dboptions.nBlockSize));
+    options.push_back(Pair("blockcachepercent", dboptions.nBlockCachePercent));
+
+    // "leveldb.stats" is a table with one row per non-empty level.
+    UniValue levels(UniValue::VARR);
+    std::istringstream ssStats(db.GetProperty("leveldb.stats"));
+    std::string strLine;
+    while (std::getline(ssStats, strLine)) {
+        int nLevel, nFiles;
+        double dSize, dTime, dRead, dWrite;
+        if (sscanf(strLine.c_str(), "%d %d %lf %lf %lf %lf", &nLevel, &nFiles, &dSize, &dTime, &dRead, &dWrite) != 6)
+            continue;
+        UniValue level(UniValue::VOBJ);
+        level.push_back(Pair("level", nLevel));
+        level.push_back(Pair("files", nFiles));
+        level.push_back(Pair("size_mb", dSize));
+        level.push_back(Pair("compaction_sec", dTime));
+        level.push_back(Pair("compaction_read_mb", dRead));
+        level.push_back(Pair("compaction_write_mb", dWrite));
+        levels.push_back(level);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("options", options));
+    ret.push_back(Pair("approximate_size", db.GetApproximateSize()));
+    ret.push_back(Pair("levels", levels));
+    return ret;
+}
+
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getdbstats ( \"database\" )\n"
+            "\nReturns the options and LevelDB internal statistics of the node's databases.\n"
+            "\nArguments:\n"
+            "1. \"database\"   (string, optional) Only report this database: chainstate, blockindex or sporks\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {                (json object) one entry per database\n"
+            "    \"options\": {                 (json object) options it was opened with, see -dbprofile and -dboption\n"
+            "      \"profile\": \"name\",\n"
+            "      \"compression\": true|false,\n"
+            "      \"maxopenfiles\": n,\n"
+            "      \"bloombits\": n,\n"
+            "      \"blocksize\": n,\n"
+            "      \"blockcachepercent\": n\n"
+            "    },\n"
+            "    \"approximate_size\": n,       (numeric) approximate size on disk in bytes\n"
+            "    \"levels\": [                  (json array) LevelDB levels that hold files or were compacted\n"
+            "      {\n"
+            "        \"level\": n,\n"
+            "        \"files\": n,              (numeric) number of table files\n"
+            "        \"size_mb\": x.x,          (numeric) size of the level in MiB\n"
+            "        \"compaction_sec\": x.x,   (numeric) time spent compacting into this level\n"
+            "        \"compaction_read_mb\": x.x,\n"
+            "        \"compaction_write_mb\": x.x\n"
+            "      }, ...\n"
+            "    ]\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getdbstats", "") + HelpExampleCli("getdbstats", "\"chainstate\"") + HelpExampleRpc("getdbstats", "\"chainstate\""));
+
+    std::string strName = params.size() > 0 ? params[0].get_str() : "";
+    if (!strName.empty() && std::find(LEVELDB_NAMES, LEVELDB_NAMES + ARRAYLEN(LEVELDB_NAMES), strName) == LEVELDB_NAMES + ARRAYLEN(LEVELDB_NAMES))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown database " + strName);
+
+    LOCK(cs_main);
+    const CLevelDBWrapper* pdbs[] = {&pcoinsdbview->GetDB(), pblocktree, pSporkDB};
+    UniValue ret(UniValue::VOBJ);
+    for (unsigned int i = 0; i < ARRAYLEN(pdbs); i++) {
+        if (strName.empty() || pdbs[i]->GetName() == strName)
+            ret.push_back(Pair(pdbs[i]->GetName(), DBStatsToJSON(*pdbs[i])));
+    }
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -439,8 +529,8 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
-            "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
+            "  \"coinbase\" : true|false,  (boolean) Coinbase or not\n"
+            "  \"coinstake\" : true|false  (boolean) Coinstake or not\n"
             "}\n"
 
             "\nExamples:\n"
@@ -459,33 +549,34 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out))
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n < 0 || (unsigned int)n >= coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex* pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", coin.fCoinBase));
+    ret.push_back(Pair("coinstake", coin.fCoinStake));
 
     return ret;
 }
@@ -504,8 +595,9 @@ UniValue verifychain(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("verifychain", "") + HelpExampleRpc("verifychain", ""));
 
-    LOCK(cs_main);
-
+    // VerifyDB takes cs_main itself, only for the steps that need it, and starts
+    // over if a block connects in between. Its block check threads run CheckBlock
+    // without the checks against the chain state.
     int nCheckLevel = GetArg("-checklevel", 3);
     int nCheckDepth = GetArg("-checkblocks", 288);
     if (params.size() > 0)
@@ -530,7 +622,10 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"coinscacheusage\": xxxx,  (numeric) current heap usage of the in-memory UTXO cache, in bytes\n"
+            "  \"coinscachelimit\": xxxx,  (numeric) usage above which the UTXO cache is flushed to disk, in bytes\n"
+            "  \"coinscacheentries\": xxxx (numeric) number of unspent outputs held in the UTXO cache\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getblockchaininfo", "") + HelpExampleRpc("getblockchaininfo", ""));
@@ -545,6 +640,9 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("coinscacheusage", (uint64_t)pcoinsTip->DynamicMemoryUsage()));
+    obj.push_back(Pair("coinscachelimit", (uint64_t)nCoinCacheUsage));
+    obj.push_back(Pair("coinscacheentries", (uint64_t)pcoinsTip->GetCacheSize()));
     return obj;
 }
 
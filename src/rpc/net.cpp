@@ -91,6 +91,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"knownfilterbytes\": n,     (numeric) Memory used by the known address and inventory filters for this peer\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"pingtime\": n,             (numeric) ping time\n"
             "    \"pingwait\": n,             (numeric) ping wait\n"
@@ -104,7 +105,11 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"blocks_downloaded\": n,    (numeric) Requested blocks this peer delivered\n"
+            "    \"bytes_downloaded\": n,     (numeric) Size of those blocks in bytes\n"
+            "    \"block_time\": n,           (numeric) Average seconds per delivered block while blocks were in flight\n"
+            "    \"download_window\": n       (numeric) Number of blocks we keep in flight from this peer\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -131,6 +136,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         obj.push_back(Pair("lastrecv", stats.nLastRecv));
         obj.push_back(Pair("bytessent", stats.nSendBytes));
         obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
+        obj.push_back(Pair("knownfilterbytes", stats.nKnownFilterBytes));
         obj.push_back(Pair("conntime", stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
         obj.push_back(Pair("pingtime", stats.dPingTime));
@@ -152,6 +158,10 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("blocks_downloaded", statestats.nBlocksDelivered));
+            obj.push_back(Pair("bytes_downloaded", statestats.nBytesDelivered));
+            obj.push_back(Pair("block_time", ((double)statestats.nAvgBlockTime) / 1e6));
+            obj.push_back(Pair("download_window", statestats.nDownloadWindow));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -343,7 +353,21 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\":\n"
+            "  {\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"recvbuffers\": {       (json object) Receive buffer pool\n"
+            "    \"reused\": n,         (numeric) Buffers handed out from the pool\n"
+            "    \"allocated\": n,      (numeric) Buffers that had to be allocated\n"
+            "    \"pooledbytes\": n     (numeric) Bytes currently held for reuse\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
@@ -352,6 +376,21 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    UniValue recvBuffers(UniValue::VOBJ);
+    recvBuffers.push_back(Pair("reused", messageBufferPool.GetReused()));
+    recvBuffers.push_back(Pair("allocated", messageBufferPool.GetAllocated()));
+    recvBuffers.push_back(Pair("pooledbytes", (uint64_t)messageBufferPool.GetPooledBytes()));
+    obj.push_back(Pair("recvbuffers", recvBuffers));
     return obj;
 }
 
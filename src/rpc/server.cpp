@@ -281,8 +281,9 @@ static const CRPCCommand vRPCCommands[] =
         {"blockchain", "getmempoolinfo", &getmempoolinfo, true, true, false},
         {"blockchain", "getrawmempool", &getrawmempool, true, false, false},
         {"blockchain", "gettxout", &gettxout, true, false, false},
-        {"blockchain", "gettxoutsetinfo", &gettxoutsetinfo, true, false, false},
-        {"blockchain", "verifychain", &verifychain, true, false, false},
+        {"blockchain", "gettxoutsetinfo", &gettxoutsetinfo, true, true, false},
+        {"blockchain", "getdbstats", &getdbstats, true, false, false},
+        {"blockchain", "verifychain", &verifychain, true, true, false},
         {"blockchain", "invalidateblock", &invalidateblock, true, true, false},
         {"blockchain", "reconsiderblock", &reconsiderblock, true, true, false},
 
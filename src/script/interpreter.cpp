@@ -12,6 +12,7 @@
 #include "eccryptoverify.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -1057,6 +1058,44 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     return ss.GetHash();
 }
 
+CTransactionSigHashCache::CTransactionSigHashCache(const CTransaction& txToIn) : txTo(txToIn)
+{
+    // Serialize every input as it appears when some other input is signed
+    // with SIGHASH_ALL: prevout, empty script, nSequence.
+    CDataStream ssTail(SER_GETHASH, 0);
+    vTailOffset.reserve(txTo.vin.size() + 1);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vTailOffset.push_back(ssTail.size());
+        ssTail << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+    }
+    vTailOffset.push_back(ssTail.size());
+    ssTail << txTo.vout << txTo.nLockTime;
+    vchTail.assign(ssTail.begin(), ssTail.end());
+
+    vMidstate.reserve(txTo.vin.size());
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vMidstate.push_back(ss);
+        ss.write((const char*)&vchTail[vTailOffset[i]], vTailOffset[i + 1] - vTailOffset[i]);
+    }
+}
+
+uint256 CTransactionSigHashCache::SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const
+{
+    // Only plain SIGHASH_ALL shares the serialization of the other inputs and outputs
+    if (nIn >= txTo.vin.size() || (nHashType & SIGHASH_ANYONECANPAY) ||
+        (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return ::SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    CHashWriter ss(vMidstate[nIn]);
+    CTransactionSignatureSerializer(txTo, scriptCode, nIn, nHashType).SerializeInput(ss, nIn, ss.nType, ss.nVersion);
+    ss.write((const char*)&vchTail[vTailOffset[nIn + 1]], vchTail.size() - vTailOffset[nIn + 1]);
+    ss << nHashType;
+    return ss.GetHash();
+}
+
 bool TransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
     return pubkey.Verify(sighash, vchSig);
@@ -1075,7 +1114,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = sighashCache ? sighashCache->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, *txTo, nIn, nHashType);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -7,6 +7,7 @@
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
 #include "script_error.h"
+#include "../hash.h"
 #include "../primitives/transaction.h"
 
 #include <vector>
@@ -74,6 +75,33 @@ enum
 
 uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
+/**
+ * Signature hash state shared by the checks of all inputs of one transaction.
+ *
+ * For SIGHASH_ALL every input hashes the same serialization of txTo except for
+ * its own scriptSig slot, so the blanked inputs, outputs and nLockTime are
+ * serialized once and the hasher state ahead of each input is kept. A digest
+ * then only hashes the input being signed and the precomputed tail instead of
+ * reserializing the whole transaction. Other hash types fall back to
+ * SignatureHash(). Results are identical to SignatureHash().
+ */
+class CTransactionSigHashCache
+{
+private:
+    const CTransaction& txTo;
+    //! hasher state after nVersion, the input count and the blanked inputs before input i
+    std::vector<CHashWriter> vMidstate;
+    //! serialized blanked inputs followed by the outputs and nLockTime
+    std::vector<unsigned char> vchTail;
+    //! offset in vchTail of each blanked input (plus one past the last input)
+    std::vector<unsigned int> vTailOffset;
+
+public:
+    explicit CTransactionSigHashCache(const CTransaction& txToIn);
+
+    uint256 SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const;
+};
+
 class BaseSignatureChecker
 {
 public:
@@ -90,12 +118,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const CTransactionSigHashCache* sighashCache;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CTransactionSigHashCache* sighashCacheIn = NULL) : txTo(txToIn), nIn(nInIn), sighashCache(sighashCacheIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
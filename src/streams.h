@@ -286,6 +286,13 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    //! Exchange the underlying buffer with data; the read position is reset
+    void Swap(CSerializeData& data)
+    {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
@@ -0,0 +1,168 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrman.h"
+#include "clientversion.h"
+#include "streams.h"
+
+#include <set>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+/** Gives the tests the consistency check and lookups, whatever DEBUG_ADDRMAN says. */
+class CAddrManTest : public CAddrMan
+{
+public:
+    int CheckConsistency() { return Check_(); }
+    bool Contains(const CNetAddr& addr) { return Find(addr) != NULL; }
+};
+
+static CNetAddr IPv4(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    struct in_addr ip;
+    ip.s_addr = htonl((a << 24) | (b << 16) | (c << 8) | d);
+    return CNetAddr(ip);
+}
+
+static CAddress Address(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    return CAddress(CService(IPv4(a, b, c, d), 1945), NODE_NETWORK);
+}
+
+/** The new and tried counts, as written at the start of the serialized table. */
+static void GetCounts(const CAddrMan& addrman, int& nNew, int& nTried)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    unsigned char nVersion, nKeySize;
+    uint256 nKey;
+    ss >> nVersion >> nKeySize >> nKey >> nNew >> nTried;
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_add)
+{
+    CAddrManTest addrman;
+    CNetAddr source = IPv4(2, 1, 0, 1);
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+
+    BOOST_CHECK(addrman.Add(Address(1, 2, 3, 4), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK(addrman.Contains(IPv4(1, 2, 3, 4)));
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+
+    // Nothing new about a known address, and unroutable ones are never kept
+    BOOST_CHECK(!addrman.Add(Address(1, 2, 3, 4), source));
+    BOOST_CHECK(!addrman.Add(Address(10, 0, 0, 1), source));
+    BOOST_CHECK(!addrman.Add(Address(127, 0, 0, 1), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+
+    // Addresses from many groups and sources
+    for (int i = 0; i < 100; i++)
+        addrman.Add(Address(1, 3 + i, 0, 1), IPv4(2, 2 + i % 10, 0, 1));
+    BOOST_CHECK(addrman.size() > 1 && addrman.size() <= 101);
+    int nNew, nTried;
+    GetCounts(addrman, nNew, nTried);
+    BOOST_CHECK_EQUAL(nNew, addrman.size());
+    BOOST_CHECK_EQUAL(nTried, 0);
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_good_evicts)
+{
+    CAddrManTest addrman;
+
+    // A /16 group has ADDRMAN_TRIED_BUCKETS_PER_GROUP tried buckets; spread its
+    // addresses over many new buckets by learning them from many sources
+    const int nTriedSlots = ADDRMAN_TRIED_BUCKETS_PER_GROUP * ADDRMAN_BUCKET_SIZE;
+    for (int i = 0; i < 2 * nTriedSlots; i++)
+        addrman.Add(Address(1, 2, i / 256, i % 256), IPv4(2, i % 200, 0, 1));
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+    int nAdded = addrman.size();
+    BOOST_REQUIRE(nAdded > nTriedSlots);
+
+    // Marking all of them good must evict tried entries back to the new table
+    for (int i = 0; i < 2 * nTriedSlots; i++) {
+        addrman.Good(CService(IPv4(1, 2, i / 256, i % 256), 1945));
+        if (i % 64 == 0)
+            BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+    }
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+    int nNew, nTried;
+    GetCounts(addrman, nNew, nTried);
+    BOOST_CHECK(nTried > 0 && nTried <= nTriedSlots);
+    BOOST_CHECK(nNew > 0);
+    BOOST_CHECK_EQUAL(nNew + nTried, addrman.size());
+    BOOST_CHECK(addrman.size() <= nAdded);
+
+    // Good on an address we don't know changes nothing
+    addrman.Good(CService(IPv4(1, 99, 0, 1), 1945));
+    GetCounts(addrman, nNew, nTried);
+    BOOST_CHECK_EQUAL(nNew + nTried, addrman.size());
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_select)
+{
+    CAddrManTest addrman;
+
+    // Nothing to select from an empty table
+    BOOST_CHECK(addrman.Select().GetPort() == 0);
+
+    std::set<std::string> setAdded;
+    for (int i = 0; i < 50; i++) {
+        CAddress addr = Address(1, 10 + i, 0, 1);
+        addrman.Add(addr, IPv4(2, 1 + i, 0, 1));
+        setAdded.insert(addr.ToStringIPPort());
+    }
+    for (int i = 0; i < 20; i++)
+        addrman.Good(CService(IPv4(1, 10 + i, 0, 1), 1945));
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+
+    // Every selection is from the table, drawing from both new and tried entries
+    std::set<std::string> setSelected;
+    for (int i = 0; i < 500; i++) {
+        CAddress addr = addrman.Select();
+        BOOST_CHECK(setAdded.count(addr.ToStringIPPort()));
+        setSelected.insert(addr.ToStringIPPort());
+    }
+    BOOST_CHECK(setSelected.size() > 1);
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrManTest addrman;
+    for (int i = 0; i < 1000; i++)
+        addrman.Add(Address(1, i % 200, i / 200, 1), IPv4(2, i % 50, 0, 1));
+    for (int i = 0; i < 1000; i += 3)
+        addrman.Good(CService(IPv4(1, i % 200, i / 200, 1), 1945));
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+    int nNew, nTried;
+    GetCounts(addrman, nNew, nTried);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrManTest addrman2;
+    ss >> addrman2;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(addrman2.CheckConsistency(), 0);
+
+    // The same entries in the same tables, at the same positions as they share the key
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    int nNew2, nTried2;
+    GetCounts(addrman2, nNew2, nTried2);
+    BOOST_CHECK_EQUAL(nNew2, nNew);
+    BOOST_CHECK_EQUAL(nTried2, nTried);
+    for (int i = 0; i < 1000; i++) {
+        CNetAddr addr = IPv4(1, i % 200, i / 200, 1);
+        BOOST_CHECK_EQUAL(addrman2.Contains(addr), addrman.Contains(addr));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,88 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for the per-peer block download window
+//
+
+#include "blockencodings.h"
+#include "chainparams.h"
+#include "main.h"
+#include "net.h"
+#include "random.h"
+#include "utiltime.h"
+
+#include <memory>
+
+#include <boost/test/unit_test.hpp>
+
+// Tests these internal-to-main.cpp methods:
+extern int GetDownloadWindow(int64_t nAvgBlockTime);
+extern void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex, std::shared_ptr<PartiallyDownloadedBlock> partialBlock);
+extern void MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom, unsigned int nBlockSize);
+
+static CService DownloadPeer(uint32_t i)
+{
+    struct in_addr s;
+    s.s_addr = i;
+    return CService(CNetAddr(s), Params().GetDefaultPort());
+}
+
+BOOST_AUTO_TEST_SUITE(blockdownload_tests)
+
+BOOST_AUTO_TEST_CASE(download_window)
+{
+    // A peer we haven't measured yet gets the fixed window
+    BOOST_CHECK_EQUAL(GetDownloadWindow(0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Fast peers are capped, slow ones keep a minimum in flight
+    BOOST_CHECK_EQUAL(GetDownloadWindow(1), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetDownloadWindow(10000), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetDownloadWindow(BLOCK_DOWNLOAD_TARGET_TIME * 1000000), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetDownloadWindow(60 * 1000000), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // In between, the window covers BLOCK_DOWNLOAD_TARGET_TIME
+    BOOST_CHECK_EQUAL(GetDownloadWindow(BLOCK_DOWNLOAD_TARGET_TIME * 1000000 / 20), 20);
+    BOOST_CHECK_EQUAL(GetDownloadWindow(BLOCK_DOWNLOAD_TARGET_TIME * 1000000 / 20 + 1), 19);
+}
+
+BOOST_AUTO_TEST_CASE(download_reassign)
+{
+    CNode dummyNodeSlow(INVALID_SOCKET, CAddress(DownloadPeer(0xa0b0c031)), "", true);
+    CNode dummyNodeFast(INVALID_SOCKET, CAddress(DownloadPeer(0xa0b0c032)), "", true);
+    NodeId idSlow = dummyNodeSlow.GetId(), idFast = dummyNodeFast.GetId();
+    CNodeStateStats stats;
+    uint256 hash = GetRandHash();
+
+    LOCK(cs_main);
+    MarkBlockAsInFlight(idSlow, hash, NULL, std::shared_ptr<PartiallyDownloadedBlock>());
+    BOOST_REQUIRE(GetNodeStateStats(idSlow, stats));
+    BOOST_CHECK_EQUAL(stats.nAvgBlockTime, 0);
+
+    // Taking the block over charges the time it waited to the peer that held it
+    MilliSleep(20);
+    MarkBlockAsInFlight(idFast, hash, NULL, std::shared_ptr<PartiallyDownloadedBlock>());
+    BOOST_REQUIRE(GetNodeStateStats(idSlow, stats));
+    BOOST_CHECK(stats.nAvgBlockTime >= 20000);
+    BOOST_CHECK_EQUAL(stats.nBlocksDelivered, 0);
+    BOOST_CHECK_EQUAL(stats.nDownloadWindow, GetDownloadWindow(stats.nAvgBlockTime));
+    BOOST_REQUIRE(GetNodeStateStats(idFast, stats));
+    BOOST_CHECK_EQUAL(stats.nAvgBlockTime, 0);
+
+    // A late copy from the previous holder isn't counted as a delivery
+    MarkBlockAsReceived(hash, idSlow, 1000);
+    BOOST_REQUIRE(GetNodeStateStats(idSlow, stats));
+    BOOST_CHECK_EQUAL(stats.nBlocksDelivered, 0);
+    BOOST_REQUIRE(GetNodeStateStats(idFast, stats));
+    BOOST_CHECK_EQUAL(stats.nBlocksDelivered, 0);
+
+    // Only the peer it was assigned to gets credit for delivering it
+    MarkBlockAsInFlight(idFast, hash, NULL, std::shared_ptr<PartiallyDownloadedBlock>());
+    MarkBlockAsReceived(hash, idFast, 1000);
+    BOOST_REQUIRE(GetNodeStateStats(idFast, stats));
+    BOOST_CHECK_EQUAL(stats.nBlocksDelivered, 1);
+    BOOST_CHECK_EQUAL(stats.nBytesDelivered, 1000U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
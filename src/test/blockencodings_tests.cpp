@@ -0,0 +1,297 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+class CBlockHeaderAndShortTxIDsTester : public CBlockHeaderAndShortTxIDs
+{
+public:
+    CBlockHeaderAndShortTxIDsTester(const CBlock& block) : CBlockHeaderAndShortTxIDs(block) {}
+    CBlockHeaderAndShortTxIDsTester() {}
+
+    const vector<PrefilledTransaction>& Prefilled() const { return prefilledtxn; }
+    vector<PrefilledTransaction>& MutablePrefilled() { return prefilledtxn; }
+};
+
+static CTransaction MakeSpend(int nOutputs = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = 10000LL;
+    }
+    return CTransaction(tx);
+}
+
+/** A block with a coinbase, a coinstake and block signature when fProofOfStake, and nTx spends. */
+static CBlock BuildBlock(unsigned int nTx, bool fProofOfStake)
+{
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = GetTime();
+    block.nBits = 0x207fffff;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << 42 << OP_0;
+    coinbase.vout.resize(1);
+    if (!fProofOfStake)
+        coinbase.vout[0].nValue = 50000LL;
+    block.vtx.push_back(CTransaction(coinbase));
+
+    if (fProofOfStake) {
+        CMutableTransaction coinstake;
+        coinstake.vin.resize(1);
+        coinstake.vin[0].prevout = COutPoint(GetRandHash(), 1);
+        coinstake.vout.resize(2);
+        coinstake.vout[0].SetEmpty();
+        coinstake.vout[1].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        coinstake.vout[1].nValue = 60000LL;
+        block.vtx.push_back(CTransaction(coinstake));
+        block.vchBlockSig.assign(72, 0x5a);
+    }
+
+    for (unsigned int i = 0; i < nTx; i++)
+        block.vtx.push_back(MakeSpend(1 + i % 3));
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(compact_block_relay_between_two_nodes)
+{
+    // The sending node mined the block; the receiving node has all but a few
+    // of its transactions in its mempool. Messages go through serialization so
+    // the bytes on the wire can be compared with relaying the full block.
+    CBlock block = BuildBlock(500, true);
+    CTxMemPool receiverPool(CFeeRate(0));
+    set<unsigned int> setMissing;
+    setMissing.insert(7);
+    setMissing.insert(250);
+    setMissing.insert(501);
+    for (unsigned int i = 2; i < block.vtx.size(); i++)
+        if (!setMissing.count(i))
+            receiverPool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+
+    int64_t nStart = GetTimeMicros();
+
+    // Sender: "cmpctblock"
+    CDataStream ssCmpct(SER_NETWORK, PROTOCOL_VERSION);
+    ssCmpct << CBlockHeaderAndShortTxIDs(block);
+    size_t nCmpctBytes = ssCmpct.size();
+
+    // Receiver: rebuild what it can, "getblocktxn" for the rest
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    ssCmpct >> cmpctblock;
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, receiverPool, vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 2);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), block.vtx.size() - 2 - setMissing.size());
+
+    BlockTransactionsRequest req;
+    req.blockhash = cmpctblock.header.GetHash();
+    req.indexes = partialBlock.GetMissing();
+    BOOST_CHECK(set<unsigned int>(req.indexes.begin(), req.indexes.end()) == setMissing);
+    CDataStream ssReq(SER_NETWORK, PROTOCOL_VERSION);
+    ssReq << req;
+    size_t nReqBytes = ssReq.size();
+
+    // Sender: "blocktxn"
+    BlockTransactionsRequest reqReceived;
+    ssReq >> reqReceived;
+    BOOST_CHECK(reqReceived.indexes == req.indexes);
+    BlockTransactions resp(reqReceived);
+    for (unsigned int i = 0; i < reqReceived.indexes.size(); i++)
+        resp.txn[i] = block.vtx[reqReceived.indexes[i]];
+    CDataStream ssResp(SER_NETWORK, PROTOCOL_VERSION);
+    ssResp << resp;
+    size_t nRespBytes = ssResp.size();
+
+    // Receiver: complete the block
+    BlockTransactions respReceived;
+    ssResp >> respReceived;
+    CBlock rebuilt;
+    BOOST_CHECK(partialBlock.FillBlock(rebuilt, respReceived.txn) == READ_STATUS_OK);
+    int64_t nElapsed = GetTimeMicros() - nStart;
+
+    BOOST_CHECK_EQUAL(rebuilt.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK(rebuilt.vchBlockSig == block.vchBlockSig);
+    BOOST_CHECK_EQUAL(rebuilt.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(rebuilt.vtx[i].GetHash() == block.vtx[i].GetHash());
+
+    // Time a plain block relay for comparison
+    nStart = GetTimeMicros();
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    size_t nBlockBytes = ssBlock.size();
+    CBlock received;
+    ssBlock >> received;
+    int64_t nBlockElapsed = GetTimeMicros() - nStart;
+
+    size_t nCompactTotal = nCmpctBytes + nReqBytes + nRespBytes;
+    BOOST_TEST_MESSAGE(strprintf("compact relay: %u bytes (%u cmpctblock, %u getblocktxn, %u blocktxn) in %dus; full block: %u bytes in %dus",
+        nCompactTotal, nCmpctBytes, nReqBytes, nRespBytes, nElapsed, nBlockBytes, nBlockElapsed));
+    BOOST_CHECK(nCompactTotal * 4 < nBlockBytes);
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_prefills_coinbase_and_coinstake)
+{
+    CBlock blockPoW = BuildBlock(10, false);
+    CBlockHeaderAndShortTxIDsTester cmpctPoW(blockPoW);
+    BOOST_CHECK_EQUAL(cmpctPoW.Prefilled().size(), 1);
+    BOOST_CHECK_EQUAL(cmpctPoW.Prefilled()[0].index, 0);
+    BOOST_CHECK_EQUAL(cmpctPoW.BlockTxCount(), blockPoW.vtx.size());
+
+    CBlock blockPoS = BuildBlock(10, true);
+    CBlockHeaderAndShortTxIDsTester cmpctPoS(blockPoS);
+    BOOST_CHECK_EQUAL(cmpctPoS.Prefilled().size(), 2);
+    BOOST_CHECK_EQUAL(cmpctPoS.Prefilled()[1].index, 1);
+    BOOST_CHECK(cmpctPoS.Prefilled()[1].tx.IsCoinStake());
+
+    // With nothing in the mempool, everything but the prefilled transactions is requested
+    CTxMemPool pool(CFeeRate(0));
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctPoS, pool, vector<CTransaction>()) == READ_STATUS_OK);
+    vector<uint16_t> vMissing = partialBlock.GetMissing();
+    BOOST_CHECK_EQUAL(vMissing.size(), 10);
+    BOOST_CHECK_EQUAL(vMissing.front(), 2);
+
+    // Transactions known outside the mempool, like SwiftTX lock requests, fill slots too
+    vector<CTransaction> vExtraTxn(blockPoS.vtx.begin() + 2, blockPoS.vtx.end());
+    PartiallyDownloadedBlock partialFromExtra;
+    BOOST_CHECK(partialFromExtra.InitData(cmpctPoS, pool, vExtraTxn) == READ_STATUS_OK);
+    BOOST_CHECK(partialFromExtra.GetMissing().empty());
+    BOOST_CHECK_EQUAL(partialFromExtra.GetExtraCount(), 10);
+    CBlock rebuilt;
+    BOOST_CHECK(partialFromExtra.FillBlock(rebuilt, vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(rebuilt.GetHash() == blockPoS.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_bad_data)
+{
+    CBlock block = BuildBlock(5, false);
+    CTxMemPool pool(CFeeRate(0));
+
+    // A prefilled index past the end of the block
+    CBlockHeaderAndShortTxIDsTester cmpctblock(block);
+    cmpctblock.MutablePrefilled()[0].index = block.vtx.size();
+    PartiallyDownloadedBlock partialBadIndex;
+    BOOST_CHECK(partialBadIndex.InitData(cmpctblock, pool, vector<CTransaction>()) == READ_STATUS_INVALID);
+
+    CBlockHeaderAndShortTxIDs cmpctGood(block);
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctGood, pool, vector<CTransaction>()) == READ_STATUS_OK);
+    vector<CTransaction> vMissing(block.vtx.begin() + 1, block.vtx.end());
+    CBlock rebuilt;
+
+    // Too few or too many transactions is the peer's fault
+    vector<CTransaction> vTooFew(vMissing.begin(), vMissing.end() - 1);
+    BOOST_CHECK(partialBlock.FillBlock(rebuilt, vTooFew) == READ_STATUS_INVALID);
+    vector<CTransaction> vTooMany(vMissing);
+    vTooMany.push_back(MakeSpend());
+    BOOST_CHECK(partialBlock.FillBlock(rebuilt, vTooMany) == READ_STATUS_INVALID);
+
+    // The wrong transaction only shows up in the merkle root
+    vector<CTransaction> vWrong(vMissing);
+    vWrong[2] = MakeSpend();
+    BOOST_CHECK(partialBlock.FillBlock(rebuilt, vWrong) == READ_STATUS_FAILED);
+
+    BOOST_CHECK(partialBlock.FillBlock(rebuilt, vMissing) == READ_STATUS_OK);
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_serialization_limits)
+{
+    // More transactions than one read chunk survive a round trip
+    CBlock block = BuildBlock(2500, false);
+    CBlockHeaderAndShortTxIDsTester cmpctblock(block);
+    for (unsigned int i = 1; i < 1200; i++) {
+        PrefilledTransaction prefilled = {(uint16_t)i, block.vtx[i]};
+        cmpctblock.MutablePrefilled().push_back(prefilled);
+    }
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDsTester cmpctblock2;
+    stream >> cmpctblock2;
+    BOOST_CHECK_EQUAL(cmpctblock2.BlockTxCount(), cmpctblock.BlockTxCount());
+    BOOST_CHECK_EQUAL(cmpctblock2.Prefilled().size(), 1200U);
+    BOOST_CHECK_EQUAL(cmpctblock2.Prefilled()[1199].index, 1199);
+    BOOST_CHECK(cmpctblock2.Prefilled()[1199].tx.GetHash() == block.vtx[1199].GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock2.GetShortID(block.vtx[2400].GetHash()), cmpctblock.GetShortID(block.vtx[2400].GetHash()));
+
+    // Counts past the 16 bit index space are rejected before any data is read
+    CDataStream streamHeader(SER_NETWORK, PROTOCOL_VERSION);
+    streamHeader << cmpctblock.header << cmpctblock.vchBlockSig << cmpctblock.nonce;
+
+    CDataStream streamShortIDs(streamHeader);
+    WriteCompactSize(streamShortIDs, 65536);
+    BOOST_CHECK_THROW(streamShortIDs >> cmpctblock2, std::ios_base::failure);
+
+    CDataStream streamPrefilled(streamHeader);
+    WriteCompactSize(streamPrefilled, 1);
+    streamPrefilled << (uint32_t)0 << (uint16_t)0;
+    WriteCompactSize(streamPrefilled, 65535);
+    BOOST_CHECK_THROW(streamPrefilled >> cmpctblock2, std::ios_base::failure);
+
+    // A large count with nothing behind it fails on the missing data
+    CDataStream streamTruncated(streamHeader);
+    WriteCompactSize(streamTruncated, 65535);
+    BOOST_CHECK_THROW(streamTruncated >> cmpctblock2, std::ios_base::failure);
+
+    BlockTransactionsRequest req;
+    CDataStream streamIndexes(SER_NETWORK, PROTOCOL_VERSION);
+    streamIndexes << GetRandHash();
+    WriteCompactSize(streamIndexes, 65536);
+    BOOST_CHECK_THROW(streamIndexes >> req, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(blocktxn_request_serialization)
+{
+    BlockTransactionsRequest req;
+    req.blockhash = GetRandHash();
+    req.indexes.push_back(0);
+    req.indexes.push_back(1);
+    req.indexes.push_back(3);
+    req.indexes.push_back(4000);
+    req.indexes.push_back(65535);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    BOOST_CHECK_EQUAL(stream.size(), GetSerializeSize(req, SER_NETWORK, PROTOCOL_VERSION));
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+    BOOST_CHECK(req2.blockhash == req.blockhash);
+    BOOST_CHECK(req2.indexes == req.indexes);
+
+    // Gaps that run past the 16 bit index space are rejected
+    CDataStream streamBad(SER_NETWORK, PROTOCOL_VERSION);
+    streamBad << req.blockhash;
+    WriteCompactSize(streamBad, 2);
+    WriteCompactSize(streamBad, 65535);
+    WriteCompactSize(streamBad, 0);
+    BOOST_CHECK_THROW(streamBad >> req2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
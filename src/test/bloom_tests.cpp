@@ -8,6 +8,7 @@
 #include "clientversion.h"
 #include "key.h"
 #include "merkleblock.h"
+#include "random.h"
 #include "serialize.h"
 #include "streams.h"
 #include "uint256.h"
@@ -459,4 +460,41 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Remembers at least the last 100 items, 1% fp rate
+    CRollingBloomFilter rb(200, 0.01);
+    std::vector<uint256> vInserted;
+    for (int i = 0; i < 1000; i++) {
+        vInserted.push_back(GetRandHash());
+        rb.insert(vInserted.back());
+    }
+    for (int i = 900; i < 1000; i++)
+        BOOST_CHECK(rb.contains(vInserted[i]));
+
+    // Three generations of 100 are at most in the filter, so the oldest items are gone
+    int nOldHits = 0;
+    for (int i = 0; i < 500; i++)
+        if (rb.contains(vInserted[i]))
+            nOldHits++;
+    BOOST_CHECK(nOldHits < 25);
+
+    int nFalsePositives = 0;
+    for (int i = 0; i < 10000; i++)
+        if (rb.contains(GetRandHash()))
+            nFalsePositives++;
+    BOOST_CHECK(nFalsePositives < 200);
+
+    // Memory is fixed at construction
+    size_t nUsage = rb.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+    rb.reset();
+    BOOST_CHECK_EQUAL(rb.DynamicMemoryUsage(), nUsage);
+    int nHitsAfterReset = 0;
+    for (int i = 900; i < 1000; i++)
+        if (rb.contains(vInserted[i]))
+            nHitsAfterReset++;
+    BOOST_CHECK_EQUAL(nHitsAfterReset, 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
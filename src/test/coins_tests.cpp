@@ -2,9 +2,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "coins.h"
+#include "main.h"
 #include "random.h"
+#include "streams.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "utilstrencodings.h"
 
 #include <vector>
 #include <map>
@@ -16,27 +21,27 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin) && !coin.IsSpent();
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -44,8 +49,11 @@ public:
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                // Same optimization used in CCoinsViewDB is to only write dirty entries.
+                map_[it->first] = it->second.coin;
+            }
+            if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                 // Randomly delete empty entries on write.
                 map_.erase(it->first);
             }
@@ -58,6 +66,22 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coin.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -67,8 +91,8 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
@@ -85,12 +109,12 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool missed_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -102,39 +126,49 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
         // Do a random modification.
         {
-            uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], insecure_rand() % 4); // outpoint we're going to modify in this iteration.
+            Coin& coin = result[outpoint];
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin.out == entry.out);
+            BOOST_CHECK(coin.IsSpent() || (coin.nHeight == entry.nHeight && coin.fCoinStake == entry.fCoinStake));
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                if (coin.IsSpent()) {
                     added_an_entry = true;
                 } else {
                     updated_an_entry = true;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+                newcoin.nHeight = 1 + (insecure_rand() & 0xFFFF);
+                newcoin.fCoinStake = insecure_rand() % 2;
+                bool fPossibleOverwrite = !coin.IsSpent() || insecure_rand() % 2;
+                coin = newcoin;
+                stack.back()->AddCoin(outpoint, std::move(newcoin), fPossibleOverwrite);
             } else {
-                coins.Clear();
-                entry->Clear();
+                coin.Clear();
+                stack.back()->SpendCoin(outpoint);
                 removed_an_entry = true;
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin.out == it->second.out);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(coin.nHeight == it->second.nHeight);
+                    found_an_entry = true;
                 }
             }
+            for (unsigned int j = 0; j < stack.size(); j++) {
+                stack[j]->SelfTest();
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +185,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -175,4 +209,159 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    // Coinstake output at height 203998: b0e57a = VARINT(203998 * 4 + 2)
+    Coin coin(CTxOut(60000000000LL, CScript() << OP_DUP << OP_HASH160 << ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35") << OP_EQUALVERIFY << OP_CHECKSIG), 203998, false, true);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << coin;
+    BOOST_CHECK_EQUAL(HexStr(ss.begin(), ss.end()), "b0e57a835800816115944e077fe7c803cfa57f29b36bf87c1d35");
+
+    Coin coin2;
+    ss >> coin2;
+    BOOST_CHECK(coin2.out == coin.out);
+    BOOST_CHECK_EQUAL(coin2.nHeight, 203998U);
+    BOOST_CHECK(!coin2.IsCoinBase());
+    BOOST_CHECK(coin2.IsCoinStake());
+}
+
+static Coin RandomCoin()
+{
+    CScript script = CScript() << OP_DUP << OP_HASH160 << ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35") << OP_EQUALVERIFY << OP_CHECKSIG;
+    return Coin(CTxOut(1 + insecure_rand() % 1000000, script), 1 + insecure_rand() % 1000, false, false);
+}
+
+static void AddDirty(CCoinsMap& map, const COutPoint& outpoint, const Coin& coin)
+{
+    CCoinsCacheEntry& entry = map[outpoint];
+    entry.coin = coin;
+    entry.flags = CCoinsCacheEntry::DIRTY;
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_staged_writes)
+{
+    CCoinsViewDB db(1 << 20, true);
+    COutPoint outA(GetRandHash(), 0), outB(GetRandHash(), 1);
+    uint256 hashBlock1 = GetRandHash(), hashBlock2 = GetRandHash();
+    Coin coinA = RandomCoin(), coinB = RandomCoin();
+
+    // Staged entries are served to readers before they reach the database,
+    // and the best block marker is only written together with them.
+    CCoinsMap map;
+    AddDirty(map, outA, coinA);
+    db.SetStageWrites(true);
+    BOOST_CHECK(db.BatchWrite(map, hashBlock1));
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(db.HaveCoin(outA));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock1);
+    BOOST_CHECK(db.GetStagedUsage() > 0);
+    uint256 hashOnDisk;
+    BOOST_CHECK(!db.GetDB().Read('H', hashOnDisk));
+
+    // A second flush writes the first one out before staging its own entries.
+    AddDirty(map, outB, coinB);
+    AddDirty(map, outA, Coin());
+    BOOST_CHECK(db.BatchWrite(map, hashBlock2));
+    BOOST_CHECK(db.GetDB().Read('H', hashOnDisk));
+    BOOST_CHECK(hashOnDisk == hashBlock1);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+    // The staged spend hides the written coin.
+    BOOST_CHECK(!db.HaveCoin(outA));
+    Coin coin;
+    BOOST_CHECK(db.GetCoin(outB, coin));
+    BOOST_CHECK(coin.out == coinB.out);
+
+    BOOST_CHECK(db.WriteStaged());
+    BOOST_CHECK_EQUAL(db.GetStagedUsage(), 0U);
+    BOOST_CHECK(db.GetDB().Read('H', hashOnDisk));
+    BOOST_CHECK(hashOnDisk == hashBlock2);
+    BOOST_CHECK(!db.HaveCoin(outA));
+    BOOST_CHECK(db.HaveCoin(outB));
+
+    // Nothing left to write.
+    BOOST_CHECK(db.WriteStaged());
+    db.SetStageWrites(false);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_stats)
+{
+    CCoinsViewDB db(1 << 22, true);
+    uint256 hashBlock = GetRandHash();
+    std::vector<COutPoint> vOutpoints;
+    uint64_t nTransactions = 0, nOutputs = 0;
+    CAmount nTotal = 0;
+    CCoinsMap map;
+    for (int i = 0; i < 500; i++) {
+        uint256 txid = GetRandHash();
+        Coin coin = RandomCoin();
+        unsigned int nOut = 1 + insecure_rand() % 4;
+        for (unsigned int n = 0; n < nOut; n++) {
+            coin.out.nValue = 1 + insecure_rand() % 1000000;
+            AddDirty(map, COutPoint(txid, n), coin);
+            vOutpoints.push_back(COutPoint(txid, n));
+            nTotal += coin.out.nValue;
+        }
+        nTransactions++;
+        nOutputs += nOut;
+    }
+    BOOST_CHECK(db.BatchWrite(map, hashBlock));
+
+    // The txid ranges are fixed, so one thread and many give the same statistics
+    CCoinsStats stats, statsSerial;
+    BOOST_CHECK(db.GetStats(stats, MAX_UTXO_STATS_THREADS));
+    BOOST_CHECK(db.GetStats(statsSerial, 1));
+    BOOST_CHECK(stats.hashBlock == hashBlock);
+    BOOST_CHECK_EQUAL(stats.nTransactions, nTransactions);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, nOutputs);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, nTotal);
+    BOOST_CHECK(statsSerial.hashBlock == stats.hashBlock);
+    BOOST_CHECK_EQUAL(statsSerial.nTransactions, stats.nTransactions);
+    BOOST_CHECK_EQUAL(statsSerial.nTransactionOutputs, stats.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(statsSerial.nSerializedSize, stats.nSerializedSize);
+    BOOST_CHECK_EQUAL(statsSerial.nTotalAmount, stats.nTotalAmount);
+    BOOST_CHECK(statsSerial.hashSerialized == stats.hashSerialized);
+
+    // ...and the same again for an unchanged set
+    CCoinsStats statsAgain;
+    BOOST_CHECK(db.GetStats(statsAgain, 3));
+    BOOST_CHECK(statsAgain.hashSerialized == stats.hashSerialized);
+
+    // Spending one output changes the hash
+    Coin coinSpent;
+    BOOST_CHECK(db.GetCoin(vOutpoints[0], coinSpent));
+    AddDirty(map, vOutpoints[0], Coin());
+    BOOST_CHECK(db.BatchWrite(map, hashBlock));
+    BOOST_CHECK(db.GetStats(statsAgain, 3));
+    BOOST_CHECK_EQUAL(statsAgain.nTransactionOutputs, nOutputs - 1);
+    BOOST_CHECK_EQUAL(statsAgain.nTotalAmount, nTotal - coinSpent.out.nValue);
+    BOOST_CHECK(statsAgain.hashSerialized != stats.hashSerialized);
+}
+
+BOOST_AUTO_TEST_CASE(coins_flush_drains_staged)
+{
+    LOCK(cs_main);
+    COutPoint outA(GetRandHash(), 0), outB(GetRandHash(), 0);
+
+    // Stage one flush, as a background flush would, and leave it unwritten.
+    pcoinsTip->AddCoin(outA, RandomCoin(), false);
+    pcoinsdbview->SetStageWrites(true);
+    BOOST_CHECK(pcoinsTip->Flush());
+    pcoinsdbview->SetStageWrites(false);
+    BOOST_CHECK(pcoinsdbview->GetStagedUsage() > 0);
+
+    // The flush at shutdown writes the staged entries before the cache.
+    pcoinsTip->AddCoin(outB, RandomCoin(), false);
+    FlushStateToDisk();
+    BOOST_CHECK_EQUAL(pcoinsdbview->GetStagedUsage(), 0U);
+    BOOST_CHECK(pcoinsdbview->HaveCoin(outA));
+    BOOST_CHECK(pcoinsdbview->HaveCoin(outB));
+    uint256 hashOnDisk;
+    BOOST_CHECK(pcoinsdbview->GetDB().Read('H', hashOnDisk));
+    BOOST_CHECK(hashOnDisk == pcoinsTip->GetBestBlock());
+
+    pcoinsTip->SpendCoin(outA);
+    pcoinsTip->SpendCoin(outB);
+    FlushStateToDisk();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
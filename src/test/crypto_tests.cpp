@@ -9,6 +9,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 
@@ -109,7 +110,7 @@ BOOST_AUTO_TEST_CASE(sha1_testvectors) {
     TestSHA1(test1, "b7755760681cbfd971451668f32af5774f4656b5");
 }
 
-BOOST_AUTO_TEST_CASE(sha256_testvectors) {
+static void TestSHA256Vectors() {
     TestSHA256("", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
     TestSHA256("abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
     TestSHA256("message digest",
@@ -131,6 +132,61 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256_testvectors) {
+    TestSHA256Vectors();
+}
+
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Compare the (possibly SIMD) batch double-SHA256 against CHash256, for
+    // batch sizes that exercise the 8-way, 4-way and single-hash tails.
+    for (int i = 0; i <= 32; ++i) {
+        std::vector<unsigned char> in(64 * 32), out1(32 * 32), out2(32 * 32);
+        for (unsigned int j = 0; j < in.size(); ++j)
+            in[j] = insecure_rand() & 0xff;
+        for (int j = 0; j < i; ++j)
+            CHash256().Write(&in[64 * j], 64).Finalize(&out1[32 * j]);
+        SHA256D64(&out2[0], &in[0], i);
+        BOOST_CHECK(out1 == out2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_kernels)
+{
+    // Run every kernel this build and CPU have on its own, so one that
+    // SHA256AutoDetect ranks below another still gets tested.
+    std::vector<unsigned char> in(64 * 32), out1(32 * 32);
+    for (unsigned int j = 0; j < in.size(); ++j)
+        in[j] = insecure_rand() & 0xff;
+    BOOST_CHECK_EQUAL(SHA256AutoDetect(sha256_implementation::STANDARD), "standard");
+    for (int j = 0; j < 32; ++j)
+        CHash256().Write(&in[64 * j], 64).Finalize(&out1[32 * j]);
+
+    const struct {
+        sha256_implementation::UseImplementation use;
+        const char* name;
+    } kernels[] = {
+        {sha256_implementation::STANDARD, "standard"},
+        {sha256_implementation::USE_SSE4, "sse41(4way)"},
+        {sha256_implementation::USE_AVX2, "avx2(8way)"},
+        {sha256_implementation::USE_SHANI, "shani(1way)"},
+    };
+    for (unsigned int k = 0; k < ARRAYLEN(kernels); k++) {
+        std::string strName = SHA256AutoDetect(kernels[k].use);
+        if (strName.find(kernels[k].name) == std::string::npos) {
+            BOOST_TEST_MESSAGE(std::string("SHA256 kernel not available: ") + kernels[k].name);
+            continue;
+        }
+        TestSHA256Vectors();
+        for (int i = 0; i <= 32; ++i) {
+            std::vector<unsigned char> out2(32 * 32);
+            SHA256D64(&out2[0], &in[0], i);
+            BOOST_CHECK(std::equal(out2.begin(), out2.begin() + 32 * i, out1.begin()));
+        }
+    }
+    SHA256AutoDetect();
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
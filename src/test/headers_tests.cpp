@@ -0,0 +1,272 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for the header chain kept ahead of the block index
+//
+
+#include "chainparams.h"
+#include "checkpoints.h"
+#include "main.h"
+#include "net.h"
+#include "pow.h"
+#include "util.h"
+
+#include <deque>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+// Tests these internal-to-main.cpp methods:
+extern bool AcceptHeader(const CBlockHeader& header, NodeId nodeid, CValidationState& state);
+extern bool LookupHeader(const uint256& hash, int& nHeight, uint256& nChainWork);
+extern bool FindAnnouncedBlocksToFetch(const uint256& hash, const uint256& hashPrev, std::vector<uint256>& vBlocks);
+extern bool CheckHeadersProgress(int64_t nNow);
+extern void UpdatePeerBestHeader(NodeId nodeid, const uint256& hash);
+extern void FindNextHeaderBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<uint256>& vBlocks, NodeId& nodeStaller);
+extern std::deque<uint256> vBestHeaders;
+extern int nBestHeadersBase;
+
+static CService HeadersPeer(uint32_t i)
+{
+    struct in_addr s;
+    s.s_addr = i;
+    return CService(CNetAddr(s), Params().GetDefaultPort());
+}
+
+static CBlockHeader MakeHeader(const uint256& hashPrev, unsigned int nTime, unsigned int nBits, unsigned int nNonce)
+{
+    CBlockHeader header;
+    header.nVersion = 3;
+    header.hashPrevBlock = hashPrev;
+    header.nTime = nTime;
+    header.nBits = nBits;
+    header.nNonce = nNonce;
+    return header;
+}
+
+/** Chain nCount headers on hashPrev, one a minute from nTime, and accept them from nodeid. */
+static std::vector<CBlockHeader> AcceptChain(NodeId nodeid, const uint256& hashPrev, unsigned int nTime, unsigned int nBits, unsigned int nNonce, int nCount)
+{
+    std::vector<CBlockHeader> vHeaders;
+    uint256 hash = hashPrev;
+    for (int i = 0; i < nCount; i++) {
+        vHeaders.push_back(MakeHeader(hash, nTime + 60 * (i + 1), nBits, nNonce));
+        hash = vHeaders.back().GetHash();
+        CValidationState state;
+        BOOST_REQUIRE(AcceptHeader(vHeaders.back(), nodeid, state));
+    }
+    return vHeaders;
+}
+
+static bool IsKnownHeader(const uint256& hash)
+{
+    int nHeight;
+    uint256 nChainWork;
+    return LookupHeader(hash, nHeight, nChainWork);
+}
+
+BOOST_AUTO_TEST_SUITE(headers_tests)
+
+BOOST_AUTO_TEST_CASE(headers_proof_of_stake)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    int nLastPOWBlock = Params().LAST_POW_BLOCK();
+    ModifiableParams()->setLastPOWBlock(pindexTip->nHeight);
+    Checkpoints::fEnabled = false;
+    int64_t nNow = pindexTip->GetBlockTime() + 30 * 24 * 60 * 60;
+    SetMockTime(nNow);
+
+    CNode dummyNode1(INVALID_SOCKET, CAddress(HeadersPeer(0xa0b0c001)), "", true);
+    CNode dummyNode2(INVALID_SOCKET, CAddress(HeadersPeer(0xa0b0c002)), "", true);
+    CNode dummyNode3(INVALID_SOCKET, CAddress(HeadersPeer(0xa0b0c003)), "", true);
+    unsigned int nTime = pindexTip->nTime;
+    unsigned int nBits = GetNextWorkRequired(pindexTip, nTime + 60, NULL);
+
+    // The difficulty of a header on the block index is checked
+    CValidationState state;
+    int nDoS = 0;
+    BOOST_CHECK(!AcceptHeader(MakeHeader(pindexTip->GetBlockHash(), nTime + 60, nBits + 1, 0), dummyNode1.GetId(), state));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+
+    // Chain A becomes the download chain
+    std::vector<CBlockHeader> vA = AcceptChain(dummyNode1.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 1, 10);
+    BOOST_CHECK_EQUAL(vBestHeaders.size(), 10U);
+    BOOST_CHECK_EQUAL(nBestHeadersBase, pindexTip->nHeight + 1);
+    BOOST_CHECK(vBestHeaders.back() == vA.back().GetHash());
+
+    // Branch B claims far more work past its first header, which can't be checked
+    std::vector<CBlockHeader> vB = AcceptChain(dummyNode2.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 2, 1);
+    std::vector<CBlockHeader> vBRest = AcceptChain(dummyNode2.GetId(), vB[0].GetHash(), nTime + 60, uint256(~uint256(0) >> 64).GetCompact(), 2, 11);
+    vB.insert(vB.end(), vBRest.begin(), vBRest.end());
+    BOOST_CHECK_EQUAL(vBestHeaders.size(), 10U);
+    BOOST_CHECK(vBestHeaders.front() == vA.front().GetHash());
+    BOOST_CHECK(vBestHeaders.back() == vA.back().GetHash());
+
+    // An announcement of B fetches the branch up to it, oldest first
+    std::vector<uint256> vBlocks;
+    BOOST_CHECK(FindAnnouncedBlocksToFetch(vB[3].GetHash(), vB[2].GetHash(), vBlocks));
+    BOOST_REQUIRE_EQUAL(vBlocks.size(), 4U);
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(vBlocks[i] == vB[i].GetHash());
+    vBlocks.clear();
+    BOOST_CHECK(FindAnnouncedBlocksToFetch(pindexTip->GetBlockHash(), pindexTip->GetBlockHeader().hashPrevBlock, vBlocks));
+    BOOST_CHECK(vBlocks.empty());
+
+    // A peer at its header limit only makes room by losing its own headers
+    std::vector<CBlockHeader> vC = AcceptChain(dummyNode3.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 3, MAX_HEADERS_PER_PEER);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptHeader(MakeHeader(vC.back().GetHash(), nTime + 60 * (MAX_HEADERS_PER_PEER + 1), nBits, 3), dummyNode3.GetId(), state));
+    BOOST_CHECK(!state.IsInvalid(nDoS) || nDoS == 0);
+    BOOST_CHECK(!IsKnownHeader(vC.front().GetHash()));
+    BOOST_CHECK(!IsKnownHeader(vC.back().GetHash()));
+    BOOST_CHECK(IsKnownHeader(vB.back().GetHash()));
+    BOOST_CHECK_EQUAL(vBestHeaders.size(), 10U);
+    BOOST_CHECK(vBestHeaders.back() == vA.back().GetHash());
+    AcceptChain(dummyNode3.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 4, 1);
+
+    // A download chain whose blocks never arrive is dropped, and can be started again
+    BOOST_CHECK(!CheckHeadersProgress(nNow + HEADERS_DOWNLOAD_TIMEOUT));
+    BOOST_CHECK(CheckHeadersProgress(nNow + HEADERS_DOWNLOAD_TIMEOUT + 1));
+    BOOST_CHECK(vBestHeaders.empty());
+    BOOST_CHECK(!IsKnownHeader(vA.front().GetHash()));
+    BOOST_CHECK(IsKnownHeader(vB.back().GetHash()));
+    AcceptChain(dummyNode1.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 1, 1);
+    BOOST_CHECK_EQUAL(vBestHeaders.size(), 1U);
+    BOOST_CHECK(vBestHeaders.front() == vA.front().GetHash());
+
+    CheckHeadersProgress(nNow + 2 * HEADERS_DOWNLOAD_TIMEOUT);
+    SetMockTime(0);
+    Checkpoints::fEnabled = true;
+    ModifiableParams()->setLastPOWBlock(nLastPOWBlock);
+}
+
+BOOST_AUTO_TEST_CASE(headers_source_disconnects)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    int nLastPOWBlock = Params().LAST_POW_BLOCK();
+    ModifiableParams()->setLastPOWBlock(pindexTip->nHeight);
+    Checkpoints::fEnabled = false;
+    int64_t nNow = pindexTip->GetBlockTime() + 30 * 24 * 60 * 60;
+    SetMockTime(nNow);
+
+    CNode dummyNodeHonest(INVALID_SOCKET, CAddress(HeadersPeer(0xa0b0c011)), "", true);
+    unsigned int nTime = pindexTip->nTime;
+    unsigned int nBits = GetNextWorkRequired(pindexTip, nTime + 60, NULL);
+    std::vector<CBlockHeader> vX;
+    std::vector<CBlockHeader> vH;
+    {
+        CNode* pnodeSource = new CNode(INVALID_SOCKET, CAddress(HeadersPeer(0xa0b0c012)), "", true);
+        CNode dummyNodeRelay(INVALID_SOCKET, CAddress(HeadersPeer(0xa0b0c013)), "", true);
+
+        // Chain X from one peer becomes the download chain, and the honest branch H waits
+        vX = AcceptChain(pnodeSource->GetId(), pindexTip->GetBlockHash(), nTime, nBits, 5, 10);
+        UpdatePeerBestHeader(pnodeSource->GetId(), vX.back().GetHash());
+        vH = AcceptChain(dummyNodeHonest.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 6, 4);
+        UpdatePeerBestHeader(dummyNodeHonest.GetId(), vH.back().GetHash());
+        BOOST_CHECK_EQUAL(vBestHeaders.size(), 10U);
+        BOOST_CHECK(vBestHeaders.back() == vX.back().GetHash());
+
+        std::vector<uint256> vBlocks;
+        NodeId nodeStaller = -1;
+        FindNextHeaderBlocksToDownload(dummyNodeHonest.GetId(), 16, vBlocks, nodeStaller);
+        BOOST_CHECK(vBlocks.empty());
+
+        // Another peer on X keeps it once its source is gone
+        AcceptChain(dummyNodeRelay.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 5, 6);
+        UpdatePeerBestHeader(dummyNodeRelay.GetId(), vX[5].GetHash());
+        delete pnodeSource;
+        BOOST_CHECK_EQUAL(vBestHeaders.size(), 10U);
+        BOOST_CHECK(IsKnownHeader(vX.front().GetHash()));
+    }
+
+    // With no peer left on X it is dropped at once, not after HEADERS_DOWNLOAD_TIMEOUT
+    BOOST_CHECK(vBestHeaders.empty());
+    BOOST_CHECK(!IsKnownHeader(vX.front().GetHash()));
+    BOOST_CHECK(!IsKnownHeader(vX.back().GetHash()));
+    BOOST_CHECK(IsKnownHeader(vH.back().GetHash()));
+
+    // The honest peer syncs headers again, and its branch gets downloaded
+    AcceptChain(dummyNodeHonest.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 6, 4);
+    UpdatePeerBestHeader(dummyNodeHonest.GetId(), vH.back().GetHash());
+    BOOST_REQUIRE_EQUAL(vBestHeaders.size(), 4U);
+    std::vector<uint256> vBlocks;
+    NodeId nodeStaller = -1;
+    FindNextHeaderBlocksToDownload(dummyNodeHonest.GetId(), 16, vBlocks, nodeStaller);
+    BOOST_REQUIRE_EQUAL(vBlocks.size(), 4U);
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(vBlocks[i] == vH[i].GetHash());
+
+    CheckHeadersProgress(nNow + 2 * HEADERS_DOWNLOAD_TIMEOUT);
+    SetMockTime(0);
+    Checkpoints::fEnabled = true;
+    ModifiableParams()->setLastPOWBlock(nLastPOWBlock);
+}
+
+BOOST_AUTO_TEST_CASE(headers_peers_race)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    int nLastPOWBlock = Params().LAST_POW_BLOCK();
+    ModifiableParams()->setLastPOWBlock(pindexTip->nHeight);
+    Checkpoints::fEnabled = false;
+    int64_t nNow = pindexTip->GetBlockTime() + 30 * 24 * 60 * 60;
+    SetMockTime(nNow);
+
+    CNode dummyNodeSecond(INVALID_SOCKET, CAddress(HeadersPeer(0xa0b0c021)), "", true);
+    unsigned int nTime = pindexTip->nTime;
+    unsigned int nBits = GetNextWorkRequired(pindexTip, nTime + 60, NULL);
+    CNodeStateStats stats;
+    std::vector<CBlockHeader> vY;
+    {
+        CNode* pnodeFirst = new CNode(INVALID_SOCKET, CAddress(HeadersPeer(0xa0b0c022)), "", true);
+
+        // The first peer's chain X wins the race, though its blocks never arrive
+        std::vector<CBlockHeader> vX = AcceptChain(pnodeFirst->GetId(), pindexTip->GetBlockHash(), nTime, nBits, 7, 10);
+        UpdatePeerBestHeader(pnodeFirst->GetId(), vX.back().GetHash());
+        vY = AcceptChain(dummyNodeSecond.GetId(), pindexTip->GetBlockHash(), nTime, nBits, 8, 4);
+        UpdatePeerBestHeader(dummyNodeSecond.GetId(), vY.back().GetHash());
+        BOOST_CHECK(vBestHeaders.back() == vX.back().GetHash());
+
+        // A stalled X gives way to the second peer's branch Y, at the expense of its source
+        BOOST_CHECK(!CheckHeadersProgress(nNow + HEADERS_STALL_TIMEOUT));
+        BOOST_CHECK(CheckHeadersProgress(nNow + HEADERS_STALL_TIMEOUT + 1));
+        BOOST_REQUIRE_EQUAL(vBestHeaders.size(), 4U);
+        BOOST_CHECK(vBestHeaders.back() == vY.back().GetHash());
+        BOOST_CHECK(GetNodeStateStats(pnodeFirst->GetId(), stats));
+        BOOST_CHECK_EQUAL(stats.nMisbehavior, 50);
+
+        std::vector<uint256> vBlocks;
+        NodeId nodeStaller = -1;
+        FindNextHeaderBlocksToDownload(pnodeFirst->GetId(), 16, vBlocks, nodeStaller);
+        BOOST_CHECK(vBlocks.empty());
+        FindNextHeaderBlocksToDownload(dummyNodeSecond.GetId(), 16, vBlocks, nodeStaller);
+        BOOST_REQUIRE_EQUAL(vBlocks.size(), 4U);
+        for (int i = 0; i < 4; i++)
+            BOOST_CHECK(vBlocks[i] == vY[i].GetHash());
+
+        // Extending X doesn't take the download back
+        std::vector<CBlockHeader> vXMore = AcceptChain(pnodeFirst->GetId(), vX.back().GetHash(), nTime + 600, nBits, 7, 1);
+        UpdatePeerBestHeader(pnodeFirst->GetId(), vXMore.back().GetHash());
+        BOOST_CHECK(vBestHeaders.back() == vY.back().GetHash());
+        delete pnodeFirst;
+    }
+
+    // With no branch left to give way to, a stalled Y is dropped after HEADERS_DOWNLOAD_TIMEOUT
+    int64_t nSwitched = nNow + HEADERS_STALL_TIMEOUT + 1;
+    BOOST_CHECK(!CheckHeadersProgress(nSwitched + HEADERS_DOWNLOAD_TIMEOUT));
+    BOOST_CHECK_EQUAL(vBestHeaders.size(), 4U);
+    BOOST_CHECK(CheckHeadersProgress(nSwitched + HEADERS_DOWNLOAD_TIMEOUT + 1));
+    BOOST_CHECK(vBestHeaders.empty());
+    BOOST_CHECK(GetNodeStateStats(dummyNodeSecond.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.nMisbehavior, 100);
+
+    SetMockTime(0);
+    Checkpoints::fEnabled = true;
+    ModifiableParams()->setLastPOWBlock(nLastPOWBlock);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
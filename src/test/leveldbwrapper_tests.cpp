@@ -0,0 +1,148 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "init.h"
+#include "leveldbwrapper.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(leveldbwrapper_tests)
+
+static void SetDBArgs(const std::vector<std::string>& vProfiles, const std::vector<std::string>& vOptions)
+{
+    mapMultiArgs.erase("-dbprofile");
+    mapMultiArgs.erase("-dboption");
+    if (!vProfiles.empty())
+        mapMultiArgs["-dbprofile"] = vProfiles;
+    if (!vOptions.empty())
+        mapMultiArgs["-dboption"] = vOptions;
+}
+
+static bool GetOptions(const std::string& strName, CLevelDBOptions& options)
+{
+    std::string strError;
+    return GetLevelDBOptions(strName, options, strError);
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_profiles)
+{
+    CLevelDBOptions options;
+    BOOST_CHECK_EQUAL(options.strProfile, "default");
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, DEFAULT_LEVELDB_MAX_OPEN_FILES);
+    BOOST_CHECK(!options.fCompression);
+
+    BOOST_CHECK(options.SetProfile("hdd"));
+    BOOST_CHECK_EQUAL(options.strProfile, "hdd");
+    BOOST_CHECK_EQUAL(options.nBlockSize, 65536U);
+    BOOST_CHECK(options.fCompression);
+
+    BOOST_CHECK(!options.SetProfile("fast"));
+    BOOST_CHECK_EQUAL(options.strProfile, "hdd");
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_option_values)
+{
+    CLevelDBOptions options;
+    BOOST_CHECK(options.Set("compression", "1"));
+    BOOST_CHECK(options.fCompression);
+    BOOST_CHECK(!options.Set("compression", "2"));
+    BOOST_CHECK(options.Set("maxopenfiles", "500"));
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, 500);
+    BOOST_CHECK(!options.Set("maxopenfiles", "8"));
+    BOOST_CHECK(options.Set("bloombits", "0"));
+    BOOST_CHECK_EQUAL(options.nBloomBits, 0);
+    BOOST_CHECK(!options.Set("blocksize", "512"));
+    BOOST_CHECK(!options.Set("blockcachepercent", "95"));
+    BOOST_CHECK(!options.Set("cachesize", "100"));
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, 500);
+
+    // Values must be whole numbers
+    BOOST_CHECK(!options.Set("blocksize", "4MB"));
+    BOOST_CHECK(!options.Set("maxopenfiles", "200 "));
+    BOOST_CHECK(!options.Set("bloombits", ""));
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, 500);
+    BOOST_CHECK_EQUAL(options.nBloomBits, 0);
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_args)
+{
+    CLevelDBOptions options;
+
+    // Database specific settings win over the ones for all databases,
+    // and options win over profiles.
+    std::vector<std::string> vProfiles, vOptions;
+    vProfiles.push_back("chainstate:ssd");
+    vProfiles.push_back("hdd");
+    vOptions.push_back("blockindex:maxopenfiles=200");
+    vOptions.push_back("maxopenfiles=100");
+    vOptions.push_back("chainstate:compression=0");
+    SetDBArgs(vProfiles, vOptions);
+
+    BOOST_CHECK(GetOptions("chainstate", options));
+    BOOST_CHECK_EQUAL(options.strProfile, "ssd");
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, 100);
+    BOOST_CHECK(!options.fCompression);
+
+    BOOST_CHECK(GetOptions("blockindex", options));
+    BOOST_CHECK_EQUAL(options.strProfile, "hdd");
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, 200);
+    BOOST_CHECK(options.fCompression);
+
+    BOOST_CHECK(GetOptions("sporks", options));
+    BOOST_CHECK_EQUAL(options.strProfile, "hdd");
+    BOOST_CHECK_EQUAL(options.nMaxOpenFiles, 100);
+
+    // A mistyped database prefix fails for every database.
+    std::string strError;
+    SetDBArgs(std::vector<std::string>(1, "chainstat:ssd"), std::vector<std::string>());
+    BOOST_CHECK(!GetLevelDBOptions("blockindex", options, strError));
+    BOOST_CHECK(strError.find("chainstat") != std::string::npos);
+    SetDBArgs(std::vector<std::string>(), std::vector<std::string>(1, "blocks:bloombits=12"));
+    BOOST_CHECK(!GetOptions("chainstate", options));
+
+    // Unknown profiles and invalid options fail for the databases they apply to.
+    SetDBArgs(std::vector<std::string>(1, "sporks:fast"), std::vector<std::string>());
+    BOOST_CHECK(!GetOptions("sporks", options));
+    SetDBArgs(std::vector<std::string>(), std::vector<std::string>(1, "bloombits"));
+    BOOST_CHECK(!GetOptions("chainstate", options));
+    SetDBArgs(std::vector<std::string>(), std::vector<std::string>(1, "chainstate:blocksize=1"));
+    BOOST_CHECK(!GetOptions("chainstate", options));
+
+    SetDBArgs(std::vector<std::string>(), std::vector<std::string>());
+    BOOST_CHECK(GetOptions("chainstate", options));
+    BOOST_CHECK_EQUAL(options.strProfile, "default");
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_connection_budget)
+{
+    int nDBFD = 0;
+    std::string strError;
+    SetDBArgs(std::vector<std::string>(), std::vector<std::string>());
+    BOOST_CHECK(GetLevelDBExtraFileDescriptors(nDBFD, strError));
+    BOOST_CHECK_EQUAL(nDBFD, 0);
+    BOOST_CHECK_EQUAL(GetMaxConnections(125, 1, nDBFD, 1024), 125);
+
+    // The ssd profile keeps far more files open than FD_SETSIZE allows, which
+    // must only count against the process limit and still leave connections.
+    SetDBArgs(std::vector<std::string>(1, "ssd"), std::vector<std::string>());
+    BOOST_CHECK(GetLevelDBExtraFileDescriptors(nDBFD, strError));
+    BOOST_CHECK_EQUAL(nDBFD, (int)ARRAYLEN(LEVELDB_NAMES) * (1000 - DEFAULT_LEVELDB_MAX_OPEN_FILES));
+    BOOST_CHECK_EQUAL(GetMaxConnections(125, 1, nDBFD, 4096), 125);
+    BOOST_CHECK(GetMaxConnections(125, 1, nDBFD, 3000) > 0);
+    BOOST_CHECK_EQUAL(GetMaxConnections(125, 1, nDBFD, 1024), 0);
+
+    SetDBArgs(std::vector<std::string>(1, "chainstate:ssd"), std::vector<std::string>());
+    BOOST_CHECK(GetLevelDBExtraFileDescriptors(nDBFD, strError));
+    BOOST_CHECK_EQUAL(nDBFD, 1000 - DEFAULT_LEVELDB_MAX_OPEN_FILES);
+    BOOST_CHECK_EQUAL(GetMaxConnections(125, 1, nDBFD, 4096), 125);
+
+    SetDBArgs(std::vector<std::string>(), std::vector<std::string>());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
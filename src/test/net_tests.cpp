@@ -0,0 +1,195 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "net.h"
+#include "random.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(messagebufferpool_reuse)
+{
+    CMessageBufferPool pool;
+    CSerializeData data;
+
+    // An empty pool allocates, rounding up to the size class
+    pool.Get(data, 300);
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK(data.capacity() >= 1024);
+    BOOST_CHECK_EQUAL(pool.GetAllocated(), 1U);
+    BOOST_CHECK_EQUAL(pool.GetReused(), 0U);
+
+    data.resize(300, 'x');
+    const char* pBuffer = data.data();
+    size_t nCapacity = data.capacity();
+    pool.Put(data);
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), nCapacity);
+
+    // The same buffer comes back, cleared, for any size in its class
+    pool.Get(data, 1000);
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK_EQUAL(data.capacity(), nCapacity);
+    BOOST_CHECK(data.data() == pBuffer);
+    BOOST_CHECK_EQUAL(pool.GetReused(), 1U);
+    BOOST_CHECK_EQUAL(pool.GetAllocated(), 1U);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 0U);
+
+    // A request for a larger class doesn't take it
+    pool.Put(data);
+    CSerializeData larger;
+    pool.Get(larger, 2000);
+    BOOST_CHECK(larger.capacity() >= 4096);
+    BOOST_CHECK_EQUAL(pool.GetAllocated(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), nCapacity);
+
+    // Nor does a smaller one
+    CSerializeData smaller;
+    pool.Get(smaller, 24);
+    BOOST_CHECK(smaller.capacity() >= CMessageBufferPool::MIN_CLASS_SIZE);
+    BOOST_CHECK(smaller.capacity() < nCapacity);
+    BOOST_CHECK_EQUAL(pool.GetAllocated(), 3U);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), nCapacity);
+}
+
+BOOST_AUTO_TEST_CASE(messagebufferpool_limits)
+{
+    CMessageBufferPool pool;
+
+    // Buffers below the smallest class are dropped
+    CSerializeData tiny;
+    tiny.reserve(64);
+    pool.Put(tiny);
+    BOOST_CHECK_EQUAL(tiny.capacity(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 0U);
+
+    // Each class keeps at most MAX_CLASS_BYTES on its free list
+    const size_t nClassSize = CMessageBufferPool::MAX_CLASS_SIZE;
+    const size_t nMaxBuffers = CMessageBufferPool::MAX_CLASS_BYTES / nClassSize;
+    std::vector<CSerializeData> vBuffers(nMaxBuffers + 4);
+    for (CSerializeData& buffer : vBuffers)
+        pool.Get(buffer, nClassSize);
+    BOOST_CHECK_EQUAL(pool.GetAllocated(), vBuffers.size());
+    size_t nExpected = 0;
+    for (size_t i = 0; i < vBuffers.size(); i++) {
+        size_t nCapacity = vBuffers[i].capacity();
+        pool.Put(vBuffers[i]);
+        BOOST_CHECK(vBuffers[i].empty());
+        if (i < nMaxBuffers)
+            nExpected += nCapacity;
+        BOOST_CHECK_EQUAL(pool.GetPooledBytes(), nExpected);
+    }
+    BOOST_CHECK(pool.GetPooledBytes() <= CMessageBufferPool::MAX_CLASS_BYTES);
+
+    // Only the pooled buffers are handed out again
+    for (CSerializeData& buffer : vBuffers)
+        pool.Get(buffer, nClassSize);
+    BOOST_CHECK_EQUAL(pool.GetReused(), nMaxBuffers);
+    BOOST_CHECK_EQUAL(pool.GetAllocated(), vBuffers.size() + 4);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 0U);
+
+    // Buffers are charged their capacity, not their class size: only five
+    // 768 KiB buffers fit in the 256 KiB class
+    std::vector<CSerializeData> vLarge(8);
+    for (CSerializeData& buffer : vLarge) {
+        buffer.reserve(768 * 1024);
+        pool.Put(buffer);
+    }
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 5 * 768 * 1024U);
+    pool.Get(vLarge[0], CMessageBufferPool::MAX_CLASS_SIZE);
+    BOOST_CHECK_EQUAL(vLarge[0].capacity(), 768 * 1024U);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 4 * 768 * 1024U);
+
+    // Buffers too large for the largest class are never pooled, since Get
+    // would never hand them out
+    CSerializeData large;
+    large.reserve(CMessageBufferPool::MAX_CLASS_SIZE * 4);
+    pool.Put(large);
+    BOOST_CHECK_EQUAL(large.capacity(), 0U);
+    CSerializeData huge;
+    pool.Get(huge, 20 * 1024 * 1024);
+    BOOST_CHECK(huge.capacity() >= 20 * 1024 * 1024U);
+    pool.Put(huge);
+    BOOST_CHECK_EQUAL(huge.capacity(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetPooledBytes(), 4 * 768 * 1024U);
+}
+
+BOOST_AUTO_TEST_CASE(inventory_known_by_type)
+{
+    CAddress addr(CService(CNetAddr("10.0.0.1"), 1945));
+    CNode dummyNode(INVALID_SOCKET, addr, "", true);
+    uint256 hash = GetRandHash();
+
+    // A known transaction doesn't make its lock request known
+    dummyNode.AddInventoryKnown(CInv(MSG_TX, hash));
+    dummyNode.PushInventory(CInv(MSG_TX, hash));
+    BOOST_CHECK(dummyNode.vInventoryToSend.empty());
+    dummyNode.PushInventory(CInv(MSG_TXLOCK_REQUEST, hash));
+    BOOST_REQUIRE_EQUAL(dummyNode.vInventoryToSend.size(), 1U);
+    BOOST_CHECK_EQUAL(dummyNode.vInventoryToSend[0].type, (int)MSG_TXLOCK_REQUEST);
+
+    dummyNode.AddInventoryKnown(CInv(MSG_TXLOCK_REQUEST, hash));
+    dummyNode.PushInventory(CInv(MSG_TXLOCK_REQUEST, hash));
+    BOOST_CHECK_EQUAL(dummyNode.vInventoryToSend.size(), 1U);
+    BOOST_CHECK(!dummyNode.filterInventoryKnown.contains(CNode::GetInventoryKey(CInv(MSG_BLOCK, hash))));
+}
+
+BOOST_AUTO_TEST_CASE(outbound_target)
+{
+    // Start a fresh cycle well after any bytes other tests may have recorded
+    const int64_t nStart = GetTime() + 2 * MAX_UPLOAD_TIMEFRAME;
+    SetMockTime(nStart);
+    CNode::SetMaxOutboundBlockReserve(1000);
+    const uint64_t nReserve = CNode::GetMaxOutboundCycleReserve();
+    BOOST_CHECK_EQUAL(nReserve, MAX_UPLOAD_TIMEFRAME / Params().TargetSpacing() * 1000);
+    const uint64_t nTarget = 2 * nReserve;
+    CNode::SetMaxOutboundTarget(nTarget);
+    CNode::RecordBytesSent(1);
+    BOOST_CHECK_EQUAL(CNode::GetMaxOutboundTimeLeftInCycle(), MAX_UPLOAD_TIMEFRAME);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+
+    // Historical blocks stop once only the reserve for the rest of the cycle is left
+    CNode::RecordBytesSent(nTarget - nReserve - 2);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    CNode::RecordBytesSent(1);
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nReserve);
+
+    // Halfway through the cycle, only half the reserve is kept back
+    SetMockTime(nStart + MAX_UPLOAD_TIMEFRAME / 2);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    CNode::RecordBytesSent(nReserve / 2);
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+
+    // Everything else stops at the target itself
+    CNode::RecordBytesSent(nReserve / 2 - 1);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    CNode::RecordBytesSent(1);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    // Past the end of the cycle the target holds until the next bytes start a new one
+    SetMockTime(nStart + MAX_UPLOAD_TIMEFRAME + 1);
+    BOOST_CHECK_EQUAL(CNode::GetMaxOutboundTimeLeftInCycle(), 0U);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    CNode::RecordBytesSent(1);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nTarget - 1);
+    BOOST_CHECK_EQUAL(CNode::GetMaxOutboundTimeLeftInCycle(), MAX_UPLOAD_TIMEFRAME);
+
+    CNode::SetMaxOutboundTarget(0);
+    CNode::SetMaxOutboundBlockReserve(DEFAULT_UPLOAD_BLOCK_RESERVE * 1024);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,102 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for the block file scan and ordering done by -reindex
+//
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/test/unit_test.hpp>
+
+// Tests these internal-to-main.cpp methods:
+extern void ScanBlockFile(int nFile, std::vector<CReindexEntry>* pvEntries);
+extern void OrderReindexEntries(const std::vector<CReindexEntry>& vEntries, std::vector<size_t>& vOrder);
+
+static CBlock MakeBlock(const uint256& hashPrev, unsigned int nNonce)
+{
+    CBlock block = Params().GenesisBlock();
+    block.hashPrevBlock = hashPrev;
+    block.nNonce = nNonce;
+    return block;
+}
+
+/** Append a block file record (message start, size, block) and return the position of the block */
+static unsigned int AppendRecord(CDataStream& ss, const CBlock& block)
+{
+    unsigned int nSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    ss.write((const char*)Params().MessageStart(), MESSAGE_START_SIZE);
+    unsigned char vchSize[4];
+    WriteLE32(vchSize, nSize);
+    ss.write((const char*)vchSize, sizeof(vchSize));
+    unsigned int nPos = ss.size();
+    ss << block;
+    return nPos;
+}
+
+BOOST_AUTO_TEST_SUITE(reindex_tests)
+
+BOOST_AUTO_TEST_CASE(reindex_scan_and_order)
+{
+    uint256 hashGenesis = Params().HashGenesisBlock();
+    CBlock block1 = MakeBlock(hashGenesis, 1);
+    CBlock block2 = MakeBlock(block1.GetHash(), 2);
+    CBlock block3 = MakeBlock(block2.GetHash(), 3);
+    CBlock orphan = MakeBlock(GetRandHash(), 4);
+
+    // Blocks out of order, garbage between records, a record claiming more
+    // than MAX_BLOCK_SIZE and a block stored twice.
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    std::vector<unsigned int> vPos;
+    vPos.push_back(AppendRecord(ss, block2));
+    ss.write("garbage", 7);
+    ss.write((const char*)Params().MessageStart(), MESSAGE_START_SIZE);
+    unsigned char vchSize[4];
+    WriteLE32(vchSize, MAX_BLOCK_SIZE + 1);
+    ss.write((const char*)vchSize, sizeof(vchSize));
+    ss << block1.GetBlockHeader();
+    vPos.push_back(AppendRecord(ss, block3));
+    vPos.push_back(AppendRecord(ss, block1));
+    vPos.push_back(AppendRecord(ss, orphan));
+    ss.write("\0\0\0", 3);
+    vPos.push_back(AppendRecord(ss, block1));
+
+    const int nFile = 9998;
+    FILE* file = OpenBlockFile(CDiskBlockPos(nFile, 0));
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+    fclose(file);
+
+    std::vector<CReindexEntry> vEntries;
+    ScanBlockFile(nFile, &vEntries);
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 5U);
+    const CBlock* vBlocks[] = {&block2, &block3, &block1, &orphan, &block1};
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        BOOST_CHECK(vEntries[i].hash == vBlocks[i]->GetHash());
+        BOOST_CHECK(vEntries[i].hashPrev == vBlocks[i]->hashPrevBlock);
+        BOOST_CHECK_EQUAL(vEntries[i].pos.nFile, nFile);
+        BOOST_CHECK_EQUAL(vEntries[i].pos.nPos, vPos[i]);
+    }
+
+    // Parents first, the first copy of block1, and the orphan left out
+    std::vector<size_t> vOrder;
+    OrderReindexEntries(vEntries, vOrder);
+    BOOST_REQUIRE_EQUAL(vOrder.size(), 3U);
+    BOOST_CHECK_EQUAL(vOrder[0], 2U);
+    BOOST_CHECK_EQUAL(vOrder[1], 0U);
+    BOOST_CHECK_EQUAL(vOrder[2], 1U);
+
+    boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -160,6 +160,26 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+BOOST_AUTO_TEST_CASE(sighash_cache_test)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<5000; i++) {
+        int nHashType = insecure_rand();
+        if (i % 2)
+            nHashType = SIGHASH_ALL;
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CTransaction tx(txTo);
+        CTransactionSigHashCache cache(tx);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++)
+            BOOST_CHECK(cache.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, tx, nIn, nHashType));
+    }
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
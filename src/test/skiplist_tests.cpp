@@ -99,4 +99,45 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blockindex_arena_test)
+{
+    CBlockIndexArena arena;
+    std::vector<CBlockIndex*> vIndex;
+
+    // A reservation is served from one contiguous block, each entry on its own cache lines
+    arena.Reserve(10000);
+    for (int i = 0; i < 10000; i++) {
+        CBlockIndex index;
+        index.nHeight = i;
+        index.pprev = (i == 0) ? NULL : vIndex.back();
+        vIndex.push_back(arena.Allocate(index));
+        vIndex.back()->BuildSkip();
+    }
+    size_t nStride = (char*)vIndex[1] - (char*)vIndex[0];
+    BOOST_CHECK(nStride >= sizeof(CBlockIndex) && nStride < sizeof(CBlockIndex) + 64);
+    for (int i = 0; i < 10000; i++) {
+        BOOST_CHECK((char*)vIndex[i] == (char*)vIndex[0] + i * nStride);
+        BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(vIndex[i]) % 64, 0U);
+    }
+
+    // Allocations past the reservation keep earlier entries in place
+    for (int i = 10000; i < 20000; i++) {
+        CBlockIndex index;
+        index.nHeight = i;
+        index.pprev = vIndex.back();
+        vIndex.push_back(arena.Allocate(index));
+        vIndex.back()->BuildSkip();
+    }
+    BOOST_CHECK_EQUAL(arena.Size(), 20000U);
+    for (int i = 0; i < 1000; i++) {
+        int from = insecure_rand() % 20000;
+        int to = insecure_rand() % (from + 1);
+        BOOST_CHECK(vIndex[from]->GetAncestor(to) == vIndex[to]);
+        BOOST_CHECK_EQUAL(vIndex[to]->nHeight, to);
+    }
+
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.Size(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #define BOOST_TEST_MODULE XDNA Test Suite
 
+#include "crypto/sha256.h"
 #include "main.h"
 #include "random.h"
 #include "txdb.h"
@@ -25,11 +26,11 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
 
     TestingSetup() {
+        SHA256AutoDetect();
         SetupEnvironment();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
@@ -67,6 +68,7 @@ struct TestingSetup {
 #endif
         delete pcoinsTip;
         delete pcoinsdbview;
+        pcoinsdbview = NULL;
         delete pblocktree;
 #ifdef ENABLE_WALLET
         bitdb.Flush(true);
@@ -0,0 +1,58 @@
+// Copyright (c) 2017-2020 The XDNA Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for the block checks VerifyDB runs on several threads
+//
+
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+// Tests this internal-to-main.cpp method:
+extern bool CheckBlocksContextFree(const std::vector<CBlockIndex*>& vIndex, int nCheckLevel, unsigned int nThreads, int nProgressSpan, std::string& strError);
+
+BOOST_AUTO_TEST_SUITE(verifydb_tests)
+
+BOOST_AUTO_TEST_CASE(verifydb_parallel_matches_serial)
+{
+    // Copies of the genesis block on disk stand in for the last blocks of a chain, tip first
+    CBlock block = Params().GenesisBlock();
+    uint256 hashGenesis = block.GetHash();
+    std::vector<CBlockIndex> vEntries(40);
+    std::vector<CBlockIndex*> vIndex;
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        CDiskBlockPos pos(9999, 0);
+        BOOST_REQUIRE(WriteBlockToDisk(block, pos));
+        vEntries[i].phashBlock = &hashGenesis;
+        vEntries[i].nHeight = vEntries.size() - i;
+        vEntries[i].nFile = pos.nFile;
+        vEntries[i].nDataPos = pos.nPos;
+        vEntries[i].nStatus = BLOCK_HAVE_DATA;
+        vIndex.push_back(&vEntries[i]);
+    }
+
+    std::string strSerial, strParallel;
+    BOOST_CHECK(CheckBlocksContextFree(vIndex, 0, 1, 100, strSerial));
+    BOOST_CHECK(CheckBlocksContextFree(vIndex, 0, 8, 100, strParallel));
+
+    // Both report the failure nearest the tip, whichever thread finds one first
+    vEntries[30].nStatus = 0;
+    vEntries[7].nDataPos++;
+    BOOST_CHECK(!CheckBlocksContextFree(vIndex, 0, 1, 100, strSerial));
+    for (int i = 0; i < 10; i++) {
+        strParallel.clear();
+        BOOST_CHECK(!CheckBlocksContextFree(vIndex, 0, 8, 100, strParallel));
+        BOOST_CHECK_EQUAL(strParallel, strSerial);
+    }
+    BOOST_CHECK(strSerial.find(strprintf("at %d,", vEntries[7].nHeight)) != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
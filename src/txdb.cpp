@@ -7,59 +7,184 @@
 
 #include "txdb.h"
 
+#include "init.h"
 #include "main.h"
+#include "memusage.h"
 #include "pow.h"
 #include "uint256.h"
 
+#include <algorithm>
+#include <atomic>
+#include <map>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+namespace
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+/** Database key of a single unspent output: 'C' + txid + VARINT(n) */
+struct CoinEntry {
+    char key;
+    uint256 hash;
+    uint32_t n;
+
+    CoinEntry() : key('C'), n(0) {}
+    CoinEntry(const COutPoint& outpoint) : key('C'), hash(outpoint.hash), n(outpoint.n) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(key);
+        READWRITE(hash);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * Legacy per-transaction coins record ('c' + txid), only used to convert a
+ * chainstate written before the UTXO set was keyed by outpoint.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode): bit 1 coinbase, bit 2 coinstake, bit 4 vout[0] unspent,
+ *   bit 8 vout[1] unspent, higher bits the number of non-zero bitvector bytes
+ *   (minus one if neither vout[0] nor vout[1] is unspent)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ */
+class CCoins
+{
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+    int nHeight;
+
+    CCoins() : fCoinBase(false), fCoinStake(false), nHeight(0) {}
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        fCoinStake = (nCode & 2) != 0;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 4) != 0;
+        vAvail[1] = (nCode & 8) != 0;
+        unsigned int nMaskCode = (nCode / 16) + ((nCode & 12) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 {
-    batch.Write('B', hash);
+    batch.Write('H', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, "chainstate"), hashStagedBlock(0), fStaged(false), fStageWrites(false), nStagedUsage(0)
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
+bool CCoinsViewDB::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    {
+        boost::mutex::scoped_lock lock(cs_staged);
+        if (fStaged) {
+            CCoinsMap::const_iterator it = mapStaged.find(outpoint);
+            if (it != mapStaged.end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
+    return db.Read(CoinEntry(outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256& txid) const
+bool CCoinsViewDB::HaveCoin(const COutPoint& outpoint) const
 {
-    return db.Exists(make_pair('c', txid));
+    {
+        boost::mutex::scoped_lock lock(cs_staged);
+        if (fStaged) {
+            CCoinsMap::const_iterator it = mapStaged.find(outpoint);
+            if (it != mapStaged.end())
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return db.Exists(CoinEntry(outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
 {
+    {
+        boost::mutex::scoped_lock lock(cs_staged);
+        if (fStaged && hashStagedBlock != uint256(0))
+            return hashStagedBlock;
+    }
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read('H', hashBestChain))
         return uint256(0);
     return hashBestChain;
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
 {
+    // Whatever was staged before must reach the database first.
+    if (!WriteStaged())
+        return false;
+
+    if (fStageWrites) {
+        boost::mutex::scoped_lock lockWrite(cs_write);
+        boost::mutex::scoped_lock lock(cs_staged);
+        mapStaged.swap(mapCoins);
+        hashStagedBlock = hashBlock;
+        fStaged = true;
+        size_t nUsage = memusage::DynamicUsage(mapStaged);
+        for (CCoinsMap::const_iterator it = mapStaged.begin(); it != mapStaged.end(); ++it)
+            nUsage += it->second.coin.DynamicMemoryUsage();
+        nStagedUsage = nUsage;
+        return true;
+    }
+
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            CoinEntry entry(it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
+            else
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
@@ -69,11 +194,145 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
+bool CCoinsViewDB::WriteStaged()
+{
+    boost::mutex::scoped_lock lockWrite(cs_write);
+    if (!fStaged)
+        return true;
+
+    // Nobody modifies mapStaged without cs_write, so it can be read here
+    // while other threads look entries up under cs_staged.
+    CLevelDBBatch batch;
+    size_t changed = 0;
+    for (CCoinsMap::const_iterator it = mapStaged.begin(); it != mapStaged.end(); ++it) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            CoinEntry entry(it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
+            else
+                batch.Write(entry, it->second.coin);
+            changed++;
+        }
+    }
+    // The best block marker goes in the same batch, so a crash either keeps
+    // the previous consistent state or the new one.
+    if (hashStagedBlock != uint256(0))
+        BatchWriteHashBestChain(batch, hashStagedBlock);
+
+    LogPrint("coindb", "Committing %u staged transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)mapStaged.size());
+    if (!db.WriteBatch(batch))
+        return false;
+
+    CCoinsMap mapWritten;
+    {
+        boost::mutex::scoped_lock lock(cs_staged);
+        mapWritten.swap(mapStaged);
+        hashStagedBlock = uint256(0);
+        fStaged = false;
+        nStagedUsage = 0;
+    }
+    return true;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    int nVersion = 0;
+    if (db.Read('V', nVersion)) {
+        if (nVersion > CHAINSTATE_VERSION)
+            return error("%s : chainstate database version %d is newer than %d", __func__, nVersion, CHAINSTATE_VERSION);
+        // Older versions write their best block under 'B'; if they did, the per-output records are stale.
+        if (db.Exists('B'))
+            return error("%s : chainstate database was modified by an older version, restart with -reindex", __func__);
+    } else {
+        // Before converting anything, move the best block marker to where older
+        // versions don't look for it. They then see an empty chainstate without a
+        // best block and rebuild it, rather than take the converted UTXO set as
+        // theirs and find every output missing.
+        CLevelDBBatch batch;
+        uint256 hashBestChain;
+        if (db.Read('B', hashBestChain)) {
+            batch.Write('H', hashBestChain);
+            batch.Erase('B');
+        }
+        batch.Write('V', CHAINSTATE_VERSION);
+        if (!db.WriteBatch(batch))
+            return false;
+    }
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('c', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid() || pcursor->key().size() == 0 || pcursor->key()[0] != 'c')
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    LogPrintf("Upgrading UTXO database to per-output records...\n");
+    size_t nTxs = 0, nOutputs = 0, nBatch = 0;
+    int nReportDone = 0;
+    CLevelDBBatch batch;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'c')
+                break;
+            uint256 txid;
+            ssKey >> txid;
+            int nPercentageDone = (int)*txid.begin() * 100 / 256;
+            if (nPercentageDone / 10 > nReportDone) {
+                nReportDone = nPercentageDone / 10;
+                LogPrintf("[%d%%]...", nReportDone * 10);
+            }
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins old;
+            ssValue >> old;
+            for (unsigned int i = 0; i < old.vout.size(); i++) {
+                if (!old.vout[i].IsNull() && !old.vout[i].scriptPubKey.IsUnspendable()) {
+                    batch.Write(CoinEntry(COutPoint(txid, i)), Coin(old.vout[i], old.nHeight, old.fCoinBase, old.fCoinStake));
+                    nOutputs++;
+                    nBatch++;
+                }
+            }
+            batch.Erase(make_pair('c', txid));
+            nTxs++;
+            nBatch++;
+            // Each batch converts whole transactions, so an interrupted upgrade
+            // leaves every txid either fully converted or untouched.
+            if (nBatch >= UTXO_UPGRADE_BATCH_ENTRIES) {
+                if (!db.WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                nBatch = 0;
+            }
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    if (!db.WriteBatch(batch))
+        return false;
+    if (ShutdownRequested()) {
+        LogPrintf("[interrupted].\n");
+        return false;
+    }
+    LogPrintf("[DONE].\n");
+    LogPrintf("Converted %u transactions into %u unspent outputs in %dms\n", (unsigned int)nTxs, (unsigned int)nOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, "blockindex")
 {
 }
 
@@ -87,6 +346,21 @@ bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo& info)
     return Write(make_pair('f', nFile), info);
 }
 
+void CBlockTreeDB::WriteBlockIndex(CLevelDBBatch& batch, const CDiskBlockIndex& blockindex)
+{
+    batch.Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
+}
+
+void CBlockTreeDB::WriteBlockFileInfo(CLevelDBBatch& batch, int nFile, const CBlockFileInfo& info)
+{
+    batch.Write(make_pair('f', nFile), info);
+}
+
+void CBlockTreeDB::WriteLastBlockFile(CLevelDBBatch& batch, int nFile)
+{
+    batch.Write('l', nFile);
+}
+
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo& info)
 {
     return Read(make_pair('f', nFile), info);
@@ -116,57 +390,131 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+static void ApplyStats(CCoinsStats& stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
 {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    assert(!outputs.empty());
+    const Coin& first = outputs.begin()->second;
+    ss << hash;
+    ss << VARINT(first.nHeight * 4 + (first.fCoinStake ? 2 : 0) + (first.fCoinBase ? 1 : 0));
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += it->second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
+/** Statistics over the coins whose txid starts with a byte in one GetStats range. */
+struct CCoinsStatsRange {
+    CCoinsStats stats;
+    uint256 hash;
+    string strError;
+};
+
+static void GetStatsRange(const CLevelDBWrapper* pdb, const leveldb::Snapshot* snapshot, unsigned int nBegin, unsigned int nEnd, CCoinsStatsRange* prange)
+{
+    CCoinsStats& stats = prange->stats;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator(snapshot));
+    uint256 hashStart;
+    *hashStart.begin() = nBegin;
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('C', hashStart);
+    pcursor->Seek(ssKeySet.str());
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    // Outputs of one transaction are adjacent in key order; gather them so the
+    // hash commits to whole transactions.
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != 'C')
+                break;
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            CoinEntry key;
+            ssKey >> key;
+            if (*key.hash.begin() >= nEnd)
+                break;
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
+            prevkey = key.hash;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> outputs[key.n];
+            stats.nSerializedSize += slKey.size() + slValue.size();
             pcursor->Next();
         } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            prange->strError = strprintf("Deserialize or I/O error - %s", e.what());
+            return;
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
+    if (!outputs.empty())
+        ApplyStats(stats, ss, prevkey, outputs);
+    prange->hash = ss.GetHash();
+}
+
+static void GetStatsThread(const CLevelDBWrapper* pdb, const leveldb::Snapshot* snapshot, vector<CCoinsStatsRange>* pvRanges, std::atomic<unsigned int>* pnNext)
+{
+    unsigned int nRanges = pvRanges->size();
+    for (unsigned int i = (*pnNext)++; i < nRanges; i = (*pnNext)++)
+        GetStatsRange(pdb, snapshot, 256 * i / nRanges, 256 * (i + 1) / nRanges, &(*pvRanges)[i]);
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+{
+    return GetStats(stats, std::max(1u, std::min(boost::thread::hardware_concurrency(), MAX_UTXO_STATS_THREADS)));
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats& stats, unsigned int nThreads) const
+{
+    // Work from a snapshot, so the result is consistent with the best block
+    // recorded in it even while new flushes reach the database.
+    const leveldb::Snapshot* snapshot = db.GetSnapshot();
+    uint256 hashBlock;
+    if (!db.Read('H', hashBlock, snapshot))
+        hashBlock = uint256(0);
+
+    // Split the coins by the first byte of their txid. The ranges are fixed,
+    // so the combined hash doesn't depend on the number of threads.
+    int64_t nStart = GetTimeMillis();
+    vector<CCoinsStatsRange> vRanges(UTXO_STATS_RANGES);
+    std::atomic<unsigned int> nNext(0);
+    {
+        // The workers use this stack frame, so don't let an interruption end it early.
+        boost::this_thread::disable_interruption di;
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&GetStatsThread, &db, snapshot, &vRanges, &nNext));
+        threads.join_all();
+    }
+    db.ReleaseSnapshot(snapshot);
+    boost::this_thread::interruption_point();
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    stats.hashBlock = hashBlock;
+    ss << stats.hashBlock;
+    for (unsigned int i = 0; i < vRanges.size(); i++) {
+        const CCoinsStatsRange& range = vRanges[i];
+        if (!range.strError.empty())
+            return error("%s : %s", __func__, range.strError);
+        stats.nTransactions += range.stats.nTransactions;
+        stats.nTransactionOutputs += range.stats.nTransactionOutputs;
+        stats.nSerializedSize += range.stats.nSerializedSize;
+        stats.nTotalAmount += range.stats.nTotalAmount;
+        ss << range.hash;
+    }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(stats.hashBlock);
+        stats.nHeight = mi == mapBlockIndex.end() ? 0 : mi->second->nHeight;
+    }
+    LogPrint("coindb", "%s : %u outputs in %dms on %u threads\n", __func__, stats.nTransactionOutputs, GetTimeMillis() - nStart, nThreads);
     return true;
 }
 
@@ -207,69 +555,136 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+/** A block index entry decoded by one of the LoadBlockIndexGuts threads, waiting to be linked. */
+struct CBlockIndexRecord {
+    uint256 hash;
+    uint256 hashPrev;
+    uint256 hashNext;
+    CBlockIndex index;
+};
+
+/**
+ * Decode the block index entries whose hash starts with a byte in
+ * [nBegin, nEnd) into *pvRecords. The decoded entries are complete except
+ * for their map key and chain pointers, which the link phase sets.
+ */
+static void LoadBlockIndexRange(CBlockTreeDB* pdb, unsigned int nBegin, unsigned int nEnd, vector<CBlockIndexRecord>* pvRecords, string* pstrError, std::atomic<bool>* pfFailed)
 {
-    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    try {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator());
 
-    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
-    pcursor->Seek(ssKeySet.str());
+        uint256 hashStart;
+        *hashStart.begin() = nBegin;
+        CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+        ssKeySet << make_pair('b', hashStart);
+        pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
+        for (; pcursor->Valid() && !*pfFailed; pcursor->Next()) {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+            if (chType != 'b')
+                break;
+            uint256 hash;
+            ssKey >> hash;
+            if (*hash.begin() >= nEnd)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            // Entries are keyed by their block hash, so the expensive header hash
+            // only needs recomputing when asked to verify the index.
+            if (fCheckBlockIndexHashes) {
+                uint256 hashHeader = diskindex.GetBlockHash();
+                if (hashHeader != hash) {
+                    *pstrError = strprintf("block index entry %s hashes to %s", hash.ToString(), hashHeader.ToString());
+                    *pfFailed = true;
+                    break;
                 }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            if (diskindex.nHeight <= Params().LAST_POW_BLOCK() && !CheckProofOfWork(hash, diskindex.nBits)) {
+                *pstrError = strprintf("CheckProofOfWork failed: %s", diskindex.ToString());
+                *pfFailed = true;
+                break;
+            }
+
+            pvRecords->push_back(CBlockIndexRecord());
+            CBlockIndexRecord& record = pvRecords->back();
+            record.hash = hash;
+            record.hashPrev = diskindex.hashPrev;
+            record.hashNext = diskindex.hashNext;
+            record.index = diskindex;
         }
+    } catch (std::exception& e) {
+        *pstrError = strprintf("Deserialize or I/O error - %s", e.what());
+        *pfFailed = true;
+    }
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // Decode phase: split the 'b' records by the first byte of their hash and
+    // deserialize the ranges on separate threads, each with its own cursor.
+    unsigned int nThreads = std::max(1u, std::min(boost::thread::hardware_concurrency(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    vector<vector<CBlockIndexRecord> > vRecords(nThreads);
+    vector<string> vError(nThreads);
+    std::atomic<bool> fFailed(false);
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&LoadBlockIndexRange, this, 256 * i / nThreads, 256 * (i + 1) / nThreads, &vRecords[i], &vError[i], &fFailed));
+    threads.join_all();
+
+    if (fFailed) {
+        for (unsigned int i = 0; i < nThreads; i++) {
+            if (!vError[i].empty())
+                return error("%s : %s", __func__, vError[i]);
+        }
+        return false;
+    }
+    int64_t nDecoded = GetTimeMillis();
+
+    // Link phase: place the entries in the arena in height order, so walking
+    // back along pprev and pskip stays within nearby memory. Every entry is
+    // registered under its hash before the chain pointers are resolved, so
+    // InsertBlockIndex only creates placeholders for blocks that really are
+    // missing from the index.
+    vector<pair<int, CBlockIndexRecord*> > vSortedByHeight;
+    for (unsigned int i = 0; i < nThreads; i++) {
+        for (unsigned int j = 0; j < vRecords[i].size(); j++)
+            vSortedByHeight.push_back(make_pair(vRecords[i][j].index.nHeight, &vRecords[i][j]));
+    }
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    size_t nRecords = vSortedByHeight.size();
+    mapBlockIndex.reserve(mapBlockIndex.size() + nRecords);
+    blockIndexArena.Reserve(nRecords);
+    vector<CBlockIndex*> vIndex(nRecords);
+    for (size_t i = 0; i < nRecords; i++) {
+        const CBlockIndexRecord& record = *vSortedByHeight[i].second;
+        CBlockIndex* pindexNew = InsertBlockIndex(record.hash);
+        const uint256* phashBlock = pindexNew->phashBlock;
+        *pindexNew = record.index;
+        pindexNew->phashBlock = phashBlock;
+        vIndex[i] = pindexNew;
+    }
+    for (size_t i = 0; i < nRecords; i++) {
+        const CBlockIndexRecord& record = *vSortedByHeight[i].second;
+        CBlockIndex* pindexNew = vIndex[i];
+        pindexNew->pprev = InsertBlockIndex(record.hashPrev);
+        pindexNew->pnext = InsertBlockIndex(record.hashNext);
+
+        // ppcoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     }
+    boost::this_thread::interruption_point();
 
+    LogPrintf("%s : decoded %u block index entries on %u threads in %dms, linked in %dms\n", __func__,
+        nRecords, nThreads, nDecoded - nStart, GetTimeMillis() - nDecoded);
     return true;
 }
@@ -11,12 +11,14 @@
 #include "leveldbwrapper.h"
 #include "main.h"
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
-class CCoins;
+#include <boost/thread/mutex.hpp>
+
 class uint256;
 
 //! -dbcache default (MiB)
@@ -25,21 +27,63 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! layout of the chainstate database, recorded under 'V': per-output 'C' records, best block under 'H'
+static const int CHAINSTATE_VERSION = 1;
+//! number of records written per batch when upgrading the UTXO database
+static const size_t UTXO_UPGRADE_BATCH_ENTRIES = 100000;
+//! max. number of threads decoding the block index at startup
+static const unsigned int MAX_BLOCK_INDEX_LOAD_THREADS = 16;
+//! number of txid ranges hashed separately for the UTXO set statistics
+static const unsigned int UTXO_STATS_RANGES = 64;
+//! max. number of threads computing the UTXO set statistics
+static const unsigned int MAX_UTXO_STATS_THREADS = 16;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * When staging is enabled, BatchWrite hands its entries over in memory and
+ * returns; they keep being served to readers until WriteStaged() commits
+ * them, together with the best block marker, in a single LevelDB batch.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
 
+    //! Held while staged entries are being written or replaced
+    boost::mutex cs_write;
+    //! Held while mapStaged is looked up or cleared
+    mutable boost::mutex cs_staged;
+    CCoinsMap mapStaged;
+    uint256 hashStagedBlock;
+    bool fStaged;
+    bool fStageWrites;
+    //! Memory held by mapStaged, counted against the same -dbcache limit as the coins cache
+    std::atomic<size_t> nStagedUsage;
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    //! GetStats on nThreads threads; the result doesn't depend on their number
+    bool GetStats(CCoinsStats& stats, unsigned int nThreads) const;
+
+    //! Convert per-transaction coin records ('c') into per-output ones ('C') and record CHAINSTATE_VERSION
+    bool Upgrade();
+
+    //! The underlying database, for statistics
+    const CLevelDBWrapper& GetDB() const { return db; }
+
+    //! Make BatchWrite stage its entries for WriteStaged() instead of writing them
+    void SetStageWrites(bool fStage) { fStageWrites = fStage; }
+    //! Write the entries staged by BatchWrite, if any. Safe to call from any thread.
+    bool WriteStaged();
+    //! Memory used by entries staged and not yet written
+    size_t GetStagedUsage() const { return nStagedUsage; }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -58,6 +102,10 @@ public:
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo& fileinfo);
     bool ReadLastBlockFile(int& nFile);
     bool WriteLastBlockFile(int nFile);
+    //! Queue the same records onto a batch, to be written later with WriteBatch
+    void WriteBlockIndex(CLevelDBBatch& batch, const CDiskBlockIndex& blockindex);
+    void WriteBlockFileInfo(CLevelDBBatch& batch, int nFile, const CBlockFileInfo& fileinfo);
+    void WriteLastBlockFile(CLevelDBBatch& batch, int nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool& fReindex);
     bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
@@ -12,18 +12,19 @@
 
 /** Undo information for a CTxIn
  *
- *  Contains the prevout's CTxOut being spent, and if this was the
- *  last output of the affected transaction, its metadata as well
- *  (coinbase or not, height, transaction version)
+ *  Contains the prevout's CTxOut being spent and its metadata (coinbase
+ *  or coinstake, height). Records written before the UTXO set was kept
+ *  per output only carry the metadata for the last spent output of a
+ *  transaction and have nHeight == 0 otherwise.
  */
 class CTxInUndo
 {
 public:
     CTxOut txout;   // the txout data before being spent
-    bool fCoinBase; // if the outpoint was the last unspent: whether it belonged to a coinbase
-    bool fCoinStake;
-    unsigned int nHeight; // if the outpoint was the last unspent: its height
-    int nVersion;         // if the outpoint was the last unspent: its version
+    bool fCoinBase; // whether it belonged to a coinbase
+    bool fCoinStake; // whether it belonged to a coinstake
+    unsigned int nHeight; // the height of the containing transaction
+    int nVersion;         // unused; kept for the serialization format
 
     CTxInUndo() : txout(), fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0) {}
     CTxInUndo(const CTxOut& txoutIn, bool fCoinBaseIn = false, bool fCoinStakeIn = false, unsigned int nHeightIn = 0, int nVersionIn = 0) : txout(txoutIn), fCoinBase(fCoinBaseIn), fCoinStake(fCoinStakeIn), nHeight(nHeightIn), nVersion(nVersionIn) {}
@@ -252,9 +252,19 @@ bool LogAcceptCategory(const char* category)
     return true;
 }
 
+//! Set on threads whose log lines are dropped, see SuppressThreadLog
+static thread_local bool fThreadLogSuppressed = false;
+
+void SuppressThreadLog(bool fSuppress)
+{
+    fThreadLogSuppressed = fSuppress;
+}
+
 int LogPrintStr(const std::string& str)
 {
     int ret = 0; // Returns total number of characters written
+    if (fThreadLogSuppressed)
+        return ret;
     if (fPrintToConsole) {
         // print to console
         ret = fwrite(str.data(), 1, str.size(), stdout);
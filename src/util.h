@@ -63,6 +63,8 @@ void SetupEnvironment();
 bool LogAcceptCategory(const char* category);
 /** Send a string to the log output */
 int LogPrintStr(const std::string& str);
+/** Drop the log lines the calling thread writes while fSuppress is set */
+void SuppressThreadLog(bool fSuppress);
 
 #define LogPrintf(...) LogPrint(NULL, __VA_ARGS__)
 
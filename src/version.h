@@ -13,7 +13,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70016;
+static const int PROTOCOL_VERSION = 70018;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -39,5 +39,11 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" are understood starting with this version
+static const int COMPACT_BLOCKS_VERSION = 70017;
+
+//! "getheaders" is answered with headers and "sendheaders" is understood starting with this version
+static const int HEADERS_FIRST_VERSION = 70018;
+
 
 #endif // BITCOIN_VERSION_H